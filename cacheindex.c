@@ -0,0 +1,662 @@
+/*
+ * Copyright 2006-2019 Niklas Edmundsson <nikke@acc.umu.se>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Shared memory index of the cache state of backend files.
+
+   The index is a fixed size open addressing hash table in a file mmap:ed
+   by all processes using the cache, keyed on backend device:inode. Each
+   slot is protected by a seqlock so readers never block and never take a
+   lock; writers grab the slot by making the sequence number odd.
+
+   Everything in here is a hint. A hit is always validated against the
+   size/mtime of the backend file, and a missing/stale cache file is
+   detected by the regular code paths, so losing an update (crashed
+   process, full table) only costs us a cache probe.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <sched.h>
+#include <time.h>
+#ifdef __linux
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif /* __linux */
+
+typedef enum cacheindex_state {
+    CACHEINDEX_UNKNOWN = 0,     /* No (valid) entry, must probe the cache */
+    CACHEINDEX_ABSENT,          /* Not cached */
+    CACHEINDEX_COPYING,         /* Being copied into the cache */
+    CACHEINDEX_COMPLETE         /* Completely cached */
+} cacheindex_state;
+
+#ifdef USE_CACHEINDEX
+
+#define CACHEINDEX_MAGIC        0x48434958 /* HCIX */
+#define CACHEINDEX_INITMAGIC    0x48434900
+#define CACHEINDEX_VERSION      5
+
+typedef struct cacheindex_hdr_t {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    nslots;
+    uint32_t    entsize;
+    char        pad[48];
+} cacheindex_hdr_t;
+
+typedef struct cacheindex_entry_t {
+    uint32_t    seq;            /* Seqlock, odd while being updated */
+    uint32_t    state;          /* cacheindex_state */
+    uint64_t    dev;            /* Backend device */
+    uint64_t    ino;            /* Backend inode */
+    int64_t     size;           /* Backend size */
+    int64_t     mtime;          /* Backend mtime */
+    int64_t     updated;        /* time() of last update */
+
+    /* Copy progress, updated outside of the seqlock */
+    int64_t     progress;       /* Bytes in cached file */
+    uint32_t    wakeseq;        /* Futex, bumped on progress */
+    uint32_t    waiters;        /* Number of processes waiting on wakeseq */
+    int64_t     want[CACHEINDEX_WANTS]; /* offset+1 readers are blocked on,
+                                           0 if unused */
+    int64_t     readtime;       /* time() someone last read the file while
+                                   it's being copied */
+} __attribute__((aligned(64))) cacheindex_entry_t;
+
+static cacheindex_hdr_t     *cacheindex;
+static cacheindex_entry_t   *cacheindex_slots;
+static int                   cacheindex_tried;
+
+#define CACHEINDEX_MAPSIZE  (sizeof(cacheindex_hdr_t) + \
+                             CACHEINDEX_SLOTS * sizeof(cacheindex_entry_t))
+
+/* Map the index. When create is set (copyd) it's created if needed, and
+   an index with a different layout is thrown away and recreated,
+   otherwise we just go on without an index. The index lives in a world
+   writable directory, so it's only used if it's a plain file of our own
+   that nobody else can write to. */
+static int cacheindex_init(int (*openfunc)(const char *, int, ...),
+                           int (*fstat64func)(int filedes, struct stat64 *buf),
+                           int (*closefunc)(int fd), int create)
+{
+    int                 fd, i, retried = 0;
+    struct stat64       st;
+    cacheindex_hdr_t    *hdr;
+    uint32_t            magic;
+
+    if(cacheindex_tried) {
+        return cacheindex ? 0 : -1;
+    }
+    cacheindex_tried = 1;
+
+again:
+    fd = -1;
+    if(create) {
+        fd = openfunc(CACHEINDEX_PATH, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+                      S_IRUSR | S_IWUSR);
+        if(fd != -1) {
+            /* Ours, don't let the umask have a say */
+            fchmod(fd, S_IRUSR | S_IWUSR);
+        }
+    }
+    if(fd == -1 && (!create || errno == EEXIST)) {
+        fd = openfunc(CACHEINDEX_PATH, O_RDWR | O_NOFOLLOW);
+    }
+    if(fd == -1) {
+#ifdef DEBUG
+        perror("cacheindex_init: open");
+#endif
+        return -1;
+    }
+
+    if(fstat64func(fd, &st) == -1) {
+        closefunc(fd);
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_nlink != 1 || st.st_uid != geteuid() ||
+            (st.st_mode & 07777) != (S_IRUSR | S_IWUSR))
+    {
+#ifdef DEBUG
+        fprintf(stderr, "cacheindex_init: %s not a 0600 file of ours\n",
+                CACHEINDEX_PATH);
+#endif
+        closefunc(fd);
+        if(create && !retried) {
+            /* Fails if it's someone else's in a sticky /dev/shm, in which
+               case the O_EXCL open fails and we do without */
+            retried = 1;
+            unlink(CACHEINDEX_PATH);
+            goto again;
+        }
+        return -1;
+    }
+    if(st.st_size < (off64_t) CACHEINDEX_MAPSIZE) {
+        /* New index, or someone is initializing it right now. Extending
+           it to the same size twice is harmless. */
+        if(ftruncate(fd, CACHEINDEX_MAPSIZE) == -1) {
+#ifdef DEBUG
+            perror("cacheindex_init: ftruncate");
+#endif
+            closefunc(fd);
+            return -1;
+        }
+    }
+
+    hdr = mmap(NULL, CACHEINDEX_MAPSIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    closefunc(fd);
+    if(hdr == MAP_FAILED) {
+#ifdef DEBUG
+        perror("cacheindex_init: mmap");
+#endif
+        return -1;
+    }
+
+    magic = 0;
+    if(__atomic_compare_exchange_n(&hdr->magic, &magic, CACHEINDEX_INITMAGIC,
+                                   0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        /* We won the race to initialize the index */
+        hdr->version = CACHEINDEX_VERSION;
+        hdr->nslots = CACHEINDEX_SLOTS;
+        hdr->entsize = sizeof(cacheindex_entry_t);
+        __atomic_store_n(&hdr->magic, CACHEINDEX_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    for(i=0; i<1000; i++) {
+        magic = __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE);
+        if(magic != CACHEINDEX_INITMAGIC) {
+            break;
+        }
+        sched_yield();
+    }
+
+    if(magic != CACHEINDEX_MAGIC || hdr->version != CACHEINDEX_VERSION ||
+            hdr->nslots != CACHEINDEX_SLOTS ||
+            hdr->entsize != sizeof(cacheindex_entry_t))
+    {
+#ifdef DEBUG
+        fprintf(stderr, "cacheindex_init: Index layout mismatch\n");
+#endif
+        munmap(hdr, CACHEINDEX_MAPSIZE);
+        if(create && !retried) {
+            retried = 1;
+            unlink(CACHEINDEX_PATH);
+            goto again;
+        }
+        return -1;
+    }
+
+    cacheindex_slots = (cacheindex_entry_t *) (hdr + 1);
+    cacheindex = hdr;
+
+    return 0;
+}
+
+
+static inline uint32_t cacheindex_hashkey(uint64_t dev, uint64_t ino) {
+    uint64_t h = (dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (uint32_t) h;
+}
+
+
+/* Consistent snapshot of a slot. Returns 0 on success, -1 if the slot is
+   busy being updated */
+static int cacheindex_read(cacheindex_entry_t *slot, cacheindex_entry_t *ent)
+{
+    uint32_t    seq;
+    int         i;
+
+    for(i=0; i<4; i++) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            continue;
+        }
+        ent->state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+        ent->dev = __atomic_load_n(&slot->dev, __ATOMIC_RELAXED);
+        ent->ino = __atomic_load_n(&slot->ino, __ATOMIC_RELAXED);
+        ent->size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+        ent->mtime = __atomic_load_n(&slot->mtime, __ATOMIC_RELAXED);
+        ent->updated = __atomic_load_n(&slot->updated, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Find the most recently updated slot for dev:ino. Returns the slot, and
+   a snapshot of it in ent, or NULL if not found */
+static cacheindex_entry_t *cacheindex_find(uint64_t dev, uint64_t ino,
+                                           cacheindex_entry_t *ent)
+{
+    cacheindex_entry_t  tmp, *slot, *found = NULL;
+    uint32_t            h, i;
+
+    h = cacheindex_hashkey(dev, ino);
+    for(i=0; i<CACHEINDEX_PROBES; i++) {
+        slot = &cacheindex_slots[(h + i) & (CACHEINDEX_SLOTS - 1)];
+        if(cacheindex_read(slot, &tmp) == -1) {
+            continue;
+        }
+        if(tmp.state == CACHEINDEX_UNKNOWN) {
+            /* Slots are never emptied, so nothing beyond this one */
+            break;
+        }
+        if(tmp.dev != dev || tmp.ino != ino) {
+            continue;
+        }
+        if(!found || tmp.updated > ent->updated) {
+            found = slot;
+            memcpy(ent, &tmp, sizeof(tmp));
+        }
+    }
+
+    return found;
+}
+
+
+/* Look up the cache state of realst. If a matching entry is found and ent
+   is non-NULL a snapshot of it is stored there. Entries for another
+   version of the backend file, and copies that seem to have died, are
+   reported as CACHEINDEX_UNKNOWN. */
+static int cacheindex_lookup(struct stat64 *realst, cacheindex_entry_t *ent)
+{
+    cacheindex_entry_t  tmp;
+
+    if(!cacheindex) {
+        return CACHEINDEX_UNKNOWN;
+    }
+
+    if(ent == NULL) {
+        ent = &tmp;
+    }
+
+    if(!cacheindex_find(realst->st_dev, realst->st_ino, ent)) {
+        return CACHEINDEX_UNKNOWN;
+    }
+
+    if(ent->size != realst->st_size || ent->mtime != realst->st_mtime) {
+        return CACHEINDEX_UNKNOWN;
+    }
+
+    if(ent->state == CACHEINDEX_COPYING &&
+            ent->updated < time(NULL) - CACHE_UPDATE_TIMEOUT)
+    {
+        return CACHEINDEX_UNKNOWN;
+    }
+
+    return ent->state;
+}
+
+
+/* Wake up everyone waiting for progress in slot */
+static void cacheindex_wake(cacheindex_entry_t *slot) {
+
+    __atomic_add_fetch(&slot->wakeseq, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&slot->waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &slot->wakeseq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+
+/* Record the cache state of realst. If weak is set a fresh
+   CACHEINDEX_COPYING entry is left alone, used when a cache probe comes up
+   empty since the probe might have raced with the copy starting up.
+   Returns the slot used, or NULL. */
+static cacheindex_entry_t *cacheindex_set(struct stat64 *realst, int state,
+                                          int weak)
+{
+    cacheindex_entry_t  tmp, *slot, *victim = NULL;
+    int64_t             victimupdated = 0;
+    uint64_t            dev = realst->st_dev, ino = realst->st_ino;
+    uint32_t            h, i, seq;
+    time_t              now = time(NULL);
+
+    if(!cacheindex) {
+        return NULL;
+    }
+
+    slot = cacheindex_find(dev, ino, &tmp);
+    if(slot) {
+        if(weak && tmp.state == CACHEINDEX_COPYING &&
+                tmp.size == realst->st_size && tmp.mtime == realst->st_mtime &&
+                tmp.updated >= now - CACHE_UPDATE_TIMEOUT)
+        {
+            return slot;
+        }
+    }
+    else {
+        /* Pick an empty slot, or evict the least recently updated one */
+        h = cacheindex_hashkey(dev, ino);
+        for(i=0; i<CACHEINDEX_PROBES; i++) {
+            slot = &cacheindex_slots[(h + i) & (CACHEINDEX_SLOTS - 1)];
+            if(cacheindex_read(slot, &tmp) == -1) {
+                continue;
+            }
+            if(tmp.state == CACHEINDEX_UNKNOWN) {
+                victim = slot;
+                break;
+            }
+            if(!victim || tmp.updated < victimupdated) {
+                victim = slot;
+                victimupdated = tmp.updated;
+            }
+        }
+        slot = victim;
+        if(!slot) {
+            return NULL;
+        }
+    }
+
+    /* Someone else updating it is no reason to drop ours, theirs might be
+       the state we're moving on from. Updates are a handful of stores,
+       only a writer that died halfway keeps it busy for good. */
+    for(i=0; ; i++) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        if(!(seq & 1) &&
+                __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        if(i >= 1000) {
+            return NULL;
+        }
+        sched_yield();
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if(__atomic_load_n(&slot->dev, __ATOMIC_RELAXED) != dev ||
+            __atomic_load_n(&slot->ino, __ATOMIC_RELAXED) != ino)
+    {
+        /* New key in this slot */
+        __atomic_store_n(&slot->progress, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->readtime, 0, __ATOMIC_RELAXED);
+        for(i=0; i<CACHEINDEX_WANTS; i++) {
+            __atomic_store_n(&slot->want[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_store_n(&slot->state, state, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->dev, dev, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->ino, ino, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->size, realst->st_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->mtime, realst->st_mtime, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->updated, now, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+    /* Let waiters have a look at the new state */
+    cacheindex_wake(slot);
+
+    return slot;
+}
+
+
+/* TRUE if slot is non-NULL and holds realst, the slot may have been
+   taken over by another file or version since it was looked up */
+static inline int cacheindex_slotmatch(cacheindex_entry_t *slot,
+                                       struct stat64 *realst)
+{
+    return slot &&
+        __atomic_load_n(&slot->dev, __ATOMIC_RELAXED) ==
+            (uint64_t) realst->st_dev &&
+        __atomic_load_n(&slot->ino, __ATOMIC_RELAXED) ==
+            (uint64_t) realst->st_ino &&
+        __atomic_load_n(&slot->size, __ATOMIC_RELAXED) ==
+            (int64_t) realst->st_size &&
+        __atomic_load_n(&slot->mtime, __ATOMIC_RELAXED) ==
+            (int64_t) realst->st_mtime;
+}
+
+
+/* The slot currently holding realst, or NULL */
+static inline cacheindex_entry_t *cacheindex_getslot(struct stat64 *realst) {
+    cacheindex_entry_t  tmp, *slot;
+
+    if(!cacheindex) {
+        return NULL;
+    }
+
+    slot = cacheindex_find(realst->st_dev, realst->st_ino, &tmp);
+    if(!slot || tmp.size != (int64_t) realst->st_size ||
+            tmp.mtime != (int64_t) realst->st_mtime)
+    {
+        /* Another version's */
+        return NULL;
+    }
+
+    return slot;
+}
+
+
+/* Publish that the cached copy of realst now holds done bytes, and wake
+   up anyone waiting for it */
+static void cacheindex_progress(cacheindex_entry_t *slot,
+                                struct stat64 *realst, off64_t done)
+{
+    if(!cacheindex_slotmatch(slot, realst)) {
+        return;
+    }
+
+    __atomic_store_n(&slot->progress, done, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->updated, time(NULL), __ATOMIC_RELAXED);
+    cacheindex_wake(slot);
+}
+
+
+/* Ask the copy of realst to fetch the data at off out of order, since
+   we're blocked waiting for it. Readers share a few want slots, so a want
+   might get overwritten by someone else. That's fine as long as the
+   blocked readers keep repeating theirs. */
+static inline void cacheindex_want(cacheindex_entry_t *slot,
+                                   struct stat64 *realst, off64_t off)
+{
+    if(!cacheindex_slotmatch(slot, realst)) {
+        return;
+    }
+
+    __atomic_store_n(&slot->want[getpid() % CACHEINDEX_WANTS], off + 1,
+                     __ATOMIC_RELAXED);
+}
+
+
+/* Returns the offset wanted in want slot i, or -1 if none */
+static inline off64_t cacheindex_wanted(cacheindex_entry_t *slot, int i) {
+    int64_t want;
+
+    if(!slot) {
+        return -1;
+    }
+    want = __atomic_load_n(&slot->want[i], __ATOMIC_RELAXED);
+
+    return want - 1;
+}
+
+
+/* The want for off in slot i is taken care of. Leaves it alone if someone
+   has replaced it with a new one. */
+static inline void cacheindex_wantdone(cacheindex_entry_t *slot, int i,
+                                       off64_t off)
+{
+    int64_t want = off + 1;
+
+    if(!slot) {
+        return;
+    }
+    __atomic_compare_exchange_n(&slot->want[i], &want, 0, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+/* Tell the copy of realst that someone is still reading the file, now
+   being time() */
+static inline void cacheindex_reading(cacheindex_entry_t *slot,
+                                      struct stat64 *realst, time_t now)
+{
+    if(!cacheindex_slotmatch(slot, realst)) {
+        return;
+    }
+
+    /* Readers all over, don't bounce the cache line more than needed */
+    if(__atomic_load_n(&slot->readtime, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&slot->readtime, now, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* time() the file of realst was last read, 0 if never and -1 if slot
+   isn't realst:s (anymore) so there's no telling */
+static inline time_t cacheindex_readtime(cacheindex_entry_t *slot,
+                                         struct stat64 *realst)
+{
+    if(!cacheindex_slotmatch(slot, realst)) {
+        return -1;
+    }
+
+    return __atomic_load_n(&slot->readtime, __ATOMIC_RELAXED);
+}
+
+
+/* Call before checking whether the wait condition is fulfilled, pass the
+   result to cacheindex_wait() */
+static inline uint32_t cacheindex_waitseq(cacheindex_entry_t *slot) {
+
+    if(!slot) {
+        return 0;
+    }
+
+    return __atomic_load_n(&slot->wakeseq, __ATOMIC_SEQ_CST);
+}
+
+
+/* Sleep until progress is published in slot or timeout ms has passed.
+   Without a slot we simply sleep. */
+static inline void cacheindex_wait(cacheindex_entry_t *slot, uint32_t seq,
+                            int timeout)
+{
+    struct timespec     delay;
+
+    delay.tv_sec = timeout / 1000;
+    delay.tv_nsec = (timeout % 1000) * 1000000;
+
+    if(!slot) {
+        nanosleep(&delay, NULL);
+        return;
+    }
+
+    __atomic_add_fetch(&slot->waiters, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &slot->wakeseq, FUTEX_WAIT, seq, &delay, NULL, 0);
+    __atomic_sub_fetch(&slot->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+#else /* USE_CACHEINDEX */
+
+typedef struct cacheindex_entry_t {
+    uint32_t    state;
+} cacheindex_entry_t;
+
+static int cacheindex_init(int (*openfunc)(const char *, int, ...),
+                           int (*fstat64func)(int filedes, struct stat64 *buf),
+                           int (*closefunc)(int fd), int create)
+{
+    (void) openfunc; (void) fstat64func; (void) closefunc; (void) create;
+    return -1;
+}
+
+static int cacheindex_lookup(struct stat64 *realst, cacheindex_entry_t *ent)
+{
+    (void) realst; (void) ent;
+    return CACHEINDEX_UNKNOWN;
+}
+
+static cacheindex_entry_t *cacheindex_set(struct stat64 *realst, int state,
+                                          int weak)
+{
+    (void) realst; (void) state; (void) weak;
+    return NULL;
+}
+
+static inline cacheindex_entry_t *cacheindex_getslot(struct stat64 *realst) {
+    (void) realst;
+    return NULL;
+}
+
+static void cacheindex_progress(cacheindex_entry_t *slot,
+                                struct stat64 *realst, off64_t done)
+{
+    (void) slot; (void) realst; (void) done;
+}
+
+static inline void cacheindex_want(cacheindex_entry_t *slot,
+                                   struct stat64 *realst, off64_t off)
+{
+    (void) slot; (void) realst; (void) off;
+}
+
+static inline off64_t cacheindex_wanted(cacheindex_entry_t *slot, int i) {
+    (void) slot; (void) i;
+    return -1;
+}
+
+static inline void cacheindex_wantdone(cacheindex_entry_t *slot, int i,
+                                       off64_t off)
+{
+    (void) slot; (void) i; (void) off;
+}
+
+static inline uint32_t cacheindex_waitseq(cacheindex_entry_t *slot) {
+    (void) slot;
+    return 0;
+}
+
+static inline void cacheindex_reading(cacheindex_entry_t *slot,
+                                      struct stat64 *realst, time_t now)
+{
+    (void) slot; (void) realst; (void) now;
+}
+
+static inline time_t cacheindex_readtime(cacheindex_entry_t *slot,
+                                         struct stat64 *realst)
+{
+    (void) slot; (void) realst;
+    return -1;
+}
+
+static inline void cacheindex_wait(cacheindex_entry_t *slot, uint32_t seq,
+                            int timeout)
+{
+    struct timespec     delay;
+
+    (void) slot; (void) seq;
+    delay.tv_sec = timeout / 1000;
+    delay.tv_nsec = (timeout % 1000) * 1000000;
+    nanosleep(&delay, NULL);
+}
+
+#endif /* USE_CACHEINDEX */
@@ -19,16 +19,30 @@
 #include <utime.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
 #ifdef __linux
+#include <sys/sysmacros.h>
 #include <linux/falloc.h>
 #endif /* __linux */
+#include <pthread.h>
+#ifdef IS_COPYD
+#include <sys/mman.h>
+#ifdef USE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif /* USE_IO_URING */
+#endif /* IS_COPYD */
 
 
 #include "md5.c"
+#include "cacheindex.c"
+#include "cacheranges.c"
 
 static void cache_hash(const char *it, char *val, int ndepth, int nlength)
 {
@@ -175,8 +189,1268 @@ static int open_new_file(char *destfile,
     return COPY_FAIL;
 }
 
-static copy_status copy_file(int srcfd, int srcflags, off64_t len, 
-                         time_t mtime, char *destfile,
+/* Copy buffers, CPBUFSIZE large and aligned for O_DIRECT.
+
+   copyd carves them out of a COPY_ARENA_SIZE mapping, backed by hugepages
+   if the kernel lets us, and recycles them through a free list. Should
+   the arena run dry buffers are allocated and freed one by one instead.
+
+   Clients do at most a copy at a time, they just keep the last buffer
+   around for the next copy.
+ */
+
+#if defined(IS_COPYD) && COPY_ARENA_SIZE > 0
+typedef struct copy_arena_t {
+    pthread_mutex_t     lock;
+    int                 tried;          /* Setup attempted */
+    int                 huge;           /* Backed by MAP_HUGETLB */
+    char                *base;          /* NULL if no arena */
+    char                *end;
+    char                *next;          /* Never handed out beyond this */
+    char                *free;          /* Linked through their first bytes */
+    int                 inuse;
+    int                 peak;
+    unsigned long long  hits;
+    unsigned long long  misses;         /* Arena full, had to allocate */
+} copy_arena_t;
+
+static copy_arena_t copy_arena = { PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL,
+                                   NULL, NULL, NULL, 0, 0, 0, 0 };
+
+
+/* Map the arena, called with the lock held */
+static void copy_arena_setup(copy_arena_t *a) {
+    void    *p;
+
+    a->tried = 1;
+#ifdef MAP_HUGETLB
+    /* Reserved up front, fails unless there are enough hugepages */
+    p = mmap(NULL, COPY_ARENA_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(p != MAP_FAILED) {
+        a->huge = 1;
+    }
+    else
+#endif /* MAP_HUGETLB */
+    {
+        p = mmap(NULL, COPY_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(p == MAP_FAILED) {
+#ifdef DEBUG
+            perror("httpcacheopen: copy_arena_setup: mmap");
+#endif
+            return;
+        }
+#ifdef MADV_HUGEPAGE
+        /* Transparent hugepages are the next best thing */
+        madvise(p, COPY_ARENA_SIZE, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    }
+
+    a->base = p;
+    a->next = p;
+    a->end = a->base + COPY_ARENA_SIZE / CPBUFSIZE * CPBUFSIZE;
+}
+
+
+/* Log arena statistics */
+static void copy_arena_dump(void) {
+    copy_arena_t    *a = &copy_arena;
+
+    pthread_mutex_lock(&a->lock);
+    fprintf(stderr, "copyd: arena: %s%zu buffers, %d in use, peak %d, "
+            "%llu hits, %llu misses\n", a->huge ? "hugepage backed, " : "",
+            (size_t) (a->end - a->base) / CPBUFSIZE, a->inuse, a->peak,
+            a->hits, a->misses);
+    pthread_mutex_unlock(&a->lock);
+}
+
+#elif !defined(IS_COPYD)
+static char *copy_bufcache = NULL;
+#endif /* defined(IS_COPYD) && COPY_ARENA_SIZE > 0 */
+
+
+static char *copy_buf_get(void) {
+    void            *buf = NULL;
+#if defined(IS_COPYD) && COPY_ARENA_SIZE > 0
+    copy_arena_t    *a = &copy_arena;
+
+    pthread_mutex_lock(&a->lock);
+    if(!a->tried) {
+        copy_arena_setup(a);
+    }
+    if(a->free) {
+        buf = a->free;
+        a->free = *(char **) buf;
+    }
+    else if(a->next < a->end) {
+        buf = a->next;
+        a->next += CPBUFSIZE;
+    }
+    if(buf) {
+        a->hits++;
+        if(++a->inuse > a->peak) {
+            a->peak = a->inuse;
+        }
+    }
+    else {
+        a->misses++;
+    }
+    pthread_mutex_unlock(&a->lock);
+#elif !defined(IS_COPYD)
+    buf = __atomic_exchange_n(&copy_bufcache, NULL, __ATOMIC_ACQUIRE);
+#endif /* defined(IS_COPYD) && COPY_ARENA_SIZE > 0 */
+
+    if(!buf && posix_memalign(&buf, DIRECTIO_ALIGN, CPBUFSIZE) != 0) {
+        return NULL;
+    }
+
+    return buf;
+}
+
+
+static void copy_buf_put(char *buf) {
+#if defined(IS_COPYD) && COPY_ARENA_SIZE > 0
+    copy_arena_t    *a = &copy_arena;
+#endif /* defined(IS_COPYD) && COPY_ARENA_SIZE > 0 */
+
+    if(!buf) {
+        return;
+    }
+
+#if defined(IS_COPYD) && COPY_ARENA_SIZE > 0
+    if(buf >= a->base && buf < a->end) {
+        pthread_mutex_lock(&a->lock);
+        *(char **) buf = a->free;
+        a->free = buf;
+        a->inuse--;
+        pthread_mutex_unlock(&a->lock);
+        return;
+    }
+#elif !defined(IS_COPYD)
+    buf = __atomic_exchange_n(&copy_bufcache, buf, __ATOMIC_RELEASE);
+#endif /* defined(IS_COPYD) && COPY_ARENA_SIZE > 0 */
+
+    free(buf);
+}
+
+
+/* Bytes to ask for when reading the chunk at off of a size byte file.
+   With O_DIRECT the length must be aligned too, reading past EOF is
+   fine. */
+static inline size_t copy_readlen(off64_t size, off64_t off) {
+    off64_t len = size - off < CPBUFSIZE ? size - off : CPBUFSIZE;
+
+    return (len + DIRECTIO_ALIGN - 1) & ~(off64_t)(DIRECTIO_ALIGN - 1);
+}
+
+
+/* Write flushing.
+
+   copy_file() starts writeback of each window of written data and waits
+   for the previous one to hit the disk, so the write queues of the cache
+   device never fill up with our data. How large a window is sensible
+   depends very much on the device, so it's adapted per device to keep
+   both the time spent waiting for a flush and the read latency of the
+   device around CACHE_WRITE_FLUSH_LATENCY.
+ */
+
+typedef struct copy_flushdev_t {
+    dev_t               dev;
+    off64_t             window;
+    unsigned long long  flushms;        /* Last flush wait */
+    unsigned long long  readlat;        /* Last read latency, in us */
+    unsigned long long  rdios;          /* From /sys/dev/block/M:m/stat */
+    unsigned long long  rdticks;
+} copy_flushdev_t;
+
+static copy_flushdev_t  copy_flushdevs[CACHE_WRITE_FLUSH_DEVS];
+/* Application threads copy too, not just copyd workers */
+static pthread_mutex_t  copy_flushlock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Flush state of the device dev, taking over the least recently added
+   entry if it's not known yet. Returns the current window. */
+static off64_t copy_flush_dev(dev_t dev, copy_flushdev_t **fdev) {
+    static int  next = 0;
+    off64_t     window;
+    int         i;
+
+    pthread_mutex_lock(&copy_flushlock);
+    for(i=0; i<CACHE_WRITE_FLUSH_DEVS; i++) {
+        if(copy_flushdevs[i].window && copy_flushdevs[i].dev == dev) {
+            break;
+        }
+    }
+    if(i == CACHE_WRITE_FLUSH_DEVS) {
+        i = next;
+        next = (next + 1) % CACHE_WRITE_FLUSH_DEVS;
+        memset(&copy_flushdevs[i], 0, sizeof(copy_flushdev_t));
+        copy_flushdevs[i].dev = dev;
+        copy_flushdevs[i].window = CACHE_WRITE_FLUSH_WINDOW;
+    }
+    *fdev = &copy_flushdevs[i];
+    window = copy_flushdevs[i].window;
+    pthread_mutex_unlock(&copy_flushlock);
+
+    return window;
+}
+
+
+#ifdef __linux
+/* Average read latency of dev since the last call, in us. Returns 0 if
+   unknown or there were no reads. */
+static unsigned long long copy_flush_readlat(copy_flushdev_t *fdev,
+                                 int (*openfunc)(const char *, int, ...),
+                                 ssize_t (*readfunc)(int fd, void *buf,
+                                                     size_t count),
+                                 int (*closefunc)(int fd))
+{
+    char                path[64], buf[256];
+    int                 fd;
+    ssize_t             amt;
+    unsigned long long  ios, ticks, lat = 0;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/stat",
+             major(fdev->dev), minor(fdev->dev));
+    fd = openfunc(path, O_RDONLY);
+    if(fd == -1) {
+        return 0;
+    }
+    amt = readfunc(fd, buf, sizeof(buf)-1);
+    closefunc(fd);
+    if(amt <= 0) {
+        return 0;
+    }
+    buf[amt] = '\0';
+
+    /* read I/Os, read merges, read sectors, read ticks (ms) */
+    if(sscanf(buf, "%llu %*u %*u %llu", &ios, &ticks) != 2) {
+        return 0;
+    }
+    if(fdev->rdios && ios > fdev->rdios && ticks >= fdev->rdticks) {
+        lat = (ticks - fdev->rdticks) * 1000 / (ios - fdev->rdios);
+    }
+    fdev->rdios = ios;
+    fdev->rdticks = ticks;
+
+    return lat;
+}
+#endif /* __linux */
+
+
+/* A flush of the previous window took flushms to complete, adjust the
+   window of the device. Returns the new window. */
+static off64_t copy_flush_adapt(copy_flushdev_t *fdev,
+                                unsigned long long flushms,
+                                int (*openfunc)(const char *, int, ...),
+                                ssize_t (*readfunc)(int fd, void *buf,
+                                                    size_t count),
+                                int (*closefunc)(int fd))
+{
+    unsigned long long  lat;
+    double              ratio;
+    off64_t             window;
+
+    pthread_mutex_lock(&copy_flushlock);
+#ifdef __linux
+    fdev->readlat = copy_flush_readlat(fdev, openfunc, readfunc, closefunc);
+#else
+    (void) openfunc; (void) readfunc; (void) closefunc;
+#endif /* __linux */
+    fdev->flushms = flushms;
+
+    /* Go for whichever latency is the worst */
+    lat = fdev->readlat / 1000 > flushms ? fdev->readlat / 1000 : flushms;
+    ratio = lat ? (double) CACHE_WRITE_FLUSH_LATENCY / lat : 2;
+    if(ratio > 2) {
+        ratio = 2;
+    }
+    else if(ratio < 0.5) {
+        ratio = 0.5;
+    }
+    /* Move a quarter of the way to the target, flush times are noisy */
+    window = fdev->window * (0.75 + ratio / 4);
+    window = window / CPBUFSIZE * CPBUFSIZE;
+    if(window < CACHE_WRITE_FLUSH_MIN) {
+        window = CACHE_WRITE_FLUSH_MIN;
+    }
+    else if(window > CACHE_WRITE_FLUSH_MAX) {
+        window = CACHE_WRITE_FLUSH_MAX;
+    }
+    fdev->window = window;
+    pthread_mutex_unlock(&copy_flushlock);
+
+#ifdef DEBUG
+    fprintf(stderr, "httpcacheopen: copy_flush_adapt: flush %llu ms, "
+            "read %llu us, window %lld\n", flushms, fdev->readlat,
+            (long long)window);
+#endif
+
+    return window;
+}
+
+
+#ifdef IS_COPYD
+/* Log the flush window of each cache device */
+static void copy_flush_dump(void) {
+    int i;
+
+    pthread_mutex_lock(&copy_flushlock);
+    for(i=0; i<CACHE_WRITE_FLUSH_DEVS; i++) {
+        if(copy_flushdevs[i].window) {
+            fprintf(stderr, "copyd: flush: dev %u:%u window %lld, last flush "
+                    "%llu ms, read latency %llu us\n",
+                    major(copy_flushdevs[i].dev), minor(copy_flushdevs[i].dev),
+                    (long long)copy_flushdevs[i].window,
+                    copy_flushdevs[i].flushms, copy_flushdevs[i].readlat);
+        }
+    }
+    pthread_mutex_unlock(&copy_flushlock);
+}
+#endif /* IS_COPYD */
+
+
+#if defined(IS_COPYD) && COPY_RATE_MAX > 0
+/* Bandwidth throttling in copyd.
+
+   The copies in progress share a rate of COPY_RATE_MAX bytes/s, each
+   through a token bucket of its own. Copies nobody reads get a smaller
+   share than the rest, by way of their weight. On Linux the rate follows
+   the I/O pressure reported in /proc/pressure/io: halved when tasks spend
+   more than COPY_PSI_TARGET percent of the time stalled on I/O, stepped
+   back up by COPY_RATE_STEP otherwise. */
+
+typedef struct copy_throttle_t {
+    pthread_mutex_t     lock;
+    double              rate;           /* bytes/s for all copies */
+    int                 ncopies;
+    int                 weights;        /* Sum of the copies' weights */
+    double              pressure;       /* percent, last interval */
+    unsigned long long  psitotal;       /* us stalled, from the kernel */
+    int                 psivalid;       /* psitotal read at psitime */
+    struct timespec     psitime;        /* Last PSI check */
+} copy_throttle_t;
+
+static copy_throttle_t copy_throttle = { PTHREAD_MUTEX_INITIALIZER,
+                                         COPY_RATE_MAX, 0, 0, 0, 0, 0,
+                                         { 0, 0 } };
+
+typedef struct copy_bucket_t {
+    double              tokens;         /* bytes */
+    struct timespec     last;
+    int                 weight;         /* COPY_IDLE_WEIGHT, or 1 if idle */
+} copy_bucket_t;
+
+
+static inline double copy_elapsed(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) +
+           (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+
+#ifdef __linux
+/* Adjust the rate to the I/O pressure since the check at since. Called
+   without the lock by the thread that claimed the check, the file is read
+   without holding up the other copies. */
+static void copy_throttle_psi(copy_throttle_t *t, struct timespec *since,
+                              struct timespec *now)
+{
+    char                buf[256], *p;
+    int                 fd, valid = 0;
+    ssize_t             amt = 0;
+    unsigned long long  total = 0;
+    double              elapsed = copy_elapsed(since, now);
+
+    /* No PSI sticks to the configured rate */
+    fd = open("/proc/pressure/io", O_RDONLY);
+    if(fd != -1) {
+        amt = read(fd, buf, sizeof(buf)-1);
+        close(fd);
+    }
+    if(amt > 0) {
+        buf[amt] = '\0';
+        /* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 */
+        p = strstr(buf, "total=");
+        valid = strncmp(buf, "some ", 5) == 0 && p &&
+                sscanf(p, "total=%llu", &total) == 1;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    if(valid && t->psivalid && total >= t->psitotal && elapsed > 0) {
+        t->pressure = (total - t->psitotal) / (elapsed * 1e4);
+        if(t->pressure > COPY_PSI_TARGET) {
+            t->rate /= 2;
+        }
+        else {
+            t->rate += COPY_RATE_STEP;
+        }
+        if(t->rate < COPY_RATE_MIN) {
+            t->rate = COPY_RATE_MIN;
+        }
+        else if(t->rate > COPY_RATE_MAX) {
+            t->rate = COPY_RATE_MAX;
+        }
+#ifdef DEBUG
+        fprintf(stderr, "httpcacheopen: copy_throttle_psi: io pressure "
+                "%.1f%%, rate %.1f MB/s\n", t->pressure, t->rate / 1048576);
+#endif
+    }
+    t->psitotal = total;
+    t->psivalid = valid;
+    pthread_mutex_unlock(&t->lock);
+}
+#endif /* __linux */
+
+
+static void copy_throttle_start(copy_bucket_t *b) {
+
+    b->weight = COPY_IDLE_WEIGHT;
+
+    pthread_mutex_lock(&copy_throttle.lock);
+    copy_throttle.ncopies++;
+    copy_throttle.weights += b->weight;
+    pthread_mutex_unlock(&copy_throttle.lock);
+
+    b->tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+
+static void copy_throttle_stop(copy_bucket_t *b) {
+
+    pthread_mutex_lock(&copy_throttle.lock);
+    copy_throttle.ncopies--;
+    copy_throttle.weights -= b->weight;
+    pthread_mutex_unlock(&copy_throttle.lock);
+}
+
+
+/* Give the copy of b a share according to weight from now on */
+static void copy_throttle_weight(copy_bucket_t *b, int weight) {
+
+    if(b->weight == weight) {
+        return;
+    }
+
+    pthread_mutex_lock(&copy_throttle.lock);
+    copy_throttle.weights += weight - b->weight;
+    pthread_mutex_unlock(&copy_throttle.lock);
+    b->weight = weight;
+}
+
+
+/* Account for amt bytes copied, sleeping if we're ahead of our share */
+static void copy_throttle_wait(copy_bucket_t *b, size_t amt) {
+    struct timespec     now, ts;
+    double              share, wait;
+#ifdef __linux
+    struct timespec     since;
+    int                 psicheck = 0;
+#endif /* __linux */
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&copy_throttle.lock);
+#ifdef __linux
+    /* Whoever gets here first checks, the rest carry on */
+    if(copy_elapsed(&copy_throttle.psitime, &now) * 1000 >= COPY_PSI_INTERVAL)
+    {
+        since = copy_throttle.psitime;
+        copy_throttle.psitime = now;
+        psicheck = 1;
+    }
+#endif /* __linux */
+    share = copy_throttle.rate * b->weight / copy_throttle.weights;
+    pthread_mutex_unlock(&copy_throttle.lock);
+
+#ifdef __linux
+    if(psicheck) {
+        copy_throttle_psi(&copy_throttle, &since, &now);
+    }
+#endif /* __linux */
+
+    /* Allow bursts of a tenth of a second */
+    b->tokens += copy_elapsed(&b->last, &now) * share;
+    if(b->tokens > share / 10) {
+        b->tokens = share / 10;
+    }
+    b->last = now;
+
+    b->tokens -= amt;
+    if(b->tokens < 0) {
+        wait = -b->tokens / share;
+        ts.tv_sec = wait;
+        ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+        while(nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    }
+}
+
+
+/* Log the current rate */
+static void copy_throttle_dump(void) {
+
+    pthread_mutex_lock(&copy_throttle.lock);
+    fprintf(stderr, "copyd: throttle: %.1f MB/s shared by %d copies "
+            "(weight %d), io pressure %.1f%%\n", copy_throttle.rate / 1048576,
+            copy_throttle.ncopies, copy_throttle.weights,
+            copy_throttle.pressure);
+    pthread_mutex_unlock(&copy_throttle.lock);
+}
+#endif /* defined(IS_COPYD) && COPY_RATE_MAX > 0 */
+
+
+#ifdef __linux
+/* How copy_file() moves the data, best first */
+typedef enum copy_engine {
+    COPY_ENGINE_RW = 0,         /* read()/write() through our buffer */
+    COPY_ENGINE_SPLICE,         /* splice() through a pipe */
+    COPY_ENGINE_CFR             /* copy_file_range() */
+} copy_engine;
+
+
+/* Copy up to count bytes from srcfd to destfd, at their current file
+   offsets, without the data passing through user space. Returns the
+   number of bytes copied, 0 at EOF and -1 on error. If the kernel
+   can't do it this way *engine is downgraded and -2 returned. */
+static ssize_t copy_kernel(int srcfd, int destfd, size_t count,
+                           copy_engine *engine, int *pipefd)
+{
+    ssize_t amt, wrt, done;
+
+    if(*engine == COPY_ENGINE_CFR) {
+        amt = copy_file_range(srcfd, NULL, destfd, NULL, count, 0);
+        if(amt > 0) {
+            return amt;
+        }
+        /* Some filesystems claim EOF when they mean unsupported, let the
+           next engine figure out if it's for real */
+        if(amt == 0 || errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP || errno == EBADF)
+        {
+#ifdef DEBUG
+            perror("httpcacheopen: copy_kernel: copy_file_range");
+#endif
+            *engine = COPY_ENGINE_SPLICE;
+            return -2;
+        }
+        return -1;
+    }
+
+    if(pipefd[0] == -1) {
+        if(pipe(pipefd) == -1) {
+            *engine = COPY_ENGINE_RW;
+            return -2;
+        }
+        /* Fit a whole chunk if we're allowed to, default is 64 kB */
+        fcntl(pipefd[1], F_SETPIPE_SZ, CPBUFSIZE);
+    }
+
+    amt = splice(srcfd, NULL, pipefd[1], NULL, count, SPLICE_F_MOVE);
+    if(amt == -1) {
+        if(errno == EINVAL || errno == ENOSYS) {
+#ifdef DEBUG
+            perror("httpcacheopen: copy_kernel: splice");
+#endif
+            *engine = COPY_ENGINE_RW;
+            return -2;
+        }
+        return -1;
+    }
+
+    /* The data is in the pipe now, no way back */
+    for(done = 0; done < amt; done += wrt) {
+        wrt = splice(pipefd[0], NULL, destfd, NULL, amt - done, SPLICE_F_MOVE);
+        if(wrt == -1 && errno == EINTR) {
+            wrt = 0;
+            continue;
+        }
+        if(wrt <= 0) {
+#ifdef DEBUG
+            perror("httpcacheopen: copy_kernel: splice to destfd");
+#endif
+            if(wrt == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+    }
+
+    return amt;
+}
+#endif /* __linux */
+
+
+#ifdef USE_CACHERANGES
+/* Fetch the chunks blocked readers want ahead of the sequential copy at
+   destoff into the sidecar file. Returns -1 on failure. */
+static int copy_fetch_wanted(int srcfd, int destfd, off64_t destoff,
+                             struct stat64 *realst, char *destfile,
+                             cacheindex_entry_t *slot, cacheranges_t *cr,
+                             char *buf,
+                             int (*openfunc)(const char *, int, ...),
+                             int (*closefunc)(int fd))
+{
+    int         i;
+    int64_t     chunk;
+    off64_t     want, off, end;
+    ssize_t     amt, wrt;
+
+    for(i=0; i<CACHEINDEX_WANTS; i++) {
+        want = cacheindex_wanted(slot, i);
+        if(want < 0) {
+            continue;
+        }
+        if(want >= realst->st_size || want < destoff + CACHE_RANGE_CHUNK) {
+            /* Nothing to fetch, or the copy will be there soon enough */
+            cacheindex_wantdone(slot, i, want);
+            continue;
+        }
+        if(!cr->hdr && cacheranges_create(cr, destfile, realst, openfunc,
+                                          closefunc) == -1)
+        {
+            /* Readers will have to wait for the sequential copy */
+            cacheindex_wantdone(slot, i, want);
+            continue;
+        }
+
+        chunk = want / CACHE_RANGE_CHUNK;
+        if(cacheranges_has(cr, chunk)) {
+            cacheindex_wantdone(slot, i, want);
+            continue;
+        }
+
+#ifdef DEBUG
+        fprintf(stderr, "httpcacheopen: copy_file: Fetching chunk %lld "
+                "out of order\n", (long long)chunk);
+#endif
+        off = chunk * CACHE_RANGE_CHUNK;
+        end = off + CACHE_RANGE_CHUNK;
+        if(end > realst->st_size) {
+            end = realst->st_size;
+        }
+        while(off < end) {
+            amt = pread(srcfd, buf, copy_readlen(end, off), off);
+            if(amt == -1 && errno == EINTR) {
+                continue;
+            }
+            if(amt > end - off) {
+                amt = end - off;
+            }
+            if(amt <= 0) {
+#ifdef DEBUG
+                perror("httpcacheopen: copy_fetch_wanted: pread");
+#endif
+                return -1;
+            }
+            while(amt > 0) {
+                wrt = pwrite(cr->fd, buf, amt, cr->hdr->datastart + off);
+                if(wrt == -1) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+#ifdef DEBUG
+                    perror("httpcacheopen: copy_fetch_wanted: pwrite");
+#endif
+                    return -1;
+                }
+                memmove(buf, buf+wrt, amt-wrt);
+                off += wrt;
+                amt -= wrt;
+            }
+        }
+        cacheranges_mark(cr, chunk);
+        cacheindex_wantdone(slot, i, want);
+
+        /* Wake up readers, both those sleeping in the index and those
+           watching the cached file */
+        futimens(destfd, NULL);
+        cacheindex_progress(slot, realst, destoff);
+    }
+
+    return 0;
+}
+#endif /* USE_CACHERANGES */
+
+
+#if defined(IS_COPYD) && COPY_STREAMS_MAX > 1
+/* Parallel reading of large files from the backend.
+
+   CPBUFSIZE chunks are read from the backend into a ring of buffers, with
+   several reads in flight, while copy_file() writes them out to the cached
+   file in order. The cached file must be written sequentially, so it's
+   only the backend reads that go in parallel.
+
+   With io_uring the reads are queued from the copying thread itself,
+   using buffers registered with the kernel. Otherwise worker threads do
+   pread() into the buffers.
+
+   The number of reads in flight is adjusted by a simple hill climb: keep
+   going in the same direction as long as the throughput improves, turn
+   around when it gets worse.
+ */
+
+#define COPY_STREAMS_NBUFS      (2*COPY_STREAMS_MAX)
+
+#if COPY_URING_DEPTH > COPY_STREAMS_NBUFS
+#error COPY_URING_DEPTH must not be larger than 2*COPY_STREAMS_MAX
+#endif
+
+typedef struct copy_streambuf_t {
+    char        *buf;
+    off64_t     off;            /* Offset of data in buf */
+    ssize_t     len;            /* Bytes read, -1 on error */
+    ssize_t     done;           /* Bytes read so far (io_uring) */
+    int         filled;         /* TRUE if data in buf */
+} copy_streambuf_t;
+
+#ifdef USE_IO_URING
+typedef struct copy_uring_t {
+    int                 fd;
+    unsigned            *sqtail, *sqmask, *sqarray;
+    unsigned            *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sqring, *cqring;
+    size_t              sqringlen, cqringlen, sqeslen;
+    unsigned            tosubmit;       /* Queued but not yet submitted */
+    int                 inflight;       /* Submitted but not completed */
+} copy_uring_t;
+#endif /* USE_IO_URING */
+
+typedef struct copy_streams_t {
+    pthread_mutex_t     lock;
+    pthread_cond_t      filledcond;     /* A buffer has been filled */
+    pthread_cond_t      freecond;       /* A buffer has been freed */
+    int                 srcfd;
+    off64_t             size;
+    off64_t             readoff;        /* Next chunk to read */
+    off64_t             writeoff;       /* Next chunk to write */
+    int                 nthreads;
+    int                 maxactive;
+    int                 active;         /* Reads in flight */
+    int                 step;           /* Direction of the hill climb */
+    int                 quit;
+    double              lastrate;       /* Bytes/s last interval */
+    off64_t             lastoff;
+    struct timespec     lasttime;
+    copy_streambuf_t    bufs[COPY_STREAMS_NBUFS];
+    pthread_t           threads[COPY_STREAMS_MAX];
+#ifdef USE_IO_URING
+    copy_uring_t        *uring;         /* NULL if using threads */
+#endif /* USE_IO_URING */
+} copy_streams_t;
+
+typedef struct copy_streamarg_t {
+    copy_streams_t      *cs;
+    int                 id;
+} copy_streamarg_t;
+
+
+static void *copy_stream(void *arg) {
+    copy_streams_t      *cs = ((copy_streamarg_t *) arg)->cs;
+    int                 id = ((copy_streamarg_t *) arg)->id;
+    copy_streambuf_t    *b;
+    off64_t             off;
+    ssize_t             amt, len, want;
+
+    free(arg);
+
+    pthread_mutex_lock(&cs->lock);
+    while(1) {
+        while(!cs->quit && (id >= cs->active || cs->readoff >= cs->size ||
+                cs->readoff >= cs->writeoff + COPY_STREAMS_NBUFS*CPBUFSIZE))
+        {
+            pthread_cond_wait(&cs->freecond, &cs->lock);
+        }
+        if(cs->quit) {
+            break;
+        }
+        off = cs->readoff;
+        cs->readoff += CPBUFSIZE;
+        b = &cs->bufs[(off / CPBUFSIZE) % COPY_STREAMS_NBUFS];
+        pthread_mutex_unlock(&cs->lock);
+
+        want = cs->size - off < CPBUFSIZE ? cs->size - off : CPBUFSIZE;
+        len = 0;
+        while(len < want) {
+            amt = pread(cs->srcfd, b->buf + len, copy_readlen(cs->size, off) - len,
+                        off + len);
+            if(amt == -1 && errno == EINTR) {
+                continue;
+            }
+            if(amt <= 0) {
+                /* Error, or the file shrunk under our feet */
+#ifdef DEBUG
+                perror("httpcacheopen: copy_stream: pread");
+#endif
+                len = -1;
+                break;
+            }
+            len += amt;
+        }
+        if(len > want) {
+            len = want;
+        }
+
+        pthread_mutex_lock(&cs->lock);
+        b->off = off;
+        b->len = len;
+        b->filled = 1;
+        pthread_cond_broadcast(&cs->filledcond);
+    }
+    pthread_mutex_unlock(&cs->lock);
+
+    return NULL;
+}
+
+
+#ifdef USE_IO_URING
+static void copy_uring_free(copy_uring_t *r) {
+
+    if(r->sqes) {
+        munmap(r->sqes, r->sqeslen);
+    }
+    if(r->cqring && r->cqring != r->sqring) {
+        munmap(r->cqring, r->cqringlen);
+    }
+    if(r->sqring) {
+        munmap(r->sqring, r->sqringlen);
+    }
+    close(r->fd);
+    free(r);
+}
+
+
+/* Set up an io_uring for reading into the buffers of cs. We don't depend
+   on liburing, so it's done the hard way. */
+static copy_uring_t *copy_uring_setup(copy_streams_t *cs) {
+    struct io_uring_params  p;
+    struct iovec            iov[COPY_STREAMS_NBUFS];
+    copy_uring_t            *r;
+    int                     i;
+
+    r = calloc(1, sizeof(copy_uring_t));
+    if(!r) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, COPY_STREAMS_NBUFS, &p);
+    if(r->fd == -1) {
+#ifdef DEBUG
+        perror("httpcacheopen: copy_uring_setup: io_uring_setup");
+#endif
+        free(r);
+        return NULL;
+    }
+
+    r->sqringlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqringlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cqringlen > r->sqringlen) {
+            r->sqringlen = r->cqringlen;
+        }
+        r->cqringlen = r->sqringlen;
+    }
+    r->sqring = mmap(NULL, r->sqringlen, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sqring == MAP_FAILED) {
+        r->sqring = NULL;
+        goto err;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqring = r->sqring;
+    }
+    else {
+        r->cqring = mmap(NULL, r->cqringlen, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(r->cqring == MAP_FAILED) {
+            r->cqring = NULL;
+            goto err;
+        }
+    }
+    r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqeslen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto err;
+    }
+
+    r->sqtail = (unsigned *) ((char *) r->sqring + p.sq_off.tail);
+    r->sqmask = (unsigned *) ((char *) r->sqring + p.sq_off.ring_mask);
+    r->sqarray = (unsigned *) ((char *) r->sqring + p.sq_off.array);
+    r->cqhead = (unsigned *) ((char *) r->cqring + p.cq_off.head);
+    r->cqtail = (unsigned *) ((char *) r->cqring + p.cq_off.tail);
+    r->cqmask = (unsigned *) ((char *) r->cqring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cqring + p.cq_off.cqes);
+
+    /* Pin the buffers in the kernel once instead of for each read */
+    for(i=0; i<COPY_STREAMS_NBUFS; i++) {
+        iov[i].iov_base = cs->bufs[i].buf;
+        iov[i].iov_len = CPBUFSIZE;
+    }
+    if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov,
+               COPY_STREAMS_NBUFS) == -1)
+    {
+#ifdef DEBUG
+        perror("httpcacheopen: copy_uring_setup: io_uring_register");
+#endif
+        goto err;
+    }
+
+    return r;
+
+err:
+    copy_uring_free(r);
+    return NULL;
+}
+
+
+/* Queue a read of the rest of buffer i */
+static void copy_uring_read(copy_streams_t *cs, int i) {
+    copy_uring_t        *r = cs->uring;
+    copy_streambuf_t    *b = &cs->bufs[i];
+    struct io_uring_sqe *sqe;
+    unsigned            tail, idx;
+
+    tail = *r->sqtail;
+    idx = tail & *r->sqmask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = cs->srcfd;
+    sqe->addr = (unsigned long) (b->buf + b->done);
+    sqe->len = copy_readlen(cs->size, b->off) - b->done;
+    sqe->off = b->off + b->done;
+    sqe->buf_index = i;
+    sqe->user_data = i;
+    r->sqarray[idx] = idx;
+    __atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+    r->tosubmit++;
+    r->inflight++;
+}
+
+
+/* Submit queued reads and wait for at least wait of them to complete */
+static int copy_uring_enter(copy_uring_t *r, unsigned wait) {
+    int rc;
+
+    do {
+        rc = syscall(__NR_io_uring_enter, r->fd, r->tosubmit, wait,
+                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(rc == -1 && errno == EINTR);
+
+    if(rc >= 0) {
+        r->tosubmit -= rc;
+    }
+
+    return rc;
+}
+
+
+/* Handle completed reads */
+static void copy_uring_reap(copy_streams_t *cs) {
+    copy_uring_t        *r = cs->uring;
+    copy_streambuf_t    *b;
+    struct io_uring_cqe *cqe;
+    unsigned            head;
+    off64_t             want;
+
+    head = *r->cqhead;
+    while(head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+        cqe = &r->cqes[head & *r->cqmask];
+        b = &cs->bufs[cqe->user_data];
+        r->inflight--;
+        want = cs->size - b->off < CPBUFSIZE ? cs->size - b->off : CPBUFSIZE;
+
+        if(cqe->res == -EINTR || cqe->res == -EAGAIN) {
+            copy_uring_read(cs, cqe->user_data);
+        }
+        else if(cqe->res <= 0) {
+            /* Error, or the file shrunk under our feet */
+#ifdef DEBUG
+            fprintf(stderr, "httpcacheopen: copy_uring_reap: read: %s\n",
+                    cqe->res ? strerror(-cqe->res) : "EOF");
+#endif
+            b->len = -1;
+            b->filled = 1;
+        }
+        else {
+            b->done += cqe->res;
+            if(b->done < want) {
+                /* Short read, go for the rest */
+                copy_uring_read(cs, cqe->user_data);
+            }
+            else {
+                b->len = b->done > want ? want : b->done;
+                b->filled = 1;
+            }
+        }
+        head++;
+    }
+    __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+}
+
+
+/* Keep active reads in flight, within the buffer window */
+static void copy_uring_fill(copy_streams_t *cs) {
+    copy_streambuf_t    *b;
+    int                 i;
+
+    while(cs->uring->inflight < cs->active && cs->readoff < cs->size &&
+            cs->readoff < cs->writeoff + COPY_STREAMS_NBUFS*CPBUFSIZE)
+    {
+        i = (cs->readoff / CPBUFSIZE) % COPY_STREAMS_NBUFS;
+        b = &cs->bufs[i];
+        b->off = cs->readoff;
+        b->done = 0;
+        b->filled = 0;
+        copy_uring_read(cs, i);
+        cs->readoff += CPBUFSIZE;
+    }
+}
+#endif /* USE_IO_URING */
+
+
+static void copy_streams_stop(copy_streams_t *cs);
+
+
+/* Start reading srcfd in parallel. Returns -1 if that's not possible. */
+static int copy_streams_start(copy_streams_t *cs, int srcfd, off64_t size) {
+    pthread_attr_t      attr;
+    copy_streamarg_t    *arg;
+    int                 i;
+
+    memset(cs, 0, sizeof(*cs));
+    cs->srcfd = srcfd;
+    cs->size = size;
+    cs->active = 2;
+    cs->step = 1;
+    clock_gettime(CLOCK_MONOTONIC, &cs->lasttime);
+
+    for(i=0; i<COPY_STREAMS_NBUFS; i++) {
+        cs->bufs[i].buf = copy_buf_get();
+        if(!cs->bufs[i].buf) {
+            goto err;
+        }
+    }
+
+#ifdef USE_IO_URING
+    cs->uring = copy_uring_setup(cs);
+    if(cs->uring) {
+        cs->maxactive = COPY_URING_DEPTH;
+        return 0;
+    }
+#endif /* USE_IO_URING */
+
+    pthread_mutex_init(&cs->lock, NULL);
+    pthread_cond_init(&cs->filledcond, NULL);
+    pthread_cond_init(&cs->freecond, NULL);
+
+    if(pthread_attr_init(&attr) != 0) {
+        goto err;
+    }
+    pthread_attr_setstacksize(&attr, 65536);
+
+    for(i=0; i<COPY_STREAMS_MAX; i++) {
+        arg = malloc(sizeof(*arg));
+        if(!arg) {
+            break;
+        }
+        arg->cs = cs;
+        arg->id = i;
+        if(pthread_create(&cs->threads[i], &attr, copy_stream, arg) != 0) {
+            free(arg);
+            break;
+        }
+        cs->nthreads++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if(cs->nthreads < 2) {
+        /* Not much point, stop whatever got started */
+        copy_streams_stop(cs);
+        return -1;
+    }
+    cs->maxactive = cs->nthreads;
+
+    return 0;
+
+err:
+    for(i=0; i<COPY_STREAMS_NBUFS; i++) {
+        copy_buf_put(cs->bufs[i].buf);
+        cs->bufs[i].buf = NULL;
+    }
+    return -1;
+}
+
+
+static void copy_streams_stop(copy_streams_t *cs) {
+    int i;
+
+#ifdef USE_IO_URING
+    if(cs->uring) {
+        /* The reads in flight must be done before the buffers can go */
+        while(cs->uring->inflight > 0) {
+            if(copy_uring_enter(cs->uring, 1) == -1) {
+                break;
+            }
+            copy_uring_reap(cs);
+        }
+        copy_uring_free(cs->uring);
+        cs->uring = NULL;
+        goto out;
+    }
+#endif /* USE_IO_URING */
+
+    pthread_mutex_lock(&cs->lock);
+    cs->quit = 1;
+    pthread_cond_broadcast(&cs->freecond);
+    pthread_mutex_unlock(&cs->lock);
+
+    for(i=0; i<cs->nthreads; i++) {
+        pthread_join(cs->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&cs->freecond);
+    pthread_cond_destroy(&cs->filledcond);
+    pthread_mutex_destroy(&cs->lock);
+
+#ifdef USE_IO_URING
+out:
+#endif /* USE_IO_URING */
+    for(i=0; i<COPY_STREAMS_NBUFS; i++) {
+        copy_buf_put(cs->bufs[i].buf);
+    }
+}
+
+
+/* Wait for the chunk at off, which must be the next one to be written.
+   Returns the number of bytes in *data, or -1 on read error. */
+static ssize_t copy_streams_get(copy_streams_t *cs, off64_t off, char **data)
+{
+    copy_streambuf_t    *b = &cs->bufs[(off / CPBUFSIZE) % COPY_STREAMS_NBUFS];
+    ssize_t             len;
+
+    if(off >= cs->size) {
+        return 0;
+    }
+
+#ifdef USE_IO_URING
+    if(cs->uring) {
+        while(1) {
+            copy_uring_fill(cs);
+            if(b->filled && b->off == off) {
+                break;
+            }
+            if(copy_uring_enter(cs->uring, 1) == -1) {
+                return -1;
+            }
+            copy_uring_reap(cs);
+        }
+        len = b->len;
+        goto out;
+    }
+#endif /* USE_IO_URING */
+
+    pthread_mutex_lock(&cs->lock);
+    while(!(b->filled && b->off == off)) {
+        pthread_cond_wait(&cs->filledcond, &cs->lock);
+    }
+    len = b->len;
+    pthread_mutex_unlock(&cs->lock);
+
+#ifdef USE_IO_URING
+out:
+#endif /* USE_IO_URING */
+    if(len == -1) {
+        errno = EIO;
+    }
+    *data = b->buf;
+
+    return len;
+}
+
+
+/* See if we should adjust the number of reads in flight */
+static void copy_streams_adapt(copy_streams_t *cs) {
+    struct timespec     now;
+    double              rate;
+
+    if(cs->writeoff - cs->lastoff < COPY_STREAMS_INTERVAL) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rate = (cs->writeoff - cs->lastoff) /
+           ((now.tv_sec - cs->lasttime.tv_sec) +
+            (now.tv_nsec - cs->lasttime.tv_nsec) / 1e9 + 1e-6);
+    if(rate < cs->lastrate * 0.95) {
+        /* Worse, turn around */
+        cs->step = -cs->step;
+    }
+    if(rate < cs->lastrate * 0.95 || rate > cs->lastrate * 1.05) {
+        cs->active += cs->step;
+        if(cs->active < 1) {
+            cs->active = 1;
+            cs->step = 1;
+        }
+        else if(cs->active > cs->maxactive) {
+            cs->active = cs->maxactive;
+            cs->step = -1;
+        }
+    }
+#ifdef DEBUG
+    fprintf(stderr, "httpcacheopen: copy_streams: %.1f MB/s, now using "
+            "%d streams\n", rate / 1048576, cs->active);
+#endif
+    cs->lastrate = rate;
+    cs->lastoff = cs->writeoff;
+    cs->lasttime = now;
+}
+
+
+/* The chunk at off is written, hand the buffer back */
+static void copy_streams_put(copy_streams_t *cs, off64_t off) {
+    copy_streambuf_t    *b = &cs->bufs[(off / CPBUFSIZE) % COPY_STREAMS_NBUFS];
+
+#ifdef USE_IO_URING
+    if(cs->uring) {
+        b->filled = 0;
+        cs->writeoff = off + CPBUFSIZE;
+        copy_streams_adapt(cs);
+        /* Get the next reads going before we're busy writing */
+        copy_uring_fill(cs);
+        if(cs->uring->tosubmit > 0) {
+            copy_uring_enter(cs->uring, 0);
+        }
+        return;
+    }
+#endif /* USE_IO_URING */
+
+    pthread_mutex_lock(&cs->lock);
+    b->filled = 0;
+    cs->writeoff = off + CPBUFSIZE;
+    copy_streams_adapt(cs);
+    pthread_cond_broadcast(&cs->freecond);
+    pthread_mutex_unlock(&cs->lock);
+}
+#endif /* defined(IS_COPYD) && COPY_STREAMS_MAX > 1 */
+
+
+#ifdef IS_COPYD
+/* Called by copy_file() as soon as destfile is created, so copyd can hand
+   it to those waiting for it */
+static void copy_started(struct stat64 *realst, const char *destfile);
+#endif /* IS_COPYD */
+
+
+static copy_status copy_file(int srcfd, int srcflags, struct stat64 *realst,
+                         char *destfile,
                          int (*openfunc)(const char *, int, ...),
                          int (*statfunc)(const char *, struct stat64 *),
                          int (*fstat64func)(int filedes, struct stat64 *buf),
@@ -184,21 +1458,57 @@ static copy_status copy_file(int srcfd, int srcflags, off64_t len,
                          int (*closefunc)(int fd))
 {
     int                 destfd, modflags, i, err;
-    char                *buf;
+    char                *buf, *data;
     ssize_t             amt, wrt, done;
-    off64_t             srcoff, destoff, flushoff;
+    off64_t             srcoff, destoff, flushoff, waitoff, window;
+    off64_t             len = realst->st_size;
+    copy_flushdev_t     *flushdev = NULL;
     copy_status         rc = COPY_OK;
-
+    cacheindex_entry_t  *slot;
+#ifdef USE_CACHERANGES
+    cacheranges_t       ranges = { NULL, 0, -1 };
+    off64_t             avail;
+#endif /* USE_CACHERANGES */
+#if defined(IS_COPYD) && COPY_STREAMS_MAX > 1
+    copy_streams_t      *streams = NULL;
+#endif
+#if defined(IS_COPYD) && COPY_RATE_MAX > 0
+    copy_bucket_t       bucket;
+#endif
+#ifdef __linux
+    copy_engine         engine = COPY_ENGINE_CFR;
+    int                 pipefd[2] = { -1, -1 };
+#endif /* __linux */
+#ifdef USE_O_DIRECT
+    int                 direct = 0;
+#endif /* USE_O_DIRECT */
+#ifdef IS_COPYD
+    time_t              started = time(NULL), idle;
+#endif /* IS_COPYD */
+
+    /* Marked before the file shows up, so a stale COMPLETE never points
+       at it */
+    slot = cacheindex_set(realst, CACHEINDEX_COPYING, 0);
     destfd = open_new_file(destfile, openfunc, statfunc);
     if(destfd < 0) {
+        if(destfd != COPY_EXISTS) {
+            cacheindex_set(realst, CACHEINDEX_ABSENT, 0);
+        }
         return(destfd);
     }
+    cacheindex_progress(slot, realst, 0);
+#ifdef IS_COPYD
+    copy_started(realst, destfile);
+#endif /* IS_COPYD */
 
-    buf = malloc(CPBUFSIZE);
+    buf = copy_buf_get();
     if(buf == NULL) {
         closefunc(destfd);
         return(COPY_FAIL);
     }
+#if defined(IS_COPYD) && COPY_RATE_MAX > 0
+    copy_throttle_start(&bucket);
+#endif
 
     /* Remove nonblocking IO */
     modflags = srcflags;
@@ -212,11 +1522,42 @@ static copy_status copy_file(int srcfd, int srcflags, off64_t len,
             modflags = srcflags;
         }
 #ifdef DEBUG
-        else {
-            fprintf(stderr, "httpcacheopen: copy_file: Modified file flags\n");
-        }
+        else {
+            fprintf(stderr, "httpcacheopen: copy_file: Modified file flags\n");
+        }
+#endif
+    }
+
+#ifdef USE_O_DIRECT
+    /* Keep large files from evicting everything else from the page cache */
+    if(len >= CACHE_BF_SIZE) {
+        if(!(modflags & O_DIRECT) &&
+                fcntl(srcfd, F_SETFL, modflags | O_DIRECT) == 0)
+        {
+            /* Not all filesystems complain until the first read */
+            if(pread(srcfd, buf, DIRECTIO_ALIGN, 0) == -1) {
+#ifdef DEBUG
+                perror("httpcacheopen: copy_file: O_DIRECT read");
+#endif
+                fcntl(srcfd, F_SETFL, modflags);
+            }
+            else {
+                modflags |= O_DIRECT;
+            }
+        }
+        if(fcntl(destfd, F_SETFL, O_LARGEFILE | O_DIRECT) == 0) {
+            direct = 1;
+        }
+#ifdef DEBUG
+        fprintf(stderr, "httpcacheopen: copy_file: O_DIRECT src %d dest %d\n",
+                (modflags & O_DIRECT) != 0, direct);
 #endif
+        /* The kernel copy would go through the page cache anyway */
+        if(modflags & O_DIRECT || direct) {
+            engine = COPY_ENGINE_RW;
+        }
     }
+#endif /* USE_O_DIRECT */
 
     /* We expect sequential IO */
     err=posix_fadvise(srcfd, 0, 0, POSIX_FADV_SEQUENTIAL);
@@ -242,9 +1583,30 @@ static copy_status copy_file(int srcfd, int srcflags, off64_t len,
     }
 #endif /* __linux */
 
+#if defined(IS_COPYD) && COPY_STREAMS_MAX > 1
+    if(len >= COPY_STREAMS_MINSIZE) {
+        streams = malloc(sizeof(copy_streams_t));
+        if(streams && copy_streams_start(streams, srcfd, len) == -1) {
+            free(streams);
+            streams = NULL;
+        }
+    }
+#endif
+
+    {
+        struct stat64 st;
+
+        if(fstat64func(destfd, &st) == -1) {
+            rc = COPY_FAIL;
+            goto exit;
+        }
+        window = copy_flush_dev(st.st_dev, &flushdev);
+    }
+
     srcoff=0;
     destoff=0;
     flushoff=0;
+    waitoff=0;
     i=0;
     while(len > 0) {
         if(i++ >= CPCHKINTERVAL) {
@@ -267,7 +1629,76 @@ static copy_status copy_file(int srcfd, int srcflags, off64_t len,
                 rc = COPY_FAIL;
                 goto exit;
             }
+            /* Ours might have been lost to a race or evicted since */
+            slot = cacheindex_getslot(realst);
+#ifdef IS_COPYD
+            /* Without a slot there's no telling if anyone's reading, keep
+               going as if they were */
+            idle = cacheindex_readtime(slot, realst);
+            if(idle != -1) {
+                idle = time(NULL) - (idle > started ? idle : started);
+            }
+            if(idle >= COPY_IDLE_ABANDON &&
+                    realst->st_size >= COPY_IDLE_MINSIZE)
+            {
+                /* Nobody wants it, don't waste the bandwidth */
+#ifdef DEBUG
+                fprintf(stderr, "httpcacheopen: copy_file: Abandoned, "
+                        "unread for %ld s\n", (long) idle);
+#endif
+                unlink(destfile);
+                rc = COPY_FAIL;
+                goto exit;
+            }
+#if COPY_RATE_MAX > 0
+            copy_throttle_weight(&bucket, idle >= COPY_IDLE_DEMOTE ? 1 :
+                                 COPY_IDLE_WEIGHT);
+#endif
+#endif /* IS_COPYD */
+        }
+        data = buf;
+#ifdef USE_CACHERANGES
+        if(copy_fetch_wanted(srcfd, destfd, destoff, realst, destfile, slot,
+                             &ranges, buf, openfunc, closefunc) == -1)
+        {
+            rc = COPY_FAIL;
+            goto exit;
+        }
+        avail = cacheranges_avail(&ranges, srcoff);
+#if defined(IS_COPYD) && COPY_STREAMS_MAX > 1
+        if(streams) {
+            /* The streams are reading it already anyway */
+            avail = 0;
+        }
+#endif
+        if(avail > 0) {
+            /* Already fetched out of order, no need to bother the backend */
+            amt = pread(ranges.fd, buf, avail < CPBUFSIZE ? avail : CPBUFSIZE,
+                        ranges.hdr->datastart + srcoff);
+            if(amt > 0 && lseek64(srcfd, amt, SEEK_CUR) == -1) {
+                amt = -1;
+            }
+        }
+        else
+#endif /* USE_CACHERANGES */
+#if defined(IS_COPYD) && COPY_STREAMS_MAX > 1
+        if(streams) {
+            amt = copy_streams_get(streams, srcoff, &data);
+        }
+        else
+#endif
+#ifdef __linux
+        if(engine != COPY_ENGINE_RW) {
+            amt = copy_kernel(srcfd, destfd, len < CPBUFSIZE ? len : CPBUFSIZE,
+                              &engine, pipefd);
+            if(amt == -2) {
+                /* Not supported, go again with the next engine */
+                continue;
+            }
+            data = NULL;
         }
+        else
+#endif /* __linux */
         amt = readfunc(srcfd, buf, CPBUFSIZE);
         if(amt == -1) {
             if(errno == EINTR) {
@@ -300,12 +1731,36 @@ static copy_status copy_file(int srcfd, int srcflags, off64_t len,
 #endif
         }
         done = 0;
+        if(data == NULL) {
+            /* Copied by the kernel, already written */
+            done = amt;
+            destoff += amt;
+            len -= amt;
+            amt = 0;
+        }
         while(amt > 0) {
-            wrt = write(destfd, buf+done, amt);
-            if(amt == -1) {
+#ifdef USE_O_DIRECT
+            if(direct && ((destoff | amt | (uintptr_t) (data+done))
+                          & (DIRECTIO_ALIGN - 1)))
+            {
+                /* The unaligned tail goes through the page cache */
+                fcntl(destfd, F_SETFL, O_LARGEFILE);
+                direct = 0;
+            }
+#endif /* USE_O_DIRECT */
+            wrt = write(destfd, data+done, amt);
+            if(wrt == -1) {
                 if(errno == EINTR) {
                     continue;
                 }
+#ifdef USE_O_DIRECT
+                if(errno == EINVAL && direct) {
+                    /* Filesystem doesn't do O_DIRECT after all */
+                    fcntl(destfd, F_SETFL, O_LARGEFILE);
+                    direct = 0;
+                    continue;
+                }
+#endif /* USE_O_DIRECT */
 #ifdef DEBUG
                 perror("httpcacheopen: copy_file: write");
 #endif
@@ -317,7 +1772,17 @@ static copy_status copy_file(int srcfd, int srcflags, off64_t len,
             amt -= wrt;
             len -= wrt;
         }
-        if(destoff - flushoff >= CACHE_WRITE_FLUSH_WINDOW) {
+#if defined(IS_COPYD) && COPY_STREAMS_MAX > 1
+        if(streams) {
+            copy_streams_put(streams, srcoff - done);
+        }
+#endif
+#if defined(IS_COPYD) && COPY_RATE_MAX > 0
+        copy_throttle_wait(&bucket, done);
+#endif
+        /* Wake up readers waiting for this data */
+        cacheindex_progress(slot, realst, destoff);
+        if(destoff - flushoff >= window) {
             /* Start flushing the current write window */
             if(sync_file_range(destfd, flushoff, destoff - flushoff,
                         SYNC_FILE_RANGE_WRITE) != 0)
@@ -330,17 +1795,25 @@ static copy_status copy_file(int srcfd, int srcflags, off64_t len,
                chock full if incoming data rate is higher than the disks can
                handle, which will cause horrible read latencies for other
                requests while handling writes for this one */
-            if(flushoff >= CACHE_WRITE_FLUSH_WINDOW) {
-                if(sync_file_range(destfd, flushoff-CACHE_WRITE_FLUSH_WINDOW,
-                            CACHE_WRITE_FLUSH_WINDOW,
+            if(flushoff > waitoff) {
+                struct timespec start, end;
+
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if(sync_file_range(destfd, waitoff, flushoff - waitoff,
                             SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)
                         != 0)
                 {   
                     rc = COPY_FAIL;
                     goto exit;
                 }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                window = copy_flush_adapt(flushdev,
+                        (end.tv_sec - start.tv_sec) * 1000 +
+                        (end.tv_nsec - start.tv_nsec) / 1000000,
+                        openfunc, readfunc, closefunc);
             }
 
+            waitoff = flushoff;
             flushoff = destoff;
         }
     }
@@ -357,7 +1830,33 @@ static copy_status copy_file(int srcfd, int srcflags, off64_t len,
 
 
 exit:
-    free(buf);
+#if defined(IS_COPYD) && COPY_STREAMS_MAX > 1
+    if(streams) {
+        copy_streams_stop(streams);
+        free(streams);
+    }
+#endif
+#if defined(IS_COPYD) && COPY_RATE_MAX > 0
+    copy_throttle_stop(&bucket);
+#endif
+    copy_buf_put(buf);
+
+#ifdef __linux
+    if(pipefd[0] != -1) {
+        closefunc(pipefd[0]);
+        closefunc(pipefd[1]);
+    }
+#endif /* __linux */
+
+#ifdef USE_CACHERANGES
+    if(ranges.hdr) {
+        char rangespath[PATH_MAX];
+
+        cacheranges_close(&ranges, closefunc);
+        cacheranges_path(destfile, rangespath);
+        unlink(rangespath);
+    }
+#endif /* USE_CACHERANGES */
 
     if((closefunc(destfd)) == -1) {
 #ifdef DEBUG
@@ -370,10 +1869,13 @@ exit:
         struct utimbuf      ut;
         /* Set mtime on file to same as source */
         ut.actime = time(NULL);
-        ut.modtime = mtime;
+        ut.modtime = realst->st_mtime;
         utime(destfile, &ut);
     }
 
+    cacheindex_set(realst, rc == COPY_OK ? CACHEINDEX_COMPLETE :
+                   CACHEINDEX_ABSENT, 0);
+
     lseek64(srcfd, 0, SEEK_SET);
 
 #ifdef __sun
@@ -390,6 +1892,164 @@ exit:
 }
 
 
+#ifndef IS_COPYD
+/* Populating the cache from what a reader reads from the backend anyway.
+
+   copy_tee_start() creates the cached file, the data read is written to it
+   in order with copy_tee_write(), or copied from the backend file with
+   copy_tee_fill() when the reader used sendfile() and the data is in the
+   page cache. copy_tee_finish() marks the copy complete, or removes it if
+   the reader stopped short, it's up to the caller to have the rest copied
+   some other way rather than making the reader wait for it. */
+static int copy_tee_start(struct stat64 *realst, char *destfile,
+                          int (*openfunc)(const char *, int, ...),
+                          int (*statfunc)(const char *, struct stat64 *))
+{
+    cacheindex_entry_t  *slot;
+    int                 destfd;
+
+    /* Marked before the file shows up, as in copy_file() */
+    slot = cacheindex_set(realst, CACHEINDEX_COPYING, 0);
+    destfd = open_new_file(destfile, openfunc, statfunc);
+    if(destfd < 0) {
+        if(destfd != COPY_EXISTS) {
+            cacheindex_set(realst, CACHEINDEX_ABSENT, 0);
+        }
+        return(destfd);
+    }
+    cacheindex_progress(slot, realst, 0);
+
+#ifdef __linux
+    if(realst->st_size > 0 &&
+            fallocate(destfd, FALLOC_FL_KEEP_SIZE, 0, realst->st_size) != 0)
+    {
+#ifdef DEBUG
+        perror("copy_tee_start: fallocate");
+#endif
+    }
+#endif /* __linux */
+
+    return destfd;
+}
+
+
+/* Write amt bytes of data, read from the backend file at off, to destfd */
+static int copy_tee_write(int destfd, struct stat64 *realst, const char *data,
+                          size_t amt, off64_t off)
+{
+    ssize_t wrt;
+
+    while(amt > 0) {
+        wrt = pwrite64(destfd, data, amt, off);
+        if(wrt == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+#ifdef DEBUG
+            perror("httpcacheopen: copy_tee_write: pwrite64");
+#endif
+            return -1;
+        }
+        data += wrt;
+        off += wrt;
+        amt -= wrt;
+    }
+
+    /* Wake up readers waiting for this data */
+    cacheindex_progress(cacheindex_getslot(realst), realst, off);
+
+    return 0;
+}
+
+
+/* Copy len bytes at off from srcfd to destfd */
+static int copy_tee_fill(int srcfd, int destfd, struct stat64 *realst,
+                         off64_t off, off64_t len)
+{
+    char    *buf;
+    ssize_t amt;
+    int     rc = 0;
+
+    buf = copy_buf_get();
+    if(buf == NULL) {
+        return -1;
+    }
+
+    while(len > 0) {
+        amt = pread64(srcfd, buf, len < CPBUFSIZE ? len : CPBUFSIZE, off);
+        if(amt == -1 && errno == EINTR) {
+            continue;
+        }
+        if(amt <= 0 || copy_tee_write(destfd, realst, buf, amt, off) == -1) {
+#ifdef DEBUG
+            perror("httpcacheopen: copy_tee_fill");
+#endif
+            rc = -1;
+            break;
+        }
+        off += amt;
+        len -= amt;
+    }
+
+    copy_buf_put(buf);
+
+    return rc;
+}
+
+
+/* Complete the copy to destfd, done up to off */
+static copy_status copy_tee_finish(int destfd, struct stat64 *realst,
+                         char *destfile, off64_t off,
+                         int (*fstat64func)(int filedes, struct stat64 *buf),
+                         int (*closefunc)(int fd))
+{
+    struct stat64   st;
+    struct utimbuf  ut;
+    copy_status     rc = COPY_OK;
+
+    if(fstat64func(destfd, &st) == -1 || st.st_nlink == 0) {
+        /* Removed as stale, the path might be someone else's by now */
+#ifdef DEBUG
+        fprintf(stderr, "httpcacheopen: copy_tee_finish: destfd unlinked\n");
+#endif
+        closefunc(destfd);
+        return COPY_FAIL;
+    }
+
+    if(off < realst->st_size) {
+#ifdef DEBUG
+        fprintf(stderr, "httpcacheopen: copy_tee_finish: stopped at %lld "
+                "of %lld bytes\n", (long long)off,
+                (long long)realst->st_size);
+#endif
+        rc = COPY_FAIL;
+    }
+
+    if(closefunc(destfd) == -1) {
+#ifdef DEBUG
+        perror("httpcacheopen: copy_tee_finish: close destfd");
+#endif
+        rc = COPY_FAIL;
+    }
+
+    if(rc == COPY_OK) {
+        /* Set mtime on file to same as source */
+        ut.actime = time(NULL);
+        ut.modtime = realst->st_mtime;
+        utime(destfile, &ut);
+    }
+    else {
+        unlink(destfile);
+    }
+
+    cacheindex_set(realst, rc == COPY_OK ? CACHEINDEX_COMPLETE :
+                   CACHEINDEX_ABSENT, 0);
+
+    return rc;
+}
+#endif /* IS_COPYD */
+
+
 static int cacheopen_check(const char *path) {
 
     if(strncmp(path, backend_root, backend_len)) {
@@ -405,19 +2065,13 @@ static int cacheopen_check(const char *path) {
 
 
 /* Given realst, constructs cachepath. cachepath is assumed to be
-   large enough */
-static void cacheopen_prepare(struct stat64 *realst, char *cachepath) 
+   large enough. Returns the state of the file according to the cache
+   index. */
+static int cacheopen_prepare(struct stat64 *realst, char *cachepath) 
 {
     unsigned long long  inode, device;
     char                devinostr[34];
-    int                 len;
-
-    /* Hash on device:inode to eliminate file duplication. Since we only
-       can serve plain files we don't have to bother with all the special
-       cases in mod_disk_cache :) */
-    device = realst->st_dev; /* Avoid ifdef-hassle with types */
-    inode  = realst->st_ino;
-    snprintf(devinostr, sizeof(devinostr), "%016llx:%016llx", device, inode);
+    int                 len, state;
 
     /* Calculate cachepath. We simply put large files in a separate path
        intended to separate the contention point for large and small files */
@@ -429,8 +2083,22 @@ static void cacheopen_prepare(struct stat64 *realst, char *cachepath)
         strcpy(cachepath, bfcache_root);
         len = bfcache_len;
     }
+
+    /* Always hashed here rather than trusting a path from the index, the
+       index is writable by every process using the cache */
+    state = cacheindex_lookup(realst, NULL);
+
+    /* Hash on device:inode to eliminate file duplication. Since we only
+       can serve plain files we don't have to bother with all the special
+       cases in mod_disk_cache :) */
+    device = realst->st_dev; /* Avoid ifdef-hassle with types */
+    inode  = realst->st_ino;
+    snprintf(devinostr, sizeof(devinostr), "%016llx:%016llx", device, inode);
+
     cache_hash(devinostr, cachepath+len, DIRLEVELS, DIRLENGTH);
     strcat(cachepath, CACHE_BODY_SUFFIX);
+
+    return state;
 }
 
 
@@ -448,21 +2116,29 @@ static int cacheopen(struct stat64 *cachest, struct stat64 *realst,
                      int (*fstat64func)(int filedes, struct stat64 *buf),
                      int (*closefunc)(int fd))
 {
-    int                 cachefd;
+    int                 cachefd, state;
 
     /* Only cache regular files larger than 0 bytes */
     if(!S_ISREG(realst->st_mode) || realst->st_size == 0) {
         return CACHEOPEN_DECLINED;
     }
 
+    state = cacheindex_lookup(realst, NULL);
+
     cachefd = openfunc(cachepath, oflag);
     if(cachefd == -1) {
 #ifdef DEBUG
         perror("cacheopen: Unable to open cachepath");
 #endif
+        if(errno == ENOENT && state != CACHEINDEX_ABSENT) {
+            cacheindex_set(realst, CACHEINDEX_ABSENT, 1);
+        }
         return CACHEOPEN_FAIL;
     }
 
+    /* Even with the index saying it's complete: the file might have been
+       replaced behind its back, and a short file passed off as complete
+       means truncated downloads */
     if(fstat64func(cachefd, cachest) == -1) {
 #ifdef DEBUG
         perror("cacheopen: Unable to fstat cachefd");
@@ -482,9 +2158,19 @@ static int cacheopen(struct stat64 *cachest, struct stat64 *realst,
 #ifdef DEBUG
         fprintf(stderr, "cacheopen: cached file stale\n");
 #endif
+        cacheindex_set(realst, CACHEINDEX_ABSENT, 1);
         return CACHEOPEN_STALE;
     }
 
+    if(cachest->st_size == realst->st_size) {
+        if(state != CACHEINDEX_COMPLETE) {
+            cacheindex_set(realst, CACHEINDEX_COMPLETE, 0);
+        }
+    }
+    else if(state != CACHEINDEX_COPYING) {
+        cacheindex_set(realst, CACHEINDEX_COPYING, 0);
+    }
+
 #ifdef DEBUG
     fprintf(stderr, "cacheopen: Success, returning cached fd %d (%s)\n", 
             cachefd, cachepath);
@@ -494,52 +2180,111 @@ static int cacheopen(struct stat64 *cachest, struct stat64 *realst,
 }
 
 
+/* The copyd protocol.
+
+   A request starts with a copyd_req_t. In version 1 it's followed by the
+   null terminated path of the backend file, in version 2 the open backend
+   fd is passed along with it instead, so copyd doesn't have to look
+   anything up. A bare path, as from older clients, starts with a '/'
+   instead of the magic.
+
+   Version 2 requests are answered with a copyd_reply_t, along with an fd
+   for the cached file if there is one. Version 3 is version 2 without a
+   reply, the client reads the backend file and goes looking for the
+   cached file later on. The others get "OK", "QUEUED" or "FAIL" as a null
+   terminated string. */
+#define COPYD_REQ_MAGIC         0x48435253 /* HCRS */
+#define COPYD_REPLY_MAGIC       0x48435250 /* HCRP */
+#define COPYD_PROTO_PATH        1
+#define COPYD_PROTO_FD          2
+#define COPYD_PROTO_ASYNC       3
+
+typedef struct copyd_req_t {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    dev;
+    uint64_t    ino;
+    int64_t     size;
+    int64_t     mtime;
+} copyd_req_t;
+
+typedef enum copyd_status {
+    COPYD_OK = 0,               /* Being copied, or cached already */
+    COPYD_QUEUED,               /* Will be copied later */
+    COPYD_FAIL
+} copyd_status;
+
+typedef struct copyd_reply_t {
+    uint32_t    magic;
+    uint32_t    status;         /* copyd_status */
+} copyd_reply_t;
+
+#define COPYD_NOFD              -2 /* copyd_file(): OK, but no fd */
+
+
 #ifdef USE_COPYD
-static int copyd_file(char *file,
-                      ssize_t (*readfunc)(int fd, void *buf, size_t count),
-                      int (*closefunc)(int fd))
-{
-    struct sockaddr_un sa;
-    int rc;
-    int sock=-1;
-    struct sigaction oldsig;
-    char buf[10]; /* Should only get "OK\0" or "FAIL\0" */
-    ssize_t amt;
+/* Connection to copyd, opened on first use and kept for the life of the
+   process. Requests are serialized by copyd_socklock, copyd answers them
+   in order. Version 3 requests aren't answered at all. A version 2 reply
+   can take as long as it takes copyd to create the cached file, so the
+   lock is one that sleeps. Not forever though, a reply that doesn't come
+   within COPYD_REPLY_TIMEOUT costs the connection. */
+static int              copyd_sock = -1;
+static pthread_mutex_t  copyd_socklock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* The application closed fd or had it replaced. If it was our connection
+   it's gone, nothing we can do about that. */
+static inline void copyd_closed(int fd) {
+    int sock = fd;
+
+    if(fd >= 0) {
+        __atomic_compare_exchange_n(&copyd_sock, &sock, -1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+}
 
-#ifdef DEBUG
-    fprintf(stderr, "copyd_file: file=%s\n", file);
-#endif
 
-    if(sigaction(SIGPIPE, NULL, &oldsig) == -1) {
-#ifdef DEBUG
-        perror("copyd_file: sigaction get");
-#endif
-        return -1;
+/* In the child after fork(). The connection is shared with the parent,
+   whose replies we'd be stealing, and the lock might have been held by a
+   thread that didn't come along. */
+static void copyd_forked(int (*closefunc)(int fd)) {
+
+    pthread_mutex_init(&copyd_socklock, NULL);
+    if(copyd_sock != -1) {
+        closefunc(copyd_sock);
+        copyd_sock = -1;
     }
+}
+
 
-    if(oldsig.sa_flags & SA_SIGINFO || oldsig.sa_handler != SIG_IGN) {
-        struct sigaction newsig;
+/* Make sure copyd_sock is our connection to copyd. Called with
+   copyd_socklock held. */
+static int copyd_connect(int (*closefunc)(int fd)) {
+    struct sockaddr_un  sa;
+    struct timeval      tv;
+    int                 sock;
+
+    if(copyd_sock != -1) {
+        return 0;
+    }
 
-        /* Ignore those pesky SIGPIPE:s */
-        newsig.sa_handler = SIG_IGN;
-        newsig.sa_sigaction = NULL;
-        sigemptyset(&newsig.sa_mask);
-        newsig.sa_flags = 0;
-        if(sigaction(SIGPIPE, &newsig, &oldsig) == -1) {
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
 #ifdef DEBUG
-            perror("copyd_file: sigaction set");
+        perror("copyd_connect: socket");
 #endif
-            return -1;
-        }
+        return -1;
     }
 
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if(sock == -1) {
+    tv.tv_sec = COPYD_REPLY_TIMEOUT;
+    tv.tv_usec = 0;
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
 #ifdef DEBUG
-        perror("copyd_file: socket");
+        perror("copyd_connect: setsockopt");
 #endif
-        rc = -1;
-        goto err;
+        closefunc(sock);
+        return -1;
     }
 
     sa.sun_family = AF_UNIX;
@@ -547,64 +2292,224 @@ static int copyd_file(char *file,
 
     if(connect(sock, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
 #ifdef DEBUG
-        perror("copyd_file: connect");
+        perror("copyd_connect: connect");
 #endif
-        rc = -1;
-        goto err;
+        closefunc(sock);
+        return -1;
     }
 
-    amt = strlen(file)+1;
-    rc=write(sock, file, amt);
-    if(rc != amt) {
+    copyd_sock = sock;
+
+    return 0;
+}
+
+
+/* Send req and realfd over the copyd connection. Returns -1 if the
+   connection is broken, 1 if it would block with MSG_DONTWAIT in flags.
+   Called with copyd_socklock held. */
+static int copyd_send(copyd_req_t *req, int realfd, int flags) {
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr  *cmsg;
+    union {
+        char            buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } ctl;
+    ssize_t         amt;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &realfd, sizeof(int));
+
+    do {
+        amt = sendmsg(copyd_sock, &msg, MSG_NOSIGNAL | flags);
+    } while(amt == -1 && errno == EINTR);
+    if(amt == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    }
+    if(amt != sizeof(*req)) {
 #ifdef DEBUG
-        perror("copyd_file: write");
+        perror("copyd_send: sendmsg");
 #endif
-        goto err;
+        return -1;
     }
 
-#ifdef DEBUG
-    fprintf(stderr, "copyd_file: wrote '%s' rc=%d\n", file, rc);
-#endif
+    return 0;
+}
+
 
-    rc = readfunc(sock, buf, sizeof(buf));
-    if(rc == -1) {
+/* Send req and realfd over the copyd connection and get the reply.
+   *cachefd is set to the fd passed back, if any. Returns -1 if the
+   connection is broken, 1 if the reply didn't come in time. Either way
+   the connection is of no further use. Called with copyd_socklock
+   held. */
+static int copyd_request(copyd_req_t *req, int realfd, copyd_reply_t *rep,
+                         int *cachefd, int (*closefunc)(int fd))
+{
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr  *cmsg;
+    union {
+        char            buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } ctl;
+    ssize_t         amt;
+    size_t          len = 0;
+    int             timedout = 0;
+
+    if(copyd_send(req, realfd, 0) != 0) {
+        return -1;
+    }
+
+    *cachefd = -1;
+    while(len < sizeof(*rep)) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (char *) rep + len;
+        iov.iov_len = sizeof(*rep) - len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        amt = recvmsg(copyd_sock, &msg, MSG_CMSG_CLOEXEC);
+        if(amt == -1 && errno == EINTR) {
+            continue;
+        }
+        if(amt <= 0) {
 #ifdef DEBUG
-        perror("copyd_file: read");
+            perror("copyd_request: recvmsg");
 #endif
-        goto err;
+            timedout = amt == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
+        }
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if(cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_RIGHTS && *cachefd == -1)
+        {
+            memcpy(cachefd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        len += amt;
+    }
+
+    if(len < sizeof(*rep) || rep->magic != COPYD_REPLY_MAGIC) {
+        if(*cachefd != -1) {
+            closefunc(*cachefd);
+            *cachefd = -1;
+        }
+        return timedout ? 1 : -1;
     }
-    else if(rc < 1) {
+
+    return 0;
+}
+
+
+static void copyd_mkreq(copyd_req_t *req, int version,
+                        struct stat64 *realst)
+{
+    memset(req, 0, sizeof(*req));
+    req->magic = COPYD_REQ_MAGIC;
+    req->version = version;
+    req->dev = realst->st_dev;
+    req->ino = realst->st_ino;
+    req->size = realst->st_size;
+    req->mtime = realst->st_mtime;
+}
+
+
+/* Ask copyd to copy the file open as realfd. Returns an fd for the cached
+   file, COPYD_NOFD if it's being copied but there is no fd to be had, or
+   -1 if the file should be read directly. */
+static int copyd_file(int realfd, struct stat64 *realst,
+                      int (*closefunc)(int fd))
+{
+    int rc, tries, cachefd = -1;
+    copyd_req_t req;
+    copyd_reply_t rep;
+
 #ifdef DEBUG
-        fprintf(stderr, "copyd_file: short read\n");
+    fprintf(stderr, "copyd_file: realfd=%d ino=%llu\n", realfd,
+            (unsigned long long)realst->st_ino);
 #endif
-        rc = -1;
-        goto err;
+
+    copyd_mkreq(&req, COPYD_PROTO_FD, realst);
+
+    pthread_mutex_lock(&copyd_socklock);
+    rc = -1;
+    /* Try again with a new connection if copyd has been restarted */
+    for(tries=0; rc == -1 && tries < 2; tries++) {
+        if(copyd_connect(closefunc) == -1) {
+            break;
+        }
+        rc = copyd_request(&req, realfd, &rep, &cachefd, closefunc);
+        if(rc != 0) {
+            /* A late reply would be taken for that of the next request */
+            closefunc(copyd_sock);
+            copyd_sock = -1;
+        }
+    }
+    pthread_mutex_unlock(&copyd_socklock);
+
+    if(rc != 0) {
+        return -1;
     }
-    buf[rc-1] = '\0';
 
 #ifdef DEBUG
-    fprintf(stderr, "copyd_file: read '%s' rc=%d\n", buf, rc);
+    fprintf(stderr, "copyd_file: status %u cachefd %d\n", rep.status,
+            cachefd);
 #endif
 
-    if(!strcmp(buf, "OK")) {
-        rc = 0;
-    }
-    else {
-        rc = -1;
+    if(rep.status == COPYD_OK) {
+        return cachefd >= 0 ? cachefd : COPYD_NOFD;
     }
 
-err:
-    if(sock >= 0) {
-        closefunc(sock);
+    /* QUEUED means the copy will be done later, read the file directly
+       for now */
+    if(cachefd >= 0) {
+        closefunc(cachefd);
     }
-    if(oldsig.sa_flags & SA_SIGINFO || oldsig.sa_handler != SIG_IGN) {
-        if(sigaction(SIGPIPE, &oldsig, NULL) == -1) {
+    return -1;
+}
+
+
+/* Ask copyd to copy the file open as realfd without waiting for it to
+   answer. Returns 0 if the request was sent, -1 otherwise. */
+static int copyd_file_async(int realfd, struct stat64 *realst,
+                            int (*closefunc)(int fd))
+{
+    int rc, tries;
+    copyd_req_t req;
+
 #ifdef DEBUG
-            perror("copyd_file: restore sigaction");
+    fprintf(stderr, "copyd_file_async: realfd=%d ino=%llu\n", realfd,
+            (unsigned long long)realst->st_ino);
 #endif
+
+    copyd_mkreq(&req, COPYD_PROTO_ASYNC, realst);
+
+    pthread_mutex_lock(&copyd_socklock);
+    rc = -1;
+    for(tries=0; rc == -1 && tries < 2; tries++) {
+        if(copyd_connect(closefunc) == -1) {
+            break;
+        }
+        /* A full socket buffer means copyd is swamped, don't add to it */
+        rc = copyd_send(&req, realfd, MSG_DONTWAIT);
+        if(rc == -1) {
+            closefunc(copyd_sock);
+            copyd_sock = -1;
         }
     }
+    pthread_mutex_unlock(&copyd_socklock);
 
-    return rc;
+    return rc == 0 ? 0 : -1;
 }
 #endif /* USE_COPYD */
@@ -0,0 +1,261 @@
+/*
+ * Copyright 2006-2019 Niklas Edmundsson <nikke@acc.umu.se>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Sidecar files for data fetched out of order.
+
+   The cached file must be written front to back, mod_cache_disk_largefile
+   does read-while-caching based on the file size. Data fetched ahead of
+   the sequential copy for blocked readers instead goes into a sparse
+   sidecar file named as the cached file with CACHE_RANGES_SUFFIX added.
+
+   The sidecar starts with a header holding a bitmap of the
+   CACHE_RANGE_CHUNK sized chunks present, followed by the data at the
+   same offset as in the real file. The header is mmap:ed by the copy and
+   the readers, a chunk bit is only set after its data is written.
+
+   The sidecar is removed when the copy is done, readers having it open
+   can still use it.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+
+typedef struct cacheranges_t {
+    struct cacheranges_hdr_t    *hdr;   /* mmap:ed header, NULL if none */
+    size_t                      hdrlen;
+    int                         fd;
+} cacheranges_t;
+
+#ifdef USE_CACHERANGES
+
+#define CACHERANGES_MAGIC       0x48435247 /* HCRG */
+
+typedef struct cacheranges_hdr_t {
+    uint32_t    magic;
+    uint32_t    chunk;          /* CACHE_RANGE_CHUNK */
+    uint64_t    dev;            /* Backend device */
+    uint64_t    ino;            /* Backend inode */
+    int64_t     size;           /* Backend size */
+    int64_t     mtime;          /* Backend mtime */
+    int64_t     datastart;      /* Offset of data, same as header size */
+    uint64_t    bitmap[];       /* Chunks present */
+} cacheranges_hdr_t;
+
+
+static inline int64_t cacheranges_nchunks(off64_t size) {
+    return (size + CACHE_RANGE_CHUNK - 1) / CACHE_RANGE_CHUNK;
+}
+
+
+/* Header size, rounded up to a page so the data is page aligned */
+static size_t cacheranges_hdrlen(off64_t size) {
+    size_t  len;
+
+    len = sizeof(cacheranges_hdr_t) +
+          (cacheranges_nchunks(size) + 63) / 64 * sizeof(uint64_t);
+
+    return (len + 4095) & ~(size_t)4095;
+}
+
+
+/* Sidecar path for the cached file cachepath. buf is assumed to be
+   large enough. */
+static void cacheranges_path(const char *cachepath, char *buf) {
+
+    strcpy(buf, cachepath);
+    strcat(buf, CACHE_RANGES_SUFFIX);
+}
+
+
+static int cacheranges_map(cacheranges_t *cr, int fd, struct stat64 *realst,
+                           int prot)
+{
+    cacheranges_hdr_t   *hdr;
+    size_t              hdrlen = cacheranges_hdrlen(realst->st_size);
+
+    hdr = mmap(NULL, hdrlen, prot, MAP_SHARED, fd, 0);
+    if(hdr == MAP_FAILED) {
+#ifdef DEBUG
+        perror("cacheranges_map: mmap");
+#endif
+        return -1;
+    }
+
+    cr->hdr = hdr;
+    cr->hdrlen = hdrlen;
+    cr->fd = fd;
+
+    return 0;
+}
+
+
+/* Create the sidecar for a copy of realst to cachepath, replacing any
+   leftovers from an earlier copy */
+static int cacheranges_create(cacheranges_t *cr, const char *cachepath,
+                              struct stat64 *realst,
+                              int (*openfunc)(const char *, int, ...),
+                              int (*closefunc)(int fd))
+{
+    char                path[PATH_MAX];
+    int                 fd;
+    cacheranges_hdr_t   *hdr;
+
+    cacheranges_path(cachepath, path);
+    unlink(path);
+    fd = openfunc(path, O_RDWR | O_CREAT | O_EXCL | O_LARGEFILE,
+                  S_IRUSR | S_IWUSR);
+    if(fd == -1) {
+#ifdef DEBUG
+        perror("cacheranges_create: open");
+#endif
+        return -1;
+    }
+
+    /* Sparse, only the chunks fetched take up space */
+    if(ftruncate(fd, cacheranges_hdrlen(realst->st_size) + realst->st_size)
+            == -1 || cacheranges_map(cr, fd, realst, PROT_READ | PROT_WRITE))
+    {
+#ifdef DEBUG
+        perror("cacheranges_create: ftruncate/mmap");
+#endif
+        closefunc(fd);
+        unlink(path);
+        return -1;
+    }
+
+    hdr = cr->hdr;
+    hdr->chunk = CACHE_RANGE_CHUNK;
+    hdr->dev = realst->st_dev;
+    hdr->ino = realst->st_ino;
+    hdr->size = realst->st_size;
+    hdr->mtime = realst->st_mtime;
+    hdr->datastart = cr->hdrlen;
+    __atomic_store_n(&hdr->magic, CACHERANGES_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+
+/* Open the sidecar of cachepath, if there is one for this version of
+   realst */
+static inline int cacheranges_open(cacheranges_t *cr,
+                                   const char *cachepath,
+                                   struct stat64 *realst,
+                                   int (*openfunc)(const char *, int, ...),
+                                   int (*fstat64func)(int filedes,
+                                                      struct stat64 *buf),
+                                   int (*closefunc)(int fd))
+{
+    char                path[PATH_MAX];
+    int                 fd;
+    struct stat64       st;
+    cacheranges_hdr_t   *hdr;
+
+    cacheranges_path(cachepath, path);
+    fd = openfunc(path, O_RDONLY | O_LARGEFILE);
+    if(fd == -1) {
+        return -1;
+    }
+
+    /* Might be freshly created and not extended yet */
+    if(fstat64func(fd, &st) == -1 ||
+            st.st_size < (off64_t) cacheranges_hdrlen(realst->st_size) ||
+            cacheranges_map(cr, fd, realst, PROT_READ))
+    {
+        closefunc(fd);
+        return -1;
+    }
+
+    hdr = cr->hdr;
+    if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != CACHERANGES_MAGIC ||
+            hdr->chunk != CACHE_RANGE_CHUNK ||
+            hdr->dev != (uint64_t) realst->st_dev ||
+            hdr->ino != (uint64_t) realst->st_ino ||
+            hdr->size != realst->st_size || hdr->mtime != realst->st_mtime ||
+            hdr->datastart != (int64_t) cr->hdrlen)
+    {
+#ifdef DEBUG
+        fprintf(stderr, "cacheranges_open: %s not for this file\n", path);
+#endif
+        munmap(cr->hdr, cr->hdrlen);
+        cr->hdr = NULL;
+        closefunc(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void cacheranges_close(cacheranges_t *cr, int (*closefunc)(int fd)) {
+
+    if(cr->hdr) {
+        munmap(cr->hdr, cr->hdrlen);
+        closefunc(cr->fd);
+        cr->hdr = NULL;
+    }
+}
+
+
+static inline int cacheranges_has(cacheranges_t *cr, int64_t chunk) {
+
+    return (__atomic_load_n(&cr->hdr->bitmap[chunk / 64], __ATOMIC_ACQUIRE)
+            >> (chunk % 64)) & 1;
+}
+
+
+/* Mark chunk as present, its data must be written already */
+static inline void cacheranges_mark(cacheranges_t *cr, int64_t chunk) {
+
+    __atomic_or_fetch(&cr->hdr->bitmap[chunk / 64], 1ULL << (chunk % 64),
+                      __ATOMIC_RELEASE);
+}
+
+
+/* Number of bytes readable from the sidecar at off */
+static off64_t cacheranges_avail(cacheranges_t *cr, off64_t off) {
+    int64_t     chunk, nchunks;
+    off64_t     end;
+
+    if(!cr->hdr || off < 0 || off >= cr->hdr->size) {
+        return 0;
+    }
+
+    nchunks = cacheranges_nchunks(cr->hdr->size);
+    for(chunk = off / CACHE_RANGE_CHUNK; chunk < nchunks; chunk++) {
+        if(!cacheranges_has(cr, chunk)) {
+            break;
+        }
+    }
+
+    end = chunk * (off64_t) CACHE_RANGE_CHUNK;
+    if(end > cr->hdr->size) {
+        end = cr->hdr->size;
+    }
+
+    return end > off ? end - off : 0;
+}
+
+#else /* USE_CACHERANGES */
+
+static inline off64_t cacheranges_avail(cacheranges_t *cr, off64_t off) {
+    (void) cr; (void) off;
+    return 0;
+}
+
+#endif /* USE_CACHERANGES */
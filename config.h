@@ -23,8 +23,69 @@
 
 #define CPBUFSIZE               262144
 
-/* Size of window to flush when writing */
-#define CACHE_WRITE_FLUSH_WINDOW 8388608
+/* Files at least this large are read from the backend by several
+   concurrent streams in copyd, a single stream rarely gets anywhere near
+   the bandwidth of a network filesystem. The number of streams in use
+   adapts to the throughput measured every COPY_STREAMS_INTERVAL bytes.
+   Set COPY_STREAMS_MAX to 1 to disable. */
+#define COPY_STREAMS_MINSIZE    (64*1024*1024) /* in bytes */
+#define COPY_STREAMS_MAX        8
+#define COPY_STREAMS_INTERVAL   (32*1024*1024) /* in bytes */
+
+/* Use io_uring to keep up to COPY_URING_DEPTH backend reads in flight
+   from the copying thread instead of running stream threads. Falls back
+   to threads if the kernel doesn't support it. */
+#ifdef __linux
+#define USE_IO_URING
+#endif /* __linux */
+#define COPY_URING_DEPTH        16      /* At most 2*COPY_STREAMS_MAX */
+
+/* Copy files for the bfcache_root hierarchy with O_DIRECT on both the
+   backend and the cached file, so filling the cache with huge files
+   doesn't push the small hot ones out of the page cache. The unaligned
+   tail of a file is written through the page cache. */
+#ifdef __linux
+#define USE_O_DIRECT
+#endif /* __linux */
+#define DIRECTIO_ALIGN          4096    /* in bytes, CPBUFSIZE multiple of */
+
+/* copyd shares COPY_RATE_MAX bytes/s between the copies in progress,
+   evenly unless some are idle (see below). On Linux the rate is halved
+   when /proc/pressure/io shows tasks stalled on I/O more than
+   COPY_PSI_TARGET percent of the time, and stepped up by COPY_RATE_STEP
+   every COPY_PSI_INTERVAL otherwise. Set COPY_RATE_MAX to 0 to
+   disable. */
+#define COPY_RATE_MAX           (1024*1024*1024) /* in bytes/s */
+#define COPY_RATE_MIN           (8*1024*1024)   /* in bytes/s */
+#define COPY_RATE_STEP          (32*1024*1024)  /* in bytes/s */
+#define COPY_PSI_TARGET         10              /* in percent */
+#define COPY_PSI_INTERVAL       1000            /* in ms */
+
+/* Readers of a file being copied by copyd leave a timestamp in the cache
+   index. A copy nobody has read from for COPY_IDLE_DEMOTE seconds only
+   gets 1/COPY_IDLE_WEIGHT of the bandwidth share of one being read. If
+   the file is at least COPY_IDLE_MINSIZE bytes the copy is abandoned
+   after COPY_IDLE_ABANDON seconds without readers, the next request
+   starts it over. */
+#define COPY_IDLE_DEMOTE        10              /* in seconds */
+#define COPY_IDLE_WEIGHT        8
+#define COPY_IDLE_ABANDON       120             /* in seconds */
+#define COPY_IDLE_MINSIZE       (256*1024*1024) /* in bytes */
+
+/* Memory set aside by copyd for copy buffers, each copy of a large file
+   uses 2*COPY_STREAMS_MAX of them. Beyond this they're allocated per
+   copy. Set to 0 to always allocate. */
+#define COPY_ARENA_SIZE         (64*1024*1024) /* in bytes */
+
+/* Size of window to flush when writing. It's adapted for each cache
+   device, between CACHE_WRITE_FLUSH_MIN and CACHE_WRITE_FLUSH_MAX, so that
+   waiting for a flush and reads from the device take about
+   CACHE_WRITE_FLUSH_LATENCY. */
+#define CACHE_WRITE_FLUSH_WINDOW 8388608        /* Initial, in bytes */
+#define CACHE_WRITE_FLUSH_MIN   1048576         /* in bytes */
+#define CACHE_WRITE_FLUSH_MAX   134217728       /* in bytes */
+#define CACHE_WRITE_FLUSH_LATENCY 50            /* in ms */
+#define CACHE_WRITE_FLUSH_DEVS  16              /* Devices to keep track of */
 
 #define CACHE_UPDATE_TIMEOUT    30      /* Note! In seconds! */
 
@@ -40,14 +101,70 @@
    a file or data in file when doing read-while-caching. */
 #define CACHE_LOOP_SLEEP        50 /* in ms, lower than 1s */
 
+/* When the copy publishes its progress in the cache index we're woken up
+   as soon as there is new data. This is how long to wait for a wakeup
+   before having a look at the cached file anyway. */
+#define CACHE_PROGRESS_WAIT     1000 /* in ms */
+
 #ifdef USE_COPYD
-#define CACHE_MAXFD             32768
+/* Files over MAX_COPY_SIZE are read from the backend while copyd copies
+   them, looking for the cached file every CACHE_SWITCH_INTERVAL bytes.
+   Once the copy is ahead of the reader the fd is switched over to it. */
+#define CACHE_SWITCH_INTERVAL   (4*1024*1024) /* in bytes */
+
+/* Readers that get ahead of the copy read from the backend file instead
+   of waiting, sendfile() does so at most CACHE_BACKEND_CHUNK bytes at a
+   time before checking if the copy has caught up. */
+#define CACHE_BACKEND_CHUNK     (4*1024*1024) /* in bytes */
 #endif
 
+/* Remember the stat of backend files for this long, so cache hits don't
+   need to touch the backend at all. Set to 0 to always stat the backend. */
+#define STATCACHE_TTL           10      /* In seconds */
+#define STATCACHE_SIZE          1024    /* Entries, must be a power of two */
+
 #define COPYD_USER              "www-ftp"
 
+/* copyd runs at most COPYD_WORKERS copies at a time, with up to
+   COPYD_QUEUE_MAX more waiting. Queued copies are started in order of
+   requests per byte, requesters are told to read the file directly in
+   the meantime. COPYD_REQTHREADS threads handle the requests coming in
+   over the client connections. */
+#define COPYD_WORKERS           8
+#define COPYD_QUEUE_MAX         256     /* Each holds a backend fd */
+#define COPYD_REQTHREADS        64
+#define COPYD_INFLIGHT_BUCKETS  512     /* Hash table of queued/running */
+
+/* Single request copies of files this large get the lowest best-effort
+   I/O priority */
+#define COPYD_IDLEPRIO_SIZE     (1024LL*1024*1024) /* in bytes */
+
 #define SOCKPATH                "/run/.cachecopyd.sock"
 
+/* Give up on a copyd reply after this long and read the file directly */
+#define COPYD_REPLY_TIMEOUT     5       /* In seconds */
+
+/* Shared memory index of cached files, keyed on backend device:inode.
+   Lets us tell a hit from a miss without probing the cache hierarchy.
+   Relies on gcc atomics, so only enabled on Linux for now. */
+#ifdef __linux
+#define USE_CACHEINDEX
+#endif /* __linux */
+#define CACHEINDEX_PATH         "/dev/shm/.httpcacheindex"
+#define CACHEINDEX_SLOTS        65536   /* Must be a power of two */
+#define CACHEINDEX_PROBES       8       /* Slots to search for an entry */
+#define CACHEINDEX_WANTS        3       /* Out of order requests per file */
+
+/* Readers blocked this far ahead of a copy in progress get their data
+   fetched out of order into a sidecar file next to the cached file, the
+   cached file itself is always written sequentially. Needs the cache
+   index to tell copyd what to fetch. */
+#ifdef USE_CACHEINDEX
+#define USE_CACHERANGES
+#endif /* USE_CACHEINDEX */
+#define CACHE_RANGE_CHUNK       4194304 /* in bytes, multiple of CPBUFSIZE */
+#define CACHE_RANGES_SUFFIX     ".ranges"
+
 static const char backend_root[]    = "/export/ftp/";
 static const int  backend_len       = sizeof(backend_root)-1;
 
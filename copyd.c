@@ -46,6 +46,10 @@ static const char rcsid[] = "$Id: httpcachecopyd " GIT_SOURCE_DESC " $";
 #include <stdlib.h>
 #include <limits.h>
 #include <pwd.h>
+#include <sys/epoll.h>
+#ifdef __linux
+#include <sys/syscall.h>
+#endif /* __linux */
 
 
 #include "config.h"
@@ -60,58 +64,520 @@ static const char rcsid[] = "$Id: httpcachecopyd " GIT_SOURCE_DESC " $";
 
 static int debug=1;
 
-void *handle_conn(void * arg) {
+static volatile sig_atomic_t dumpstats = 0;
 
-    /* To avoid the bogus gcc cast to/from pointer of different size warning */
-    size_t argtmp = (size_t) arg;
-    int fd = (int) argtmp;
+static void sigusr1(int sig) {
+    (void) sig;
+    dumpstats = 1;
+}
 
-    char buf[PATH_MAX], cachepath[PATH_MAX];
-    ssize_t amt;
-    int realfd = -1, cachefd = -1, oflag;
-    struct stat64 realst, cachest;
 
-    if(debug) {
-        fprintf(stderr, "copyd: handle_conn: fd=%d\n", fd);
+/* Reply to a version 2 request, passing cachefd along unless it's -1.
+   Version 3 requests have no connection to reply to, fd is -1. */
+static void reply_fd(int fd, copyd_status status, int cachefd) {
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr  *cmsg;
+    union {
+        char            buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    } ctl;
+    copyd_reply_t   rep;
+
+    if(fd == -1) {
+        return;
     }
 
-    amt = read(fd, buf, sizeof(buf)-1);
-    if(amt == -1) {
-        perror("handle_conn: read");
-        goto err;
+    rep.magic = COPYD_REPLY_MAGIC;
+    rep.status = status;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &rep;
+    iov.iov_len = sizeof(rep);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(cachefd != -1) {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &cachefd, sizeof(int));
     }
-    else if(amt == 0) {
+
+    if(sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
         if(debug) {
-            fprintf(stderr, "copyd: handle_conn: read: no data\n");
+            perror("copyd: reply_fd");
         }
-        goto err;
     }
+}
+
+
+/* Copies are done by COPYD_WORKERS worker threads, fed from a queue.
+   The next copy is the one with the most requests per byte to copy, so
+   small and popular files go first.
+
+   Queued and running copies are also kept in a hash table on backend
+   device:inode, so duplicate requests can be answered without touching
+   the filesystem.
+
+   Version 2 requests for a copy that is about to start are answered by
+   the worker, with an fd for the cached file as soon as it's created. */
+#define COPYJOB_WAITERS         16
+
+typedef struct copyjob_t {
+    int                 realfd;
+    int                 oflag;
+    struct stat64       realst;
+    char                cachepath[PATH_MAX];
+    int                 requests;       /* Times requested while queued */
+    int                 running;
+    int                 opened;         /* cachepath created */
+    int                 nwaiters;
+    int                 waiters[COPYJOB_WAITERS]; /* Connections to reply to */
+    struct copyjob_t    *next;          /* In hash bucket */
+} copyjob_t;
+
+static pthread_mutex_t  queuelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   queuecond = PTHREAD_COND_INITIALIZER; /* Job queued */
+static copyjob_t        *queue[COPYD_QUEUE_MAX];
+static copyjob_t        *inflight[COPYD_INFLIGHT_BUCKETS];
+static int              queuelen = 0;
+static int              idleworkers = 0;
+static int              nconns = 0;
+
+
+static inline copyjob_t **copyjob_bucket(uint64_t dev, uint64_t ino) {
+
+    return &inflight[((dev * 0x9e3779b97f4a7c15ULL) ^ ino) %
+                     COPYD_INFLIGHT_BUCKETS];
+}
+
+
+/* Find the copy of dev:ino, called with the lock held */
+static copyjob_t *copyjob_find(uint64_t dev, uint64_t ino) {
+    copyjob_t   *job;
+
+    for(job = *copyjob_bucket(dev, ino); job; job = job->next) {
+        if((uint64_t) job->realst.st_dev == dev &&
+                (uint64_t) job->realst.st_ino == ino)
+        {
+            break;
+        }
+    }
+
+    return job;
+}
+
+
+/* See if this version of dev:ino is already being copied. Returns 0 if
+   it's running, 1 if it's queued and -1 if there is no such copy. */
+static int copyjob_lookup(uint64_t dev, uint64_t ino, int64_t size,
+                          int64_t mtime)
+{
+    copyjob_t   *job;
+    int         rc = -1;
+
+    pthread_mutex_lock(&queuelock);
+    job = copyjob_find(dev, ino);
+    if(job && job->realst.st_size == size && job->realst.st_mtime == mtime) {
+        if(!job->running) {
+            /* Just more popular now */
+            job->requests++;
+        }
+        rc = !job->running;
+    }
+    pthread_mutex_unlock(&queuelock);
+
+    return rc;
+}
+
+
+/* 1 if a worker should take job a before job b, requests/size without
+   dividing. Ties go to the one queued first, b. */
+static inline int copyjob_before(copyjob_t *a, copyjob_t *b) {
+
+    return (double) a->requests * (b->realst.st_size + 1) >
+           (double) b->requests * (a->realst.st_size + 1);
+}
+
+
+/* Take the most wanted job off the queue, called with the lock held */
+static copyjob_t *copyjob_next(void) {
+    copyjob_t   *job;
+    int         i, best = 0;
+
+    for(i=1; i<queuelen; i++) {
+        if(copyjob_before(queue[i], queue[best])) {
+            best = i;
+        }
+    }
+    job = queue[best];
+    queue[best] = queue[--queuelen];
+
+    return job;
+}
+
+
+/* Number of queued jobs the workers will take before queued job job.
+   Called with the lock held. */
+static int copyjob_ahead(copyjob_t *job) {
+    int i, n = 0;
+
+    for(i=0; i<queuelen; i++) {
+        if(queue[i] != job && !copyjob_before(job, queue[i])) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+/* Queue a copy of realfd, which is taken over unless the queue is full.
+   Returns 0 if a worker will start on it right away, 1 if it has to wait,
+   2 if another version of the file is being copied and -1 if the queue
+   is full. */
+static int copyjob_queue(int realfd, int oflag, struct stat64 *realst,
+                         char *cachepath)
+{
+    copyjob_t   *job, **bucket;
+    int         rc;
+
+    pthread_mutex_lock(&queuelock);
+    job = copyjob_find(realst->st_dev, realst->st_ino);
+    if(job) {
+        if(job->realst.st_size != realst->st_size ||
+                job->realst.st_mtime != realst->st_mtime)
+        {
+            /* One copy at a time, this version will have to wait for
+               another request */
+            rc = 2;
+        }
+        else {
+            /* Queued by someone else since we looked */
+            if(!job->running) {
+                job->requests++;
+            }
+            rc = !job->running;
+        }
+        pthread_mutex_unlock(&queuelock);
+        close(realfd);
+        return rc;
+    }
+    if(queuelen == COPYD_QUEUE_MAX || !(job = malloc(sizeof(copyjob_t)))) {
+        pthread_mutex_unlock(&queuelock);
+        return -1;
+    }
+    job->realfd = realfd;
+    job->oflag = oflag;
+    job->realst = *realst;
+    strcpy(job->cachepath, cachepath);
+    job->requests = 1;
+    job->running = 0;
+    job->opened = 0;
+    job->nwaiters = 0;
+    bucket = copyjob_bucket(realst->st_dev, realst->st_ino);
+    job->next = *bucket;
+    *bucket = job;
+    queue[queuelen++] = job;
+    /* Only started right away if no more wanted job takes the worker */
+    rc = copyjob_ahead(job) >= idleworkers;
+    pthread_cond_signal(&queuecond);
+    pthread_mutex_unlock(&queuelock);
+
+    return rc;
+}
+
+
+#ifdef __linux
+#define IOPRIO_CLASS_SHIFT      13
+#define IOPRIO_CLASS_BE         2
+#define IOPRIO_WHO_PROCESS      1
+
+/* Give the copy a best-effort I/O priority level to match: raised for
+   each doubling of the requests, lowest for huge files nobody else is
+   waiting for. */
+static void copyjob_ioprio(copyjob_t *job) {
+    int level = 4, n;
+
+    for(n = job->requests; n > 1 && level > 0; n /= 2) {
+        level--;
+    }
+    if(job->requests == 1 && job->realst.st_size >= COPYD_IDLEPRIO_SIZE) {
+        level = 7;
+    }
+
+    /* Who 0 is the calling thread */
+    if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+               IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | level) == -1)
+    {
+        if(debug) {
+            perror("copyd: ioprio_set");
+        }
+    }
+}
+#endif /* __linux */
+
+
+/* Hook up a version 2 or 3 request from connection fd to the copy of this
+   version of dev:ino. Returns -1 if there is no such copy, 0 if the
+   cached file is there to be opened, 1 if the copy is queued and 2 if
+   the worker will reply once the cached file is created. A queued copy
+   that a worker is about to start on is waited for if starting is set,
+   unless more wanted ones have taken the idle workers since. */
+static int copyjob_attach(copyd_req_t *req, int fd, int starting) {
+    copyjob_t   *job;
+    int         rc = -1;
+
+    pthread_mutex_lock(&queuelock);
+    job = copyjob_find(req->dev, req->ino);
+    if(job && job->realst.st_size == req->size &&
+            job->realst.st_mtime == req->mtime)
+    {
+        if(!job->running && !starting) {
+            job->requests++;
+            rc = 1;
+        }
+        else if(!job->running && copyjob_ahead(job) >= idleworkers) {
+            rc = 1;
+        }
+        else if(job->opened || job->nwaiters == COPYJOB_WAITERS || fd == -1) {
+            rc = 0;
+        }
+        else {
+            /* The reply might outlive this connection, keep the socket
+               around until then */
+            job->waiters[job->nwaiters] = dup(fd);
+            rc = job->waiters[job->nwaiters] == -1 ? 0 : 2;
+            if(rc == 2) {
+                job->nwaiters++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&queuelock);
+
+    return rc;
+}
+
+
+/* Reply to the connections in waiters with status and an fd for
+   cachepath, if given and it can be opened */
+static void copyjob_reply(int *waiters, int nwaiters, copyd_status status,
+                          const char *cachepath)
+{
+    int cachefd, i;
+
+    if(nwaiters == 0) {
+        return;
+    }
+
+    cachefd = cachepath ? open(cachepath, O_RDONLY | O_LARGEFILE | O_CLOEXEC)
+                        : -1;
+    if(cachefd == -1 && status == COPYD_OK) {
+        /* The client will have to go looking for it */
+        if(debug) {
+            perror("copyd: copyjob_reply: open");
+        }
+    }
+    else if(cachefd != -1) {
+        status = COPYD_OK;
+    }
+    for(i=0; i<nwaiters; i++) {
+        reply_fd(waiters[i], status, cachefd);
+        close(waiters[i]);
+    }
+    if(cachefd != -1) {
+        close(cachefd);
+    }
+}
+
+
+/* The copy of realst to destfile has created it, hand it out */
+static void copy_started(struct stat64 *realst, const char *destfile) {
+    copyjob_t   *job;
+    int         waiters[COPYJOB_WAITERS], nwaiters = 0;
+
+    pthread_mutex_lock(&queuelock);
+    job = copyjob_find(realst->st_dev, realst->st_ino);
+    if(job) {
+        job->opened = 1;
+        nwaiters = job->nwaiters;
+        memcpy(waiters, job->waiters, nwaiters * sizeof(int));
+        job->nwaiters = 0;
+    }
+    pthread_mutex_unlock(&queuelock);
+
+    copyjob_reply(waiters, nwaiters, COPYD_OK, destfile);
+}
+
+
+/* Queued copies waited for might have been passed over for more wanted
+   ones, leaving no idle worker to take them. Tell the waiters to read the
+   file directly instead. Called with the lock held, which is dropped
+   while replying. */
+static void copyjob_passedover(void) {
+    int waiters[COPYJOB_WAITERS], nwaiters, i;
+
+    for(i=0; i<queuelen; ) {
+        if(queue[i]->nwaiters == 0 ||
+                copyjob_ahead(queue[i]) < idleworkers)
+        {
+            i++;
+            continue;
+        }
+        nwaiters = queue[i]->nwaiters;
+        memcpy(waiters, queue[i]->waiters, nwaiters * sizeof(int));
+        queue[i]->nwaiters = 0;
+        pthread_mutex_unlock(&queuelock);
+
+        copyjob_reply(waiters, nwaiters, COPYD_QUEUED, NULL);
+
+        /* The queue might have changed meanwhile */
+        pthread_mutex_lock(&queuelock);
+        i = 0;
+    }
+}
+
+
+static void *copy_worker(void *arg) {
+    copyjob_t   *job, **pjob;
+    sigset_t    sigs;
+    int         waiters[COPYJOB_WAITERS], nwaiters;
+
+    (void) arg;
+
+    /* SIGUSR1 is for the main thread, keep it out of copies */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    pthread_mutex_lock(&queuelock);
+    while(1) {
+        idleworkers++;
+        while(queuelen == 0) {
+            pthread_cond_wait(&queuecond, &queuelock);
+        }
+        idleworkers--;
+        job = copyjob_next();
+        job->running = 1;
+        copyjob_passedover();
+        pthread_mutex_unlock(&queuelock);
+
+        if(debug) {
+            fprintf(stderr, "copyd: copy_worker: %s, %d requests\n",
+                    job->cachepath, job->requests);
+        }
+#ifdef __linux
+        copyjob_ioprio(job);
+#endif /* __linux */
+        copy_file(job->realfd, job->oflag, &job->realst, job->cachepath,
+                  open, stat64, fstat64, read, close);
+        close(job->realfd);
+
+        pthread_mutex_lock(&queuelock);
+        for(pjob = copyjob_bucket(job->realst.st_dev, job->realst.st_ino);
+                *pjob != job; pjob = &(*pjob)->next);
+        *pjob = job->next;
+        /* Still waiting if the copy never got going, someone else might
+           have cached it though */
+        nwaiters = job->nwaiters;
+        memcpy(waiters, job->waiters, nwaiters * sizeof(int));
+        pthread_mutex_unlock(&queuelock);
+
+        copyjob_reply(waiters, nwaiters, COPYD_FAIL, job->cachepath);
+        free(job);
+
+        pthread_mutex_lock(&queuelock);
+    }
+
+    return NULL;
+}
+
+
+/* Log the queue state */
+static void copyjob_dump(void) {
+
+    pthread_mutex_lock(&queuelock);
+    fprintf(stderr, "copyd: queue: %d queued, %d of %d workers idle, "
+            "%d connections\n", queuelen, idleworkers, COPYD_WORKERS,
+            nconns);
+    pthread_mutex_unlock(&queuelock);
+}
+
 
-    /* We assume a null terminated value as input, make sure we don't travel
-       outside our buffer */
-    buf[sizeof(buf)-1] = '\0';
+/* Client connections.
+
+   Clients keep their connection open and send requests one after the
+   other. The main thread watches the connections with epoll, in one-shot
+   mode so a connection with requests to handle is only given to one of
+   the COPYD_REQTHREADS request threads. */
+#define COPYD_CONN_FDS          4
+
+typedef struct copyd_conn_t {
+    int                 fd;
+    size_t              len;            /* Bytes in buf */
+    char                buf[sizeof(copyd_req_t) + PATH_MAX];
+    int                 nfds;
+    int                 fds[COPYD_CONN_FDS]; /* Passed along, in order */
+    struct copyd_conn_t *next;          /* In connqueue */
+} copyd_conn_t;
+
+static int              epfd = -1;
+static copyd_conn_t     *connqueue = NULL, *connqueuetail = NULL;
+static pthread_cond_t   conncond = PTHREAD_COND_INITIALIZER;
+
+
+static void reply(int fd, const char *msg) {
+
+    if(send(fd, msg, strlen(msg)+1, MSG_NOSIGNAL) < 0) {
+        if(debug) {
+            perror("copyd: reply");
+        }
+    }
+}
+
+
+/* Handle a request for a copy of path, reqst has magic 0 if the client
+   didn't tell us which file it means */
+static void handle_request(int fd, char *path, copyd_req_t *reqst) {
+    char cachepath[PATH_MAX];
+    int realfd = -1, cachefd = -1, oflag, rc;
+    struct stat64 realst, cachest;
 
     /* Clean it from . .. // */
-    cleanpath(buf);
+    cleanpath(path);
 
     if(debug) {
-        fprintf(stderr, "copyd: handle_conn: buf=%s\n", buf);
+        fprintf(stderr, "copyd: handle_request: path=%s\n", path);
     }
 
-    if(cacheopen_check(buf) == -1) {
+    if(cacheopen_check(path) == -1) {
         if(debug) {
             fprintf(stderr, "copyd: cacheopen_check fail\n");
         }
         goto err;
     }
 
-    oflag = O_RDONLY
-#ifdef USE_O_DIRECT
-        | O_DIRECT
-#endif
-        /* FIXME: Use directio() on solaris */
-        ;
-    realfd = open(buf, oflag);
+    if(reqst->magic == COPYD_REQ_MAGIC) {
+        rc = copyjob_lookup(reqst->dev, reqst->ino, reqst->size,
+                            reqst->mtime);
+        if(rc != -1) {
+            if(debug) {
+                fprintf(stderr, "copyd: handle_request: coalesced, %s\n",
+                        rc ? "queued" : "running");
+            }
+            goto reply;
+        }
+    }
+
+    /* copy_file() switches to O_DIRECT for large files itself, the
+       cached file must not be opened that way.
+       FIXME: Use directio() on solaris */
+    oflag = O_RDONLY;
+    realfd = open(path, oflag);
     if(realfd == -1) {
         if(debug) {
             perror("open realfd");
@@ -126,6 +592,13 @@ void *handle_conn(void * arg) {
         goto err;
     }
 
+    rc = copyjob_lookup(realst.st_dev, realst.st_ino, realst.st_size,
+                        realst.st_mtime);
+    if(rc != -1) {
+        goto reply;
+    }
+    rc = 0;
+
     cacheopen_prepare(&realst, cachepath);
 
     cachefd = cacheopen(&cachest, &realst, oflag, cachepath, open, fstat64,
@@ -137,45 +610,359 @@ void *handle_conn(void * arg) {
         goto err;
     }
 
-    /* Write reply when we're pretty sure this will work in order not to pause
-       requesting process until we're finished */
-    if(write(fd, "OK", 3) < 0) {
-        perror("write reply OK");
-    }
-    close(fd);
-    fd = -1;
-
     if(cachefd == CACHEOPEN_FAIL || cachefd == CACHEOPEN_STALE) {
         /* Either no cached file or stale cached file */
-        copy_file(realfd, oflag, realst.st_size, realst.st_mtime, cachepath, 
-                  open, stat64, fstat64, read, close);
+        rc = copyjob_queue(realfd, oflag, &realst, cachepath);
+        if(rc == -1) {
+            if(debug) {
+                fprintf(stderr, "copyd: handle_request: queue full\n");
+            }
+            goto err;
+        }
+        realfd = -1;
+    }
+
+reply:
+    if(rc == 1 || rc == 2) {
+        /* Not any time soon, the requester is better off reading the file
+           directly */
+        reply(fd, "QUEUED");
+    }
+    else {
+        reply(fd, "OK");
     }
 
     goto ok;
 
 err:
-    if(write(fd, "FAIL", 5) < 0) {
-        /* Keep quiet even if we fail */
-    }
+    reply(fd, "FAIL");
 ok:
-    if(fd >= 0) {
-        close(fd);
-    }
     if(realfd >= 0) {
         close(realfd);
     }
     if(cachefd >= 0) {
         close(cachefd);
     }
-    fprintf(stderr, "copyd: handle_conn: done\n");
+}
+
+
+/* Handle a version 2 request, the client's backend fd is realfd. fd is -1
+   for version 3, the client doesn't wait for a reply. */
+static void handle_fdrequest(int fd, copyd_req_t *req, int realfd) {
+    char cachepath[PATH_MAX], procpath[64], path[PATH_MAX];
+    int cachefd = -1, copyfd, rc;
+    ssize_t len;
+    struct stat64 realst, cachest;
+
+    if(debug) {
+        fprintf(stderr, "copyd: handle_fdrequest: ino=%llu\n",
+                (unsigned long long)req->ino);
+    }
+
+    /* Anyone can connect, only believe what the fd says. It must be the
+       backend file the request is about. */
+    snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", realfd);
+    len = readlink(procpath, path, sizeof(path)-1);
+    if(len > 0) {
+        path[len] = '\0';
+    }
+    if(len <= 0 || fstat64(realfd, &realst) == -1 ||
+            !S_ISREG(realst.st_mode) ||
+            (uint64_t) realst.st_dev != req->dev ||
+            (uint64_t) realst.st_ino != req->ino ||
+            realst.st_size != req->size || realst.st_mtime != req->mtime ||
+            cacheopen_check(path) == -1)
+    {
+        if(debug) {
+            fprintf(stderr, "copyd: handle_fdrequest: fd doesn't match "
+                    "request\n");
+        }
+        reply_fd(fd, COPYD_FAIL, -1);
+        return;
+    }
+    cacheopen_prepare(&realst, cachepath);
+
+    rc = copyjob_attach(req, fd, 0);
+    if(rc == -1) {
+        cachefd = cacheopen(&cachest, &realst, O_RDONLY, cachepath, open,
+                            fstat64, close);
+        if(cachefd == CACHEOPEN_DECLINED) {
+            reply_fd(fd, COPYD_FAIL, -1);
+            return;
+        }
+        if(cachefd >= 0) {
+            reply_fd(fd, COPYD_OK, cachefd);
+            close(cachefd);
+            return;
+        }
+
+        /* A file description of our own, the file offset and flags of the
+           client's are none of our business */
+        copyfd = open(procpath, O_RDONLY | O_CLOEXEC);
+        if(copyfd == -1) {
+            if(debug) {
+                perror("copyd: handle_fdrequest: reopen");
+            }
+            reply_fd(fd, COPYD_FAIL, -1);
+            return;
+        }
+        rc = copyjob_queue(copyfd, O_RDONLY, &realst, cachepath);
+        if(rc == -1) {
+            close(copyfd);
+            reply_fd(fd, COPYD_FAIL, -1);
+            return;
+        }
+        if(rc == 2) {
+            /* Busy with another version, read the backend meanwhile */
+            rc = 1;
+        }
+        else if(rc == 0) {
+            /* About to start, wait for the cached file */
+            rc = copyjob_attach(req, fd, 1);
+            if(rc == -1) {
+                /* Done already */
+                rc = 0;
+            }
+        }
+    }
+
+    if(rc == 1) {
+        reply_fd(fd, COPYD_QUEUED, -1);
+    }
+    else if(rc == 0) {
+        cachefd = open(cachepath, O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+        reply_fd(fd, COPYD_OK, cachefd);
+        if(cachefd != -1) {
+            close(cachefd);
+        }
+    }
+    /* else the copy worker replies */
+}
+
+
+/* Read what the client has sent and handle the complete requests.
+   Returns -1 when the connection should be closed. */
+static int handle_conn(copyd_conn_t *conn) {
+    copyd_req_t reqst;
+    ssize_t amt;
+    size_t pathoff;
+    char *nul;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char            buf[CMSG_SPACE(sizeof(int) * COPYD_CONN_FDS)];
+        struct cmsghdr  align;
+    } ctl;
+    int i, n, passed;
+
+    while(1) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = conn->buf + conn->len;
+        iov.iov_len = sizeof(conn->buf) - conn->len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        amt = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+        for(cmsg = amt > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+                cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(cmsg->cmsg_level != SOL_SOCKET ||
+                    cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(i=0; i<n; i++) {
+                memcpy(&passed, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+                if(conn->nfds < COPYD_CONN_FDS) {
+                    conn->fds[conn->nfds++] = passed;
+                }
+                else {
+                    close(passed);
+                }
+            }
+        }
+        if(amt == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("handle_conn: read");
+            return -1;
+        }
+        else if(amt == 0) {
+            /* Client went away */
+            return -1;
+        }
+        conn->len += amt;
+
+        while(conn->len > 0) {
+            /* Either a path on its own or reqst followed by the path */
+            memset(&reqst, 0, sizeof(reqst));
+            pathoff = 0;
+            if(conn->buf[0] != '/') {
+                if(conn->len < sizeof(reqst)) {
+                    break;
+                }
+                memcpy(&reqst, conn->buf, sizeof(reqst));
+                if(reqst.magic != COPYD_REQ_MAGIC ||
+                        ((reqst.version == COPYD_PROTO_FD ||
+                          reqst.version == COPYD_PROTO_ASYNC) &&
+                         conn->nfds == 0))
+                {
+                    if(debug) {
+                        fprintf(stderr, "copyd: handle_conn: bogus request\n");
+                    }
+                    reply(conn->fd, "FAIL");
+                    return -1;
+                }
+                pathoff = sizeof(reqst);
+                if(reqst.version == COPYD_PROTO_FD ||
+                        reqst.version == COPYD_PROTO_ASYNC)
+                {
+                    passed = conn->fds[0];
+                    conn->nfds--;
+                    memmove(conn->fds, conn->fds + 1, conn->nfds * sizeof(int));
+
+                    handle_fdrequest(reqst.version == COPYD_PROTO_FD ?
+                                     conn->fd : -1, &reqst, passed);
+                    close(passed);
+
+                    conn->len -= pathoff;
+                    memmove(conn->buf, conn->buf + pathoff, conn->len);
+                    continue;
+                }
+            }
+            nul = memchr(conn->buf + pathoff, '\0', conn->len - pathoff);
+            if(!nul) {
+                if(conn->len == sizeof(conn->buf)) {
+                    /* We assume a null terminated path, this is too long */
+                    reply(conn->fd, "FAIL");
+                    return -1;
+                }
+                break;
+            }
+
+            handle_request(conn->fd, conn->buf + pathoff, &reqst);
+
+            amt = nul + 1 - conn->buf;
+            conn->len -= amt;
+            memmove(conn->buf, conn->buf + amt, conn->len);
+        }
+    }
+}
+
+
+static void *request_worker(void *arg) {
+    copyd_conn_t *conn;
+    struct epoll_event ev;
+    sigset_t sigs;
+
+    (void) arg;
+
+    /* SIGUSR1 is for the main thread, keep it out of requests */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    while(1) {
+        pthread_mutex_lock(&queuelock);
+        while(!connqueue) {
+            pthread_cond_wait(&conncond, &queuelock);
+        }
+        conn = connqueue;
+        connqueue = conn->next;
+        if(!connqueue) {
+            connqueuetail = NULL;
+        }
+        pthread_mutex_unlock(&queuelock);
+
+        if(handle_conn(conn) == -1) {
+            if(debug) {
+                fprintf(stderr, "copyd: request_worker: closing fd=%d\n",
+                        conn->fd);
+            }
+            while(conn->nfds > 0) {
+                close(conn->fds[--conn->nfds]);
+            }
+            close(conn->fd);
+            free(conn);
+            pthread_mutex_lock(&queuelock);
+            nconns--;
+            pthread_mutex_unlock(&queuelock);
+            continue;
+        }
+
+        /* Wait for more */
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if(epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+            perror("copyd: epoll_ctl MOD");
+        }
+    }
+
     return NULL;
 }
 
+
+/* Accept all pending connections on sock */
+static void accept_conns(int sock) {
+    copyd_conn_t *conn;
+    struct epoll_event ev;
+    int fd;
+
+    while(1) {
+        fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd == -1) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("copyd: accept");
+            }
+            return;
+        }
+        if(debug) {
+            fprintf(stderr, "copyd: accept fd=%d\n", fd);
+        }
+
+        conn = malloc(sizeof(copyd_conn_t));
+        if(!conn) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->len = 0;
+        conn->nfds = 0;
+        conn->next = NULL;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("copyd: epoll_ctl ADD");
+            close(fd);
+            free(conn);
+            continue;
+        }
+
+        pthread_mutex_lock(&queuelock);
+        nconns++;
+        pthread_mutex_unlock(&queuelock);
+    }
+}
+
 int main(void) {
     struct sockaddr_un sa;
-    int sock, rc;
-    socklen_t salen;
+    struct epoll_event ev, evs[64];
+    int sock, n, i;
     pthread_attr_t attr;
+    pthread_t thr;
     struct passwd *pw;
 
     if(debug) {
@@ -183,6 +970,16 @@ int main(void) {
     }
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCLD, SIG_IGN);
+    {
+        struct sigaction sact;
+
+        /* Dump statistics on SIGUSR1, epoll_wait() returns EINTR so we get
+           to do it */
+        memset(&sact, 0, sizeof(sact));
+        sact.sa_handler = sigusr1;
+        sigemptyset(&sact.sa_mask);
+        sigaction(SIGUSR1, &sact, NULL);
+    }
 
     if(pthread_attr_init(&attr) != 0) {
         perror("copyd: pthread_attr_init");
@@ -203,7 +1000,7 @@ int main(void) {
     unlink(SOCKPATH);
 
     /* Create the socket and stuff */
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if(sock == -1) {
         perror("copyd: socket");
         exit(1);
@@ -250,33 +1047,85 @@ int main(void) {
         exit(6);
     }
 
+    /* Set up the cache index, as our user so clients can update it too */
+    if(cacheindex_init(open, fstat64, close, 1) != 0) {
+        fprintf(stderr, "copyd: Unable to set up cache index %s, "
+                        "continuing without it\n", CACHEINDEX_PATH);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd == -1) {
+        perror("copyd: epoll_create1");
+        exit(7);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        perror("copyd: epoll_ctl listen");
+        exit(7);
+    }
+
+    for(i=0; i<COPYD_WORKERS; i++) {
+        if(pthread_create(&thr, &attr, copy_worker, NULL) != 0) {
+            perror("copyd: pthread_create worker");
+            exit(7);
+        }
+    }
+    for(i=0; i<COPYD_REQTHREADS; i++) {
+        if(pthread_create(&thr, &attr, request_worker, NULL) != 0) {
+            perror("copyd: pthread_create request");
+            exit(7);
+        }
+    }
+
     if(debug) {
         fprintf(stderr, "copyd: Init done\n");
     }
 
-    do {
-        salen = sizeof(sa);
-        rc = accept(sock, (struct sockaddr *)&sa, &salen);
-        if(debug) {
-            fprintf(stderr, "copyd: accept rc=%d errno=%d\n", rc, errno);
+    while(1) {
+        n = epoll_wait(epfd, evs, sizeof(evs)/sizeof(evs[0]), -1);
+        if(dumpstats) {
+            dumpstats = 0;
+#if COPY_ARENA_SIZE > 0
+            copy_arena_dump();
+#endif /* COPY_ARENA_SIZE > 0 */
+            copy_flush_dump();
+#if COPY_RATE_MAX > 0
+            copy_throttle_dump();
+#endif /* COPY_RATE_MAX > 0 */
+            copyjob_dump();
         }
-        if(rc >= 0) {
-            pthread_t thr;
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for(i=0; i<n; i++) {
+            copyd_conn_t *conn = evs[i].data.ptr;
 
-            /* To avoid bogus gcc cast to/from pointer of diff. size warning */
-            size_t arg = rc;    /* Pass fd as argument to thread */
+            if(!conn) {
+                accept_conns(sock);
+                continue;
+            }
 
-            if(pthread_create(&thr, &attr, handle_conn, (void *) arg) != 0) {
-                perror("pthread_create");
-                exit(25);
+            /* Hand it to a request thread, it's disarmed until rearmed
+               by that thread */
+            pthread_mutex_lock(&queuelock);
+            conn->next = NULL;
+            if(connqueuetail) {
+                connqueuetail->next = conn;
             }
+            else {
+                connqueue = conn;
+            }
+            connqueuetail = conn;
+            pthread_cond_signal(&conncond);
+            pthread_mutex_unlock(&queuelock);
         }
-        else if (rc == -1 && (errno == EINTR || errno == ECONNABORTED || errno == ENOTCONN)) {
-            continue;
-        }
-
-    } while(rc != -1);
+    }
 
-    perror("copyd: accept");
+    perror("copyd: epoll_wait");
     exit(99);
 }
@@ -0,0 +1,305 @@
+/*
+ * Copyright 2006-2019 Niklas Edmundsson <nikke@acc.umu.se>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Threads hammering the wrapper with open/fstat/read/close on the same
+   backend file, to shake out races in the state shared between them.
+
+   Usage: LD_PRELOAD=./libhttpcacheopen.so ./stresstest [-s] file
+          [threads] [iterations]
+
+   Each thread reads the whole file every iteration. On Linux it also
+   puts the fd in an epoll instance of its own, which is what the wrapper
+   does its own bookkeeping for while the file is being copied. Exits
+   non-zero if any read comes up short or fstat() doesn't agree with
+   stat().
+
+   With -s the threads instead share a handful of fds, reading them,
+   dup()ing them and replacing them with close() and dup2() while other
+   threads are still using them. Reads then only fail on errors other
+   than EBADF, an fd closed under a thread is what this is after. Run it
+   on a file copyd is still copying to have the wrapper switch the fds
+   over to the cached file meanwhile. */
+
+#define _GNU_SOURCE 1
+#define _LARGEFILE64_SOURCE 1
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux
+#include <sys/epoll.h>
+#endif /* __linux */
+
+#define STRESS_THREADS          8
+#define STRESS_ITERATIONS       1000
+#define STRESS_BUFSIZE          65536
+#define STRESS_SHARED           4       /* fds shared with -s */
+#define STRESS_REPLACE          64      /* 1 in this many -s ops closes */
+
+static const char   *path;
+static struct stat  realst;
+static int          iterations;
+static int          shared[STRESS_SHARED];
+
+
+static void *stress_thread(void *arg) {
+    char        buf[STRESS_BUFSIZE];
+    struct stat st;
+    ssize_t     amt;
+    off_t       done;
+    int         fd, i;
+    long        failed = 0;
+#ifdef __linux
+    struct epoll_event  ev;
+    int                 epfd = epoll_create1(0);
+#endif /* __linux */
+
+    (void) arg;
+
+    for(i=0; i<iterations; i++) {
+        fd = open(path, O_RDONLY);
+        if(fd == -1) {
+            perror("stresstest: open");
+            failed++;
+            continue;
+        }
+        if(fstat(fd, &st) == -1 || st.st_size != realst.st_size ||
+                st.st_ino != realst.st_ino)
+        {
+            fprintf(stderr, "stresstest: fstat doesn't match stat\n");
+            failed++;
+        }
+#ifdef __linux
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        /* Regular files are refused unless they're still being copied */
+        if(epfd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+            epoll_wait(epfd, &ev, 1, 0);
+        }
+#endif /* __linux */
+        done = 0;
+        while((amt = read(fd, buf, sizeof(buf))) != 0) {
+            if(amt == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                perror("stresstest: read");
+                break;
+            }
+            done += amt;
+        }
+        if(done != realst.st_size) {
+            fprintf(stderr, "stresstest: read %lld of %lld bytes\n",
+                    (long long)done, (long long)realst.st_size);
+            failed++;
+        }
+        if(close(fd) == -1) {
+            perror("stresstest: close");
+            failed++;
+        }
+    }
+
+#ifdef __linux
+    if(epfd != -1) {
+        close(epfd);
+    }
+#endif /* __linux */
+
+    return (void *) failed;
+}
+
+
+/* fd is in use by other threads and may be closed under us, only a
+   wrong answer about the file counts */
+static long shared_check(int fd, char *buf) {
+    struct stat st;
+    ssize_t     amt;
+    long        failed = 0;
+
+    if(fstat(fd, &st) == 0 && st.st_ino == realst.st_ino &&
+            st.st_size != realst.st_size)
+    {
+        fprintf(stderr, "stresstest: fstat doesn't match stat\n");
+        failed++;
+    }
+    amt = read(fd, buf, STRESS_BUFSIZE);
+    if(amt == 0) {
+        lseek(fd, 0, SEEK_SET);
+    }
+    else if(amt == -1 && errno != EBADF && errno != EINTR &&
+            errno != EISDIR && errno != EINVAL)
+    {
+        perror("stresstest: read");
+        failed++;
+    }
+
+    return failed;
+}
+
+
+static void *shared_thread(void *arg) {
+    char            buf[STRESS_BUFSIZE];
+    unsigned int    seed = (unsigned int) (long) arg;
+    long            failed = 0;
+    int             i, n, fd, newfd;
+
+    for(i=0; i<iterations; i++) {
+        n = rand_r(&seed) % STRESS_SHARED;
+        fd = __atomic_load_n(&shared[n], __ATOMIC_ACQUIRE);
+
+        /* Rarely enough that fds get read far enough to be switched */
+        switch(rand_r(&seed) % STRESS_REPLACE) {
+            default:
+                failed += shared_check(fd, buf);
+                break;
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+                /* Another fd sharing the offset, gone again at once */
+                newfd = dup(fd);
+                if(newfd != -1) {
+                    failed += shared_check(newfd, buf);
+                    close(newfd);
+                }
+                break;
+            case 5:
+                /* Start over, so the copy gets ahead of the readers */
+                lseek(fd, 0, SEEK_SET);
+                break;
+            case 0:
+                /* Replace it, by close() or by dup2() over it */
+                newfd = open(path, O_RDONLY);
+                if(newfd == -1) {
+                    perror("stresstest: open");
+                    failed++;
+                    break;
+                }
+                if(rand_r(&seed) % 2) {
+                    fd = __atomic_exchange_n(&shared[n], newfd,
+                                             __ATOMIC_ACQ_REL);
+                    if(fd != -1) {
+                        close(fd);
+                    }
+                    break;
+                }
+                /* Taken out of the table meanwhile so nobody else closes
+                   it, threads that already have it keep using it */
+                fd = __atomic_exchange_n(&shared[n], -1, __ATOMIC_ACQ_REL);
+                if(fd != -1 && dup2(newfd, fd) == -1) {
+                    perror("stresstest: dup2");
+                    failed++;
+                }
+                close(newfd);
+                newfd = -1;
+                if(fd != -1 &&
+                        !__atomic_compare_exchange_n(&shared[n], &newfd, fd,
+                                                     0, __ATOMIC_ACQ_REL,
+                                                     __ATOMIC_ACQUIRE))
+                {
+                    close(fd);
+                }
+                break;
+        }
+    }
+
+    return (void *) failed;
+}
+
+
+int main(int argc, char *argv[]) {
+    pthread_t       *threads;
+    struct timespec start, end;
+    double          secs;
+    void            *rc;
+    long            failed = 0;
+    int             nthreads, i, share = 0;
+
+    if(argc > 1 && !strcmp(argv[1], "-s")) {
+        share = 1;
+        argv++;
+        argc--;
+    }
+    if(argc < 2) {
+        fprintf(stderr, "Usage: %s [-s] file [threads] [iterations]\n",
+                argv[0]);
+        return 2;
+    }
+    path = argv[1];
+    nthreads = argc > 2 ? atoi(argv[2]) : STRESS_THREADS;
+    iterations = argc > 3 ? atoi(argv[3]) : STRESS_ITERATIONS;
+    if(nthreads <= 0 || iterations <= 0) {
+        fprintf(stderr, "%s: threads and iterations must be positive\n",
+                argv[0]);
+        return 2;
+    }
+    if(stat(path, &realst) == -1) {
+        perror(path);
+        return 2;
+    }
+
+    threads = calloc(nthreads, sizeof(pthread_t));
+    if(!threads) {
+        perror("calloc");
+        return 2;
+    }
+
+    for(i=0; share && i<STRESS_SHARED; i++) {
+        shared[i] = open(path, O_RDONLY);
+        if(shared[i] == -1) {
+            perror(path);
+            return 2;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i=0; i<nthreads; i++) {
+        if(pthread_create(&threads[i], NULL,
+                          share ? shared_thread : stress_thread,
+                          (void *) (long) (i + 1)) != 0)
+        {
+            fprintf(stderr, "%s: pthread_create failed\n", argv[0]);
+            return 2;
+        }
+    }
+    for(i=0; i<nthreads; i++) {
+        pthread_join(threads[i], &rc);
+        failed += (long) rc;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for(i=0; share && i<STRESS_SHARED; i++) {
+        if(shared[i] != -1) {
+            close(shared[i]);
+        }
+    }
+
+    secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d threads, %d iterations: %.0f %s/s, %ld failed\n",
+           nthreads, iterations,
+           nthreads * iterations / (secs > 0 ? secs : 1e-9),
+           share ? "ops" : "opens", failed);
+
+    free(threads);
+
+    return failed ? 1 : 0;
+}
@@ -41,9 +41,17 @@
 #include <dlfcn.h>
 #include <stdio.h>
 #include <utime.h>
+#include <dirent.h>
 #ifdef __sun
 #include <sys/sendfile.h>
 #endif /* __sun */
+#ifdef __linux
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/sysmacros.h>
+#endif /* __linux */
 
 /* Ugh. Solaris is being moronic by defining a wrapper function in header
    files for non-LFS stat on 32bit. Ignore it for now, all our software
@@ -52,6 +60,23 @@
 #define WRAPPER_STAT_NOWRAP
 #endif
 
+/* glibc 2.33 stopped defining _STAT_VER, the __xstat family is only kept
+   for binaries built against older versions. This is what they pass. */
+#if defined(__linux) && !defined(_STAT_VER)
+#if defined(__x86_64__)
+#define _STAT_VER 1
+#elif defined(__i386__)
+#define _STAT_VER 3
+#else
+#define _STAT_VER 0
+#endif
+#endif /* defined(__linux) && !defined(_STAT_VER) */
+
+/* Only Linux has fds that aren't for reading or writing */
+#ifndef O_PATH
+#define O_PATH 0
+#endif /* O_PATH */
+
 #ifndef MIN
 #define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
 #endif     /* MIN */
@@ -70,21 +95,411 @@
 static const char rcsid[] = "$Id: libhttpcacheopen " GIT_SOURCE_DESC " $";
 
 #ifdef USE_COPYD
+/* What we know about an open file description, shared by all fds dup:ed
+   from the one we opened. Only what's spoofed is kept of the real file. */
 typedef struct cachefdinfo_t {
-    struct stat64   realst;     /* stat of real file */
-    int             complete;   /* TRUE if cached file complete, FALSE otherwise */
+    off64_t         size;       /* Real file size, 0 if not a cachefd */
+    time_t          mtime;      /* Real file mtime */
+    dev_t           dev;        /* Real file device */
+    ino64_t         ino;        /* Real file inode */
+    mode_t          mode;       /* Real file mode */
+    char            complete;   /* TRUE if cached file complete, FALSE otherwise */
+    int             refs;       /* Number of fds referring to this */
+    int             holds;      /* Threads using this, plus one for as
+                                   long as any fd refers to it */
+#ifdef __linux
+    int             notifyfd;   /* inotify fd for cached file, -1 if none */
+#endif /* __linux */
+#ifdef USE_CACHERANGES
+    cacheranges_t   ranges;     /* Data fetched out of order, if any */
+#endif /* USE_CACHERANGES */
+    off64_t         switchleft; /* Backend fd being copied by copyd: bytes
+                                   to read before looking for the cached
+                                   file again, 0 if not waiting for it */
+    int             backendfd;  /* Incomplete cachefd: backend fd+1 to read
+                                   what the copy hasn't got to yet from, 0
+                                   if none */
+    int             teefd;      /* Backend fd: cached file fd+1 the data
+                                   read goes into, 0 if none */
+    off64_t         teeoff;     /* Bytes written to teefd */
+    time_t          readtime;   /* Last told the cache index we read */
+    char            *dirpath;   /* Directory under the backend root: its
+                                   full path, for openat() relative to
+                                   it. NULL otherwise. */
+    struct cachefdinfo_t *next; /* Next on cachefd_free list */
 } cachefdinfo_t;
 
-static cachefdinfo_t cachefdinfo[CACHE_MAXFD];
+/* What we know about an fd number, there's one of these for every fd
+   number near one of ours */
+typedef struct cachefdslot_t {
+    cachefdinfo_t   *ci;        /* Its open file description, NULL if none */
+#ifdef __linux
+    int             stallfd;    /* Non-cachefd: cachefd+1 a sendfile() to
+                                   this fd is waiting for, 0 if none */
+    off64_t         stalloff;   /* Offset the stalled sendfile() waits for */
+    int             epfd;       /* epoll fd+1 this fd was added to, 0 if
+                                   none */
+    uint32_t        events;     /* ... and the events and data it was */
+    epoll_data_t    data;       /*     added with */
+#endif /* __linux */
+} cachefdslot_t;
+
+/* fd table: a directory of pages of CACHEFD_PAGE slots, both allocated
+   as fds are first registered. Most processes never get past a page or
+   two. Lookups are lock-free. Pages are never freed and a directory is
+   only ever replaced by a copy twice its size, so whatever a reader has
+   loaded stays valid. Neither are cachefdinfo_t:s, unused ones are kept
+   on cachefd_free for reuse. They're only put there once the last thread
+   holding one lets go of it, so whatever cachefd_get() returns stays put
+   until the matching cachefd_put(), fd closed or not. Allocation is
+   serialized by cachefd_alloclock. */
+#define CACHEFD_PAGEBITS        8
+#define CACHEFD_PAGE            (1 << CACHEFD_PAGEBITS)
+
+typedef struct cachefd_dir_t {
+    int             npages;
+    cachefdslot_t   *pages[];
+} cachefd_dir_t;
+
+static cachefd_dir_t    *cachefd_dir;
+static cachefdinfo_t    *cachefd_free;
+static int              cachefd_alloclock = 0;
+
+/* Number of cachefd:s not yet complete, and number of stalled sendfile()
+   destinations. Lets poll() and friends skip looking for our fds. */
+static int cachefd_incomplete;
+static int cachefd_stalled;
+
+#ifdef __linux
+/* Serializes the epoll watches, see cachewatch */
+static int cachewatch_lock = 0;
+
+static void cachefd_release(cachefdinfo_t *ci);
+#endif /* __linux */
+static void cachefd_dropbackend(cachefdinfo_t *ci);
+
+
+/* Slot for fd, NULL if nothing has been registered near it */
+static inline cachefdslot_t *cachefd_slot(int fd) {
+    cachefd_dir_t   *dir = __atomic_load_n(&cachefd_dir, __ATOMIC_ACQUIRE);
+    cachefdslot_t   *page;
+
+    if(fd < 0 || !dir || (fd >> CACHEFD_PAGEBITS) >= dir->npages) {
+        return NULL;
+    }
+    page = __atomic_load_n(&dir->pages[fd >> CACHEFD_PAGEBITS],
+                           __ATOMIC_ACQUIRE);
+    if(!page) {
+        return NULL;
+    }
+
+    return page + (fd & (CACHEFD_PAGE-1));
+}
+
+
+/* Info for fd, NULL if nothing has been registered for it. Only good for
+   comparing with another, it may be reused as soon as it's returned. */
+static inline cachefdinfo_t *cachefd_peek(int fd) {
+    cachefdslot_t *slot = cachefd_slot(fd);
+
+    if(!slot) {
+        return NULL;
+    }
+
+    return __atomic_load_n(&slot->ci, __ATOMIC_ACQUIRE);
+}
+
+
+/* Let go of ci. Whoever lets go last of an open file description no fd
+   refers to any more closes whatever hangs off it and returns it to the
+   free list. */
+static void cachefd_put(cachefdinfo_t *ci) {
+
+    if(!ci || __atomic_sub_fetch(&ci->holds, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+#ifdef __linux
+    cachefd_release(ci);
+#endif /* __linux */
+    cachefd_dropbackend(ci);
+    free(ci->dirpath);
+    memset(ci, 0, sizeof(*ci));
+    while(__atomic_test_and_set(&cachefd_alloclock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    ci->next = cachefd_free;
+    cachefd_free = ci;
+    __atomic_clear(&cachefd_alloclock, __ATOMIC_RELEASE);
+}
+
+
+/* Info for fd held for the caller, to be let go of with cachefd_put().
+   NULL if nothing has been registered for it. */
+static inline cachefdinfo_t *cachefd_get(int fd) {
+    cachefdslot_t   *slot = cachefd_slot(fd);
+    cachefdinfo_t   *ci;
+    int             holds;
+
+    if(!slot) {
+        return NULL;
+    }
+
+    while((ci = __atomic_load_n(&slot->ci, __ATOMIC_ACQUIRE))) {
+        /* Only if someone else still holds it, a free one stays free */
+        holds = __atomic_load_n(&ci->holds, __ATOMIC_RELAXED);
+        if(holds > 0 &&
+                __atomic_compare_exchange_n(&ci->holds, &holds, holds + 1,
+                                            0, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+        {
+            /* It might have been reused for another fd meanwhile */
+            if(__atomic_load_n(&slot->ci, __ATOMIC_ACQUIRE) == ci) {
+                return ci;
+            }
+            cachefd_put(ci);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Page n of the fd table, allocated if needed. Called with
+   cachefd_alloclock held. */
+static cachefdslot_t *cachefd_page(int n) {
+    cachefd_dir_t   *dir = cachefd_dir, *newdir;
+    cachefdslot_t   *page;
+    int             npages;
+
+    if(!dir || n >= dir->npages) {
+        for(npages = dir ? dir->npages : 4; npages <= n; npages *= 2);
+        newdir = calloc(1, sizeof(*newdir) + npages * sizeof(newdir->pages[0]));
+        if(!newdir) {
+            return NULL;
+        }
+        newdir->npages = npages;
+        if(dir) {
+            memcpy(newdir->pages, dir->pages,
+                   dir->npages * sizeof(dir->pages[0]));
+        }
+        /* The old directory is left for anyone still looking at it */
+        __atomic_store_n(&cachefd_dir, newdir, __ATOMIC_RELEASE);
+        dir = newdir;
+    }
+
+    page = dir->pages[n];
+    if(!page) {
+        page = calloc(CACHEFD_PAGE, sizeof(*page));
+        if(!page) {
+            return NULL;
+        }
+        __atomic_store_n(&dir->pages[n], page, __ATOMIC_RELEASE);
+    }
+
+    return page;
+}
+
+
+/* Slot for fd, allocated if needed. NULL if out of memory. */
+static cachefdslot_t *cachefd_slotalloc(int fd) {
+    cachefdslot_t   *slot = cachefd_slot(fd);
+
+    if(fd < 0 || slot) {
+        return slot;
+    }
+
+    while(__atomic_test_and_set(&cachefd_alloclock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    slot = cachefd_page(fd >> CACHEFD_PAGEBITS);
+    __atomic_clear(&cachefd_alloclock, __ATOMIC_RELEASE);
+    if(!slot) {
+        return NULL;
+    }
+
+    return slot + (fd & (CACHEFD_PAGE-1));
+}
+
+
+/* A new open file description, not yet in the fd table. NULL if out of
+   memory. */
+static cachefdinfo_t *cachefd_new(void) {
+    cachefdinfo_t   *ci;
+
+    while(__atomic_test_and_set(&cachefd_alloclock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    ci = cachefd_free;
+    if(ci) {
+        cachefd_free = ci->next;
+        ci->next = NULL;
+    }
+    __atomic_clear(&cachefd_alloclock, __ATOMIC_RELEASE);
+    if(!ci) {
+        ci = calloc(1, sizeof(*ci));
+        if(!ci) {
+            return NULL;
+        }
+    }
+
+    ci->refs = 1;
+#ifdef __linux
+    ci->notifyfd = -1;
+#endif /* __linux */
+    __atomic_store_n(&ci->holds, 1, __ATOMIC_RELEASE);
+
+    return ci;
+}
+
+
+/* Info for fd, a new open file description if there's none. NULL if out
+   of memory. Only for fds just opened that nobody else can be using yet,
+   so it isn't held. */
+static cachefdinfo_t *cachefd_alloc(int fd) {
+    cachefdslot_t   *slot = cachefd_slotalloc(fd);
+    cachefdinfo_t   *ci;
+
+    if(!slot) {
+        return NULL;
+    }
+    if(slot->ci) {
+        return slot->ci;
+    }
+
+    ci = cachefd_new();
+    if(!ci) {
+        return NULL;
+    }
+    __atomic_store_n(&slot->ci, ci, __ATOMIC_RELEASE);
+
+    return ci;
+}
+
+
+/* newfd refers to the same open file description as oldfd */
+static void cachefd_dup(int oldfd, int newfd) {
+    cachefdinfo_t   *ci = cachefd_get(oldfd);
+    cachefdslot_t   *slot;
+    int             refs;
+
+    if(!ci) {
+        return;
+    }
+
+    /* Unless oldfd was closed meanwhile and took it along */
+    refs = __atomic_load_n(&ci->refs, __ATOMIC_RELAXED);
+    while(refs > 0 &&
+            !__atomic_compare_exchange_n(&ci->refs, &refs, refs + 1, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    if(refs > 0) {
+        if((slot = cachefd_slotalloc(newfd))) {
+            __atomic_store_n(&slot->ci, ci, __ATOMIC_RELEASE);
+        }
+        else {
+            __atomic_sub_fetch(&ci->refs, 1, __ATOMIC_ACQ_REL);
+        }
+    }
+    cachefd_put(ci);
+}
+
+
+/* An fd referring to ci has been taken out of the fd table. Returns ci if
+   it was the last, to be finished off and handed to cachefd_put(). */
+static cachefdinfo_t *cachefd_unref(cachefdinfo_t *ci) {
+
+    if(!ci || __atomic_sub_fetch(&ci->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return NULL;
+    }
+
+    return ci;
+}
+
+
+/* Forget fd's open file description, as cachefd_unref() */
+static cachefdinfo_t *cachefd_detach(int fd) {
+    cachefdslot_t   *slot = cachefd_slot(fd);
+
+    if(!slot) {
+        return NULL;
+    }
+
+    return cachefd_unref(__atomic_exchange_n(&slot->ci, NULL,
+                                             __ATOMIC_ACQ_REL));
+}
+
+
+/* Forget everything about fd */
+static inline void cachefd_clear(int fd) {
+
+    cachefd_put(cachefd_detach(fd));
+}
+
+
+/* The real file as the cache functions want it */
+static void cachefd_realst(const cachefdinfo_t *ci, struct stat64 *st) {
+
+    memset(st, 0, sizeof(*st));
+    st->st_dev = ci->dev;
+    st->st_ino = ci->ino;
+    st->st_mode = ci->mode;
+    st->st_size = ci->size;
+    st->st_mtime = ci->mtime;
+}
+
+
+/* Save the parts of the real file we spoof */
+static void cachefd_setreal(cachefdinfo_t *ci, const struct stat64 *st) {
+
+    ci->dev = st->st_dev;
+    ci->ino = st->st_ino;
+    ci->mode = st->st_mode;
+    ci->size = st->st_size;
+    ci->mtime = st->st_mtime;
+}
+
+
+/* Make st, a struct stat or stat64 of the cachefd, look like the real
+   file. The rest is the cached file's, close enough for anyone. */
+#define CACHEFD_SPOOF(st, ci) do { \
+        (st)->st_dev = (ci)->dev; \
+        (st)->st_ino = (ci)->ino; \
+        (st)->st_mode = (ci)->mode; \
+        (st)->st_size = (ci)->size; \
+        (st)->st_blocks = ((ci)->size + 511) / 512; \
+        (st)->st_mtime = (ci)->mtime; \
+    } while(0)
+
+
+/* The fd table entry to spoof fd's stat with, held, NULL if fd isn't a
+   cachefd. All the fstat() flavours go through here. */
+static inline cachefdinfo_t *cachefd_spoofing(int fd) {
+    cachefdinfo_t *ci = cachefd_get(fd);
+
+    if(ci && ci->size <= 0) {
+        cachefd_put(ci);
+        return NULL;
+    }
+
+    return ci;
+}
 #endif /* USE_COPYD */
 
 
 /* Declarations for the real functions that we override */
 static int (*_open)(const char *, int, ...);
+static int (*_openat)(int, const char *, int, ...);
 static FILE *(*_fopen)(const char *, const char *);
 static FILE *(*_fopen64)(const char *, const char *);
 static int (*_chdir)(const char *);
 static char *(*_getcwd)(char *, size_t);
+static int (*_setuid)(uid_t);
+static int (*_seteuid)(uid_t);
+static int (*_setreuid)(uid_t, uid_t);
+#ifdef __linux
+static int (*_setresuid)(uid_t, uid_t, uid_t);
+#endif /* __linux */
+static pid_t (*_fork)(void);
+static pid_t wrapper_pid;       /* getpid() as of init or fork() */
 
 #ifdef _AIX
 /* Ugh. There have been different type declarations for readlink()
@@ -99,38 +514,61 @@ static ssize_t (*_readlink)(const char *, char *, size_t);
 static int realstat64(const char *, struct stat64 *);
 
 #ifdef __linux
-/* Ugh. Linux uses inlined wrappers for *stat*, so we need to catch
-   __*xstat* instead */
+/* Ugh. Before glibc 2.33 Linux used inlined wrappers for *stat*, so we
+   need to catch __*xstat* too */
 static int (*___xstat)(int, __const char *, struct stat *);
 static int (*___lxstat)(int, __const char *, struct stat *);
 static int (*___fxstat)(int, int, struct stat *);
 static int (*___xstat64)(int, __const char *, struct stat64 *);
 static int (*___lxstat64)(int, __const char *, struct stat64 *);
-#else /* __linux */
+#ifdef STATX_BASIC_STATS
+static int (*_statx)(int, const char *, int, unsigned int, struct statx *);
+#endif /* STATX_BASIC_STATS */
+#endif /* __linux */
 #ifndef WRAPPER_STAT_NOWRAP
 static int (*_stat)(const char *, struct stat *);
 static int (*_lstat)(const char *, struct stat *);
 static int (*_fstat)(int, struct stat *);
+static int (*_fstatat)(int, const char *, struct stat *, int);
 #endif /* WRAPPER_STAT_NOWRAP */
 static int (*_stat64)(const char *, struct stat64 *);
 static int (*_lstat64)(const char *, struct stat64 *);
-#endif /* __linux */
+static int (*_fstat64)(int, struct stat64 *);
+static int (*_fstatat64)(int, const char *, struct stat64 *, int);
 
 #ifdef USE_COPYD
 static ssize_t (*_read)(int, void *, size_t);
 static int (*_close)(int);
 static size_t (*_fread)(void *, size_t, size_t, FILE *);
 static int (*_fclose)(FILE *fp);
+static DIR *(*_opendir)(const char *);
+static int (*_closedir)(DIR *);
 static ssize_t (*_sendfile64)(int, int, off64_t *, size_t);
+static int (*_dup)(int);
+static int (*_dup2)(int, int);
+static int (*_fcntl)(int, int, ...);
 #ifdef __linux
+static int (*_dup3)(int, int, int);
+static int (*_fcntl64)(int, int, ...);
 static int (*___fxstat64)(int, int, struct stat64 *);
-#else /* __linux */
-static int (*_fstat64)(int, struct stat64 *);
 #endif /* __linux */
 static int realfstat64(int, struct stat64 *);
 #ifdef _AIX
 static ssize_t (*_send_file)(int *, struct sf_parms *, uint_t);
 #endif /* _AIX */
+#ifdef __linux
+static int (*_poll)(struct pollfd *, nfds_t, int);
+static int (*_select)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
+static int (*_epoll_ctl)(int, int, int, struct epoll_event *);
+static int (*_epoll_wait)(int, struct epoll_event *, int, int);
+#endif /* __linux */
+static int (*_execve)(const char *, char *const [], char *const []);
+static int (*_execv)(const char *, char *const []);
+static int (*_execvp)(const char *, char *const []);
+#ifdef __linux
+static int (*_execvpe)(const char *, char *const [], char *const []);
+static int (*_fexecve)(int, char *const [], char *const []);
+#endif /* __linux */
 #endif /* USE_COPYD */
 
 /* The issue of which types can hold function pointers is messy. xlc complains
@@ -153,32 +591,265 @@ if(! _##a) { \
     } \
 }
 
+/* As GET_REAL_SYMBOL, but leaves it to GET_REAL_SYMBOL to complain if it
+   turns out to be needed after all */
+#define INIT_REAL_SYMBOL(a) \
+if(! _##a) { \
+    DLSYM_RETURN_CAST _##a = dlsym( RTLD_NEXT, #a ); \
+}
+
+
+/* Look up the real functions before main() gets to start any threads, so
+   they're never written to while another thread might be reading them.
+   GET_REAL_SYMBOL stays as a fallback for anyone calling us from an
+   earlier constructor, all it can store is the same pointer. */
+#ifdef __GNUC__
+static void wrapper_init(void) __attribute__((constructor));
+#endif /* __GNUC__ */
+static void wrapper_init(void) {
+    INIT_REAL_SYMBOL(open);
+    INIT_REAL_SYMBOL(openat);
+    INIT_REAL_SYMBOL(fopen);
+    INIT_REAL_SYMBOL(fopen64);
+    INIT_REAL_SYMBOL(chdir);
+    INIT_REAL_SYMBOL(getcwd);
+    INIT_REAL_SYMBOL(setuid);
+    INIT_REAL_SYMBOL(seteuid);
+    INIT_REAL_SYMBOL(setreuid);
+#ifdef __linux
+    INIT_REAL_SYMBOL(setresuid);
+#endif /* __linux */
+    INIT_REAL_SYMBOL(fork);
+    INIT_REAL_SYMBOL(readlink);
+#ifdef __linux
+    INIT_REAL_SYMBOL(__xstat);
+    INIT_REAL_SYMBOL(__lxstat);
+    INIT_REAL_SYMBOL(__fxstat);
+    INIT_REAL_SYMBOL(__xstat64);
+    INIT_REAL_SYMBOL(__lxstat64);
+#ifdef STATX_BASIC_STATS
+    INIT_REAL_SYMBOL(statx);
+#endif /* STATX_BASIC_STATS */
+#endif /* __linux */
+#ifndef WRAPPER_STAT_NOWRAP
+    INIT_REAL_SYMBOL(stat);
+    INIT_REAL_SYMBOL(lstat);
+    INIT_REAL_SYMBOL(fstat);
+    INIT_REAL_SYMBOL(fstatat);
+#endif /* WRAPPER_STAT_NOWRAP */
+    INIT_REAL_SYMBOL(stat64);
+    INIT_REAL_SYMBOL(lstat64);
+    INIT_REAL_SYMBOL(fstat64);
+    INIT_REAL_SYMBOL(fstatat64);
+#ifdef USE_COPYD
+    INIT_REAL_SYMBOL(read);
+    INIT_REAL_SYMBOL(close);
+    INIT_REAL_SYMBOL(fread);
+    INIT_REAL_SYMBOL(fclose);
+    INIT_REAL_SYMBOL(opendir);
+    INIT_REAL_SYMBOL(closedir);
+    INIT_REAL_SYMBOL(sendfile64);
+    INIT_REAL_SYMBOL(dup);
+    INIT_REAL_SYMBOL(dup2);
+    INIT_REAL_SYMBOL(fcntl);
+#ifdef __linux
+    INIT_REAL_SYMBOL(dup3);
+    INIT_REAL_SYMBOL(fcntl64);
+    INIT_REAL_SYMBOL(__fxstat64);
+#endif /* __linux */
+#ifdef _AIX
+    INIT_REAL_SYMBOL(send_file);
+#endif /* _AIX */
+#ifdef __linux
+    INIT_REAL_SYMBOL(poll);
+    INIT_REAL_SYMBOL(select);
+    INIT_REAL_SYMBOL(epoll_ctl);
+    INIT_REAL_SYMBOL(epoll_wait);
+#endif /* __linux */
+    INIT_REAL_SYMBOL(execve);
+    INIT_REAL_SYMBOL(execv);
+    INIT_REAL_SYMBOL(execvp);
+#ifdef __linux
+    INIT_REAL_SYMBOL(execvpe);
+    INIT_REAL_SYMBOL(fexecve);
+#endif /* __linux */
+#endif /* USE_COPYD */
+    wrapper_pid = getpid();
+}
+
+/* The working directory and chroot are only ever replaced, never changed
+   in place, so all a reader needs is to be counted in path_readers while
+   looking at them. Replaced strings are freed once there are no readers.
+   Writers are serialized by path_lock. */
+#define PATH_RETIRED    16
+
 static char *cachedwd;          /* Cached working directory */
 static char *chrootdir;         /* chroot():ed directory, if any */
+static int  path_readers;
+static int  path_lock = 0;
+static char *path_retired[PATH_RETIRED];
+static int  path_nretired;
+
+/* Where the chroot, for absolute paths, and chroot plus working directory,
+   for relative ones, leave us in relation to backend_root. Either how
+   many bytes of backend_root they cover, or one of these. Kept up to date
+   by path_set() so open() can decide on the raw path. */
+#define PATH_NEVER      -1      /* Can't be a backend file, barring .. */
+#define PATH_UNDER      -2      /* Everything's under backend_root */
+
+static int  path_absmatch = 0;
+static int  path_relmatch = 0;
+
+/* Effective uid, (uid_t) -1 until looked up again after a set*id call */
+static uid_t euid_cache = (uid_t) -1;
+
+
+static inline void path_enter(void) {
+    __atomic_add_fetch(&path_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static inline void path_leave(void) {
+    __atomic_sub_fetch(&path_readers, 1, __ATOMIC_RELEASE);
+}
+
+
+/* path_absmatch or path_relmatch for paths tacked onto base */
+static int path_match(const char *base) {
+    int len = strlen(base);
+
+    if(strncmp(base, backend_root, MIN(len, backend_len))) {
+        return PATH_NEVER;
+    }
+    if(len >= backend_len) {
+        return PATH_UNDER;
+    }
+
+    return len;
+}
+
+
+/* Recalculate path_absmatch and path_relmatch. Called with path_lock
+   held. */
+static void path_rematch(void) {
+    char        base[PATH_MAX*3];
+    const char  *root = chrootdir ? chrootdir : "", *wd = cachedwd;
+
+    __atomic_store_n(&path_absmatch, path_match(root), __ATOMIC_RELAXED);
+
+    /* As get_full_path() puts them together */
+    snprintf(base, sizeof(base), "%s%s%s", root, wd ? wd : "",
+             wd && wd[0] && wd[strlen(wd)-1] != '/' ? "/" : "");
+    __atomic_store_n(&path_relmatch, path_match(base), __ATOMIC_RELAXED);
+}
+
+
+/* Returns 1 if path, as passed to open(), can't be a backend file. Decided
+   on the raw path, the full one is only needed if it might be. */
+static inline int path_notbackend(const char *path) {
+    int match;
+
+    match = __atomic_load_n(path[0] == '/' ? &path_absmatch : &path_relmatch,
+                            __ATOMIC_RELAXED);
+    if(match == PATH_UNDER) {
+        return 0;
+    }
+    if(match == PATH_NEVER && path[0] == '/') {
+        /* Nothing gets out of the chroot */
+        return 1;
+    }
+    if(match >= 0 &&
+            !strncmp(path, backend_root + match, backend_len - match))
+    {
+        return 0;
+    }
+
+    /* Unless cleaning it up could make it match after all */
+    return !(path[0] == '.' || strstr(path, "/.") || strstr(path, "//"));
+}
+
+
+/* geteuid(), without the syscall */
+static inline uid_t cached_geteuid(void) {
+    uid_t euid = __atomic_load_n(&euid_cache, __ATOMIC_RELAXED);
+
+    if(euid == (uid_t) -1) {
+        euid = geteuid();
+        __atomic_store_n(&euid_cache, euid, __ATOMIC_RELAXED);
+    }
+
+    return euid;
+}
+
+
+static inline void euid_forget(void) {
+    __atomic_store_n(&euid_cache, (uid_t) -1, __ATOMIC_RELAXED);
+}
+
+
+/* Replace *where, cachedwd or chrootdir, with newpath */
+static void path_set(char **where, char *newpath) {
+    char    *old;
+    int     i;
+
+    while(__atomic_test_and_set(&path_lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+
+    if(path_nretired == PATH_RETIRED) {
+        /* Readers are quick, wait for them rather than hoarding */
+        while(__atomic_load_n(&path_readers, __ATOMIC_SEQ_CST) > 0) {
+            sched_yield();
+        }
+    }
+
+    old = __atomic_exchange_n(where, newpath, __ATOMIC_SEQ_CST);
+    if(old) {
+        path_retired[path_nretired++] = old;
+    }
+
+    /* Anyone coming along now gets newpath */
+    if(__atomic_load_n(&path_readers, __ATOMIC_SEQ_CST) == 0) {
+        for(i=0; i<path_nretired; i++) {
+            free(path_retired[i]);
+        }
+        path_nretired = 0;
+    }
+
+    path_rematch();
+
+    __atomic_clear(&path_lock, __ATOMIC_RELEASE);
+}
 
 
 /* Returns the cleaned path with an eventual chroot prepended */
 /* Assumes buf is PATH_MAX in size */
 static int get_full_path(char *buf, const char *path) {
     char pathcleaned[PATH_MAX];
+    char *wd, *root;
+
+    path_enter();
 
     /* Copy the absolute path (ie. the one inside the current chroot
        and clean it from . .. // */
+    wd = __atomic_load_n(&cachedwd, __ATOMIC_SEQ_CST);
     if(path[0] == '/') {
         /* New path is absolute */
         if(strlen(path) + 1 > PATH_MAX) {
+            path_leave();
             errno = ENAMETOOLONG;
             return -1;
         }
         strcpy(pathcleaned, path);
     }
-    else if(cachedwd) {
+    else if(wd) {
         /* Yikes, relative path */
-        if(strlen(cachedwd) + strlen(path) + 2 > PATH_MAX) {
+        if(strlen(wd) + strlen(path) + 2 > PATH_MAX) {
+            path_leave();
             errno = ENAMETOOLONG;
             return -1;
         }
-        strcpy(pathcleaned, cachedwd);
+        strcpy(pathcleaned, wd);
         strcat(pathcleaned, "/");
         strcat(pathcleaned, path);
     }
@@ -188,17 +859,21 @@ static int get_full_path(char *buf, const char *path) {
     cleanpath(pathcleaned);
 
     /* Prepend current chroot, if any */
-    if(chrootdir != NULL) {
-        if(strlen(chrootdir) + strlen(pathcleaned) + 1 > PATH_MAX) {
+    root = __atomic_load_n(&chrootdir, __ATOMIC_SEQ_CST);
+    if(root != NULL) {
+        if(strlen(root) + strlen(pathcleaned) + 1 > PATH_MAX) {
+            path_leave();
             errno = ENAMETOOLONG;
             return -1;
         }
-        strcpy(buf, chrootdir);
+        strcpy(buf, root);
     }
     else {
         buf[0] = '\0';
     }
 
+    path_leave();
+
     strcat(buf, pathcleaned);
 
 #ifdef DEBUG
@@ -209,842 +884,2895 @@ static int get_full_path(char *buf, const char *path) {
 }
 
 
-int open(const char *path, int oflag, /* mode_t mode */...) {
-    va_list             ap;
-    int                 realfd, cachefd;
-    mode_t              mode;
-    struct stat64       realst, cachest;
-    char                realpath[PATH_MAX], cachepath[PATH_MAX];
-    time_t              starttime=0;
+/* Returns 1 if full path path is the backend root itself, only of
+   interest as a directory to openat() relative to */
+static inline int path_isbackendroot(const char *path) {
+    size_t len = strlen(path);
 
-#ifdef DEBUG
-    fprintf(stderr, "open: path=%s\n", path);
-#endif
+    return (len == (size_t) backend_len - 1 || len == (size_t) backend_len)
+           && !strncmp(path, backend_root, backend_len - 1);
+}
 
-    GET_REAL_SYMBOL(open);
 
-    if(get_full_path(realpath, path) == -1) {
-#ifdef DEBUG
-        perror("open: get_full_path failed");
-#endif
-        return -1;
-    }
+/* Returns 1 if path, as passed to open(), is the backend root */
+static int path_backendroot(const char *path) {
+    char realpath[PATH_MAX];
 
-#ifdef DEBUG
-    fprintf(stderr, "open: realpath=%s\n", realpath);
-#endif
+    return get_full_path(realpath, path) == 0 && path_isbackendroot(realpath);
+}
 
-    if(oflag & O_CREAT) {
-        va_start(ap, oflag);
-        mode = va_arg(ap, mode_t);
-        va_end(ap);
-        realfd = _open(realpath, oflag, mode);
-    }
-    else {
-        realfd = _open(realpath, oflag);
-    }
 
-    if(geteuid() == 0) {
-#ifdef DEBUG
-        fprintf(stderr, "open: euid == 0, skipping\n");
-#endif
-        return(realfd);
+#if STATCACHE_TTL > 0
+/* Per-process cache of the stat of backend files, used to find cache hits
+   without opening the backend file. Direct mapped on the real path. */
+typedef struct statcache_t {
+    char            *path;
+    struct stat64   st;
+    time_t          expires;
+} statcache_t;
+
+static statcache_t *statcache;
+static int         statcache_lock = 0;
+
+
+static inline void statcache_enter(void) {
+    while(__atomic_test_and_set(&statcache_lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
     }
+}
 
-    if(cacheopen_check(realpath) == -1) {
-#ifdef DEBUG
-        fprintf(stderr, "open: cacheopen_check failed\n");
-#endif
-        return(realfd);
+
+static inline void statcache_leave(void) {
+    __atomic_clear(&statcache_lock, __ATOMIC_RELEASE);
+}
+
+
+static unsigned int statcache_hash(const char *path) {
+    unsigned int h = 2166136261U;
+
+    while(*path) {
+        h ^= (unsigned char) *path++;
+        h *= 16777619U;
     }
 
-    if(realfd == -1 || oflag & (O_WRONLY | O_RDWR)) {
-#ifdef DEBUG
-        if(realfd == -1) {
-            perror("open realfd");
+    return h & (STATCACHE_SIZE-1);
+}
+
+
+/* Returns 0 and fills in st if we have a fresh entry for path */
+static int statcache_get(const char *path, struct stat64 *st) {
+    statcache_t *sc;
+    int         rc = -1;
+
+    statcache_enter();
+    if(statcache) {
+        sc = &statcache[statcache_hash(path)];
+        if(sc->path && sc->expires >= time(NULL) && !strcmp(sc->path, path))
+        {
+            memcpy(st, &sc->st, sizeof(struct stat64));
+            rc = 0;
         }
-        else {
-            fprintf(stderr, "open: Not read-only, oflag=%x\n", oflag);
+    }
+    statcache_leave();
+
+    return rc;
+}
+
+
+static void statcache_put(const char *path, struct stat64 *st) {
+    statcache_t *sc;
+
+    statcache_enter();
+    if(!statcache) {
+        statcache = calloc(STATCACHE_SIZE, sizeof(statcache_t));
+        if(!statcache) {
+            statcache_leave();
+            return;
         }
-#endif
-        return(realfd);
     }
 
-    if(realfstat64(realfd, &realst) == -1) {
-#ifdef DEBUG
-            perror("Unable to fstat realfd");
-#endif
-        /* Somewhere, something went very wrong */
-        return -1;
+    sc = &statcache[statcache_hash(path)];
+    if(!sc->path || strcmp(sc->path, path)) {
+        free(sc->path);
+        sc->path = strdup(path);
+        if(!sc->path) {
+            statcache_leave();
+            return;
+        }
     }
+    memcpy(&sc->st, st, sizeof(struct stat64));
+    sc->expires = time(NULL) + STATCACHE_TTL;
+    statcache_leave();
+}
 
-    /* FIXME: Should probably check for realst->st_size > 0 here to avoid
-              caching zero-byte files. */
 
-    /* If we get here, there are possibillities to use a cached copy of the
-       file in the httpcache instead */
+static void statcache_forget(const char *path) {
+    statcache_t *sc;
 
-    cacheopen_prepare(&realst, cachepath);
+    statcache_enter();
+    if(statcache) {
+        sc = &statcache[statcache_hash(path)];
+        if(sc->path && !strcmp(sc->path, path)) {
+            sc->expires = 0;
+        }
+    }
+    statcache_leave();
+}
+#endif /* STATCACHE_TTL */
 
-    GET_REAL_SYMBOL(close);
-    cachefd = cacheopen(&cachest, &realst, oflag, cachepath, _open, realfstat64,
-                        _close);
 
-    if(cachefd == CACHEOPEN_FAIL || cachefd == CACHEOPEN_STALE) {
-        /* Either no cached file or stale cached file, initiate
-           file copy once */
-        GET_REAL_SYMBOL(read);
-        if(realst.st_size > MAX_COPY_SIZE) {
-#ifdef DEBUG
-            fprintf(stderr, "open: Filesize over copy sizelimit\n");
-#endif
+/* fork() with another thread holding one of our locks would leave it
+   held for good in the child, so fork() waits for them */
+static void wrapper_prefork(void) {
 
+#if STATCACHE_TTL > 0
+    statcache_enter();
+#endif /* STATCACHE_TTL */
+    while(__atomic_test_and_set(&path_lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
 #ifdef USE_COPYD
-            if(copyd_file(realpath, _read, _close) == -1) {
-#ifdef DEBUG
-                fprintf(stderr, "open: copyd_file failed\n");
-#endif
-                return realfd;
-            }
-#else /* USE_COPYD */
-            return realfd;
-#endif /* USE_COPYD */
-        }
-        else if(copy_file(realfd, oflag, realst.st_size, realst.st_mtime,
-                          cachepath, _open, realstat64, realfstat64, 
-                          _read, _close) 
-                == COPY_FAIL)
-        {
-#ifdef DEBUG
-            perror("open: copy_file COPY_FAIL");
-#endif
-            return realfd;
-        }
-        cachefd = cacheopen(&cachest, &realst, oflag, cachepath, _open, 
-                            realfstat64, _close);
+#ifdef __linux
+    while(__atomic_test_and_set(&cachewatch_lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+#endif /* __linux */
+    while(__atomic_test_and_set(&cachefd_alloclock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
     }
+#endif /* USE_COPYD */
+}
 
-    /* Loop until we've got either a file with contents or a timeout */
-    while(1) {
-        if(cachefd == CACHEOPEN_DECLINED) {
-            return realfd;
-        }
 
-        if(cachefd < 0 && !starttime) {
-            starttime = time(NULL);
-        }
+static void wrapper_postfork(void) {
 
-        /* cacheopen() fills in cachest for us */
 #ifdef USE_COPYD
-        if(cachefd < 0 || cachest.st_size == 0) {
-#else /* USE_COPYD */
-        if(cachefd < 0 || cachest.st_size != realst.st_size) {
+    __atomic_clear(&cachefd_alloclock, __ATOMIC_RELEASE);
+#ifdef __linux
+    __atomic_clear(&cachewatch_lock, __ATOMIC_RELEASE);
+#endif /* __linux */
 #endif /* USE_COPYD */
-            struct timespec     delay;
-            time_t timeout = time(NULL) - CACHE_UPDATE_TIMEOUT;
+    __atomic_clear(&path_lock, __ATOMIC_RELEASE);
+#if STATCACHE_TTL > 0
+    statcache_leave();
+#endif /* STATCACHE_TTL */
+}
 
-            if(cachefd >= 0) {
-                _close(cachefd);
-            }
 
-            if( (cachefd < 0 && starttime < timeout) ||
-                (cachefd >= 0 && cachest.st_mtime < timeout) )
-            {
-#ifdef DEBUG
-                fprintf(stderr, 
-                        "open: Timed out waiting for cached file\n");
-#endif
-                /* Caching timed out */
-                return realfd;
+#ifdef USE_COPYD
+/* The fds are shared with another process now, file offsets included, so
+   backend fds can't be switched to the cached file behind its back. In
+   the child the threads holding fd table entries are gone. */
+static void cachefd_forked(int child) {
+    cachefd_dir_t   *dir = cachefd_dir;
+    cachefdslot_t   *page;
+    cachefdinfo_t   *ci;
+    int             n, i;
+
+    for(n = 0; dir && n < dir->npages; n++) {
+        page = dir->pages[n];
+        for(i = 0; page && i < CACHEFD_PAGE; i++) {
+            if((ci = page[i].ci)) {
+                __atomic_store_n(&ci->switchleft, 0, __ATOMIC_RELAXED);
+                if(child) {
+                    ci->holds = 1;
+                }
             }
-            delay.tv_sec = 0;
-            delay.tv_nsec = CACHE_LOOP_SLEEP*1000000;
-            nanosleep(&delay, NULL);
-            /* And again! */
-            cachefd = cacheopen(&cachest, &realst, oflag, cachepath, _open,
-                                realfstat64, _close);
-            continue;
         }
-
-        /* We're done */
-        break;
     }
+}
+#endif /* USE_COPYD */
+
 
+/* Readers in other threads stayed with the parent. What we know about
+   the fds holds in the child too, copies being teed into included: both
+   write the same data at the same offsets. */
+static void wrapper_postfork_child(void) {
+
+    path_readers = 0;
+    wrapper_pid = getpid();
 #ifdef USE_COPYD
-        if(cachefd < CACHE_MAXFD) {
-            /* Save information needed when doing read-while-caching */
-            if(realst.st_size == cachest.st_size) {
-                cachefdinfo[cachefd].complete=1;
-            }
-            else {
-                cachefdinfo[cachefd].complete=0;
-            }
-            memcpy(&cachefdinfo[cachefd].realst, &realst, sizeof(realst));
-        }
-        else {
-            /* No place in struct, do the best of the situation */
-            if(realst.st_size != cachest.st_size) {
-                _close(cachefd);
-                return(realfd);
-            }
-        }
+    cachefd_forked(1);
+#endif /* USE_COPYD */
+    wrapper_postfork();
+#ifdef USE_COPYD
+    GET_REAL_SYMBOL(close);
+    copyd_forked(_close);
 #endif /* USE_COPYD */
-
-    /* Victory! */
-    _close(realfd);
-    return(cachefd);
 }
 
 
-int open64(const char *path, int oflag, /* mode_t mode */...){
-    int tmp;
-    va_list ap;
-    mode_t mode;
+pid_t fork(void) {
+    pid_t pid;
 
-    oflag |= O_LARGEFILE;
+    GET_REAL_SYMBOL(fork);
 
-    if(oflag & O_CREAT) {
-        va_start(ap, oflag);
-        mode = va_arg(ap, mode_t);
-        va_end(ap);
-        tmp = open(path, oflag, mode);
+    wrapper_prefork();
+    pid = _fork();
+    if(pid == 0) {
+        wrapper_postfork_child();
     }
     else {
-        tmp = open(path, oflag);
+#ifdef USE_COPYD
+        if(pid > 0) {
+            cachefd_forked(0);
+        }
+#endif /* USE_COPYD */
+        wrapper_postfork();
     }
 
-    return tmp;
+    return pid;
 }
 
 
-int __open(const char *path, int oflag, /* mode_t mode */...){
-    int tmp;
-    va_list ap;
-    mode_t mode;
-
-    if(oflag & O_CREAT) {
-        va_start(ap, oflag);
-        mode = va_arg(ap, mode_t);
-        va_end(ap);
-        tmp = open(path, oflag, mode);
+#ifdef USE_COPYD
+/* Save information needed when doing read-while-caching */
+static void cachefd_setcache(cachefdinfo_t *ci, struct stat64 *realst,
+                             struct stat64 *cachest)
+{
+    cachefd_setreal(ci, realst);
+    if(realst->st_size == cachest->st_size) {
+        ci->complete=1;
     }
     else {
-        tmp = open(path, oflag);
+        ci->complete=0;
+        __atomic_add_fetch(&cachefd_incomplete, 1, __ATOMIC_RELAXED);
     }
-
-    return tmp;
 }
+#endif /* USE_COPYD */
 
 
-int __open64(const char *path, int oflag, /* mode_t mode */...){
-    int tmp;
-    va_list ap;
-    mode_t mode;
-
-    oflag |= O_LARGEFILE;
+/* Save what's needed to spoof the real file on a cachefd and to do
+   read-while-caching. Returns -1 if out of memory to keep track of
+   cachefd, in which case only a completely cached file may be used. */
+static int cachefd_register(int cachefd, struct stat64 *realst,
+                            struct stat64 *cachest)
+{
+#ifdef USE_COPYD
+    cachefdinfo_t *ci = cachefd_alloc(cachefd);
 
-    if(oflag & O_CREAT) {
-        va_start(ap, oflag);
-        mode = va_arg(ap, mode_t);
-        va_end(ap);
-        tmp = open(path, oflag, mode);
-    }
-    else {
-        tmp = open(path, oflag);
+    if(!ci) {
+        return -1;
     }
+    cachefd_setcache(ci, realst, cachest);
 
-    return tmp;
+    return 0;
+#else /* USE_COPYD */
+    (void) cachefd; (void) realst; (void) cachest;
+
+    return 0;
+#endif /* USE_COPYD */
 }
 
 
-/* New in glibc 2.7 */
-int __open64_2(const char *path, int oflag) {
-    int tmp;
+#ifdef USE_COPYD
+/* Keep backend fd realfd around so readers of the incomplete cachefd don't
+   have to wait for the copy. Returns -1 if realfd isn't needed. */
+static int cachefd_setbackend(cachefdinfo_t *ci, int realfd) {
 
-    oflag |= O_LARGEFILE;
+    if(!ci || ci->complete) {
+        return -1;
+    }
 
-    tmp = open(path, oflag);
+    /* Hidden from the application, don't leak it */
+    fcntl(realfd, F_SETFD, FD_CLOEXEC);
+    __atomic_store_n(&ci->backendfd, realfd + 1, __ATOMIC_RELEASE);
 
-    return tmp;
+    return 0;
 }
 
 
-/* New in glibc 2.7 */
-int __open_2(const char *path, int oflag) {
-    int tmp;
+static int cachefd_keepbackend(int cachefd, int realfd) {
+    cachefdinfo_t   *ci = cachefd_get(cachefd);
+    int             rc;
 
-    tmp = open(path, oflag);
+    rc = cachefd_setbackend(ci, realfd);
+    cachefd_put(ci);
 
-    return tmp;
+    return rc;
 }
 
 
-FILE *fopen(const char *filename, const char *mode) {
-
-    if(!filename || !mode) {
-        errno = ENOENT;
-        return NULL;
-    }
+static void cachefd_dropbackend(cachefdinfo_t *ci) {
+    int backendfd;
 
-    /* The only readonly-mode is r and rb */
-    if(strncmp(mode,"r+", 2) && strncmp(mode,"rb+", 3) &&
-            !strncmp(mode, "r", 1)) 
+    /* Whoever gets to clear it closes it */
+    if(ci && ci->backendfd > 0 &&
+            (backendfd = __atomic_exchange_n(&ci->backendfd, 0,
+                                             __ATOMIC_ACQ_REL)) > 0)
     {
-        int fd;
-
-        fd = open64(filename, O_RDONLY);
-        if(fd == -1) {
-            return NULL;
-        }
-        return fdopen(fd, mode);
+        GET_REAL_SYMBOL(close);
+        _close(backendfd - 1);
     }
+}
 
-    GET_REAL_SYMBOL(fopen);
-    if(chrootdir) {
-        char fullpath[PATH_MAX];
 
-        if(get_full_path(fullpath, filename) == -1) {
-#ifdef DEBUG
-            perror("httpcacheopen: fopen: get_full_path failed");
-#endif
-            return NULL;
-        }
+/* Backend fd realfd is read while the file is being cached, by copyd or
+   by us as it's read */
+static cachefdinfo_t *realfd_register(int realfd, struct stat64 *realst) {
+    cachefdinfo_t *ci;
 
-        return _fopen(fullpath, mode);
+    cachefd_clear(realfd);
+    ci = cachefd_alloc(realfd);
+    if(!ci) {
+        return NULL;
     }
 
-    return _fopen(filename, mode);
+    cachefd_setreal(ci, realst);
+    ci->complete = 1;
+
+    return ci;
 }
 
 
-FILE *fopen64(const char *filename, const char *mode) {
+/* Backend directory fd was opened as path, remember where it is for
+   openat() */
+static void cachefd_setdir(int fd, const char *path, struct stat64 *st) {
+    cachefdinfo_t   *ci;
+    char            *dirpath = strdup(path);
 
-    if(!filename || !mode) {
-        errno = ENOENT;
-        return NULL;
+    if(!dirpath) {
+        return;
     }
+    cachefd_clear(fd);
+    ci = cachefd_alloc(fd);
+    if(!ci) {
+        free(dirpath);
+        return;
+    }
+    ci->dev = st->st_dev;
+    ci->ino = st->st_ino;
+    ci->dirpath = dirpath;
+}
+
+
+/* Complete the copy backend fd fd is being read into. If the reader
+   stopped short the rest is copied here when fill is set, it's no more
+   than MAX_COPY_SIZE and the reader may well have used pread() or mmap()
+   which we never see. Otherwise the partial copy is dropped and copyd
+   asked to do it, so exit doesn't wait for it. */
+static void realfd_teedone(cachefdinfo_t *ci, int fd, int fill) {
+    struct stat64   realst;
+    char            cachepath[PATH_MAX];
+    off64_t         teeoff;
+    int             teefd;
+
+    if(!ci || ci->teefd <= 0 ||
+            (teefd = __atomic_exchange_n(&ci->teefd, 0, __ATOMIC_ACQ_REL))
+            <= 0)
+    {
+        return;
+    }
+
+    GET_REAL_SYMBOL(close);
+    cachefd_realst(ci, &realst);
+    cacheopen_prepare(&realst, cachepath);
+    teeoff = __atomic_load_n(&ci->teeoff, __ATOMIC_ACQUIRE);
+#ifdef DEBUG
+    fprintf(stderr, "httpcacheopen: realfd_teedone fd=%d: %lld bytes "
+            "teed\n", fd, (long long)teeoff);
+#endif
+    if(fill && teeoff < realst.st_size &&
+            copy_tee_fill(fd, teefd - 1, &realst, teeoff,
+                          realst.st_size - teeoff) == 0)
+    {
+        teeoff = realst.st_size;
+    }
+    if(copy_tee_finish(teefd - 1, &realst, cachepath, teeoff, realfstat64,
+                       _close) != COPY_OK && teeoff < realst.st_size)
+    {
+        copyd_file_async(fd, &realst, _close);
+    }
+}
+
+
+/* amt bytes ending at end have been read from backend fd fd, copy them
+   into the cached file if they're next in line. data is NULL if the
+   application never saw them, as with sendfile(). */
+static void realfd_tee(cachefdinfo_t *ci, int fd, const char *data,
+                       ssize_t amt, off64_t end)
+{
+    struct stat64   realst;
+    off64_t         start, teeoff;
+    int             teefd, rc = 0;
+
+    if(end == -1) {
+        end = lseek64(fd, 0, SEEK_CUR);
+        if(end == -1) {
+            return;
+        }
+    }
+    start = end - amt;
+
+    /* Threads sharing the fd may get here at the same time, at worst they
+       write the same data twice */
+    teeoff = __atomic_load_n(&ci->teeoff, __ATOMIC_ACQUIRE);
+    teefd = __atomic_load_n(&ci->teefd, __ATOMIC_ACQUIRE) - 1;
+    if(teefd < 0) {
+        return;
+    }
+
+    /* Anything else is left to copyd once the application is done */
+    if(start <= teeoff && end > teeoff) {
+        cachefd_realst(ci, &realst);
+        if(data) {
+            rc = copy_tee_write(teefd, &realst, data + (teeoff - start),
+                                end - teeoff, teeoff);
+        }
+        else {
+            /* Still in the page cache */
+            rc = copy_tee_fill(fd, teefd, &realst, teeoff, end - teeoff);
+        }
+        if(rc == 0) {
+            __atomic_compare_exchange_n(&ci->teeoff, &teeoff, end, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    if(rc == -1 || __atomic_load_n(&ci->teeoff, __ATOMIC_ACQUIRE) >= ci->size)
+    {
+        realfd_teedone(ci, fd, 0);
+    }
+}
+
+
+/* The process is going away, by exit or exec, and whatever it was reading
+   with it. Hand the copies still being teed over to copyd. */
+static void realfd_teeall(void) {
+    cachefd_dir_t   *dir = __atomic_load_n(&cachefd_dir, __ATOMIC_ACQUIRE);
+    cachefdinfo_t   *ci;
+    int             fd;
+
+    /* A vfork() child shares our memory with a parent that goes on */
+    if(!dir || getpid() != wrapper_pid) {
+        return;
+    }
+
+    for(fd = 0; fd < dir->npages * CACHEFD_PAGE; fd++) {
+        if((ci = cachefd_get(fd))) {
+            realfd_teedone(ci, fd, 0);
+            cachefd_put(ci);
+        }
+    }
+}
+
+
+/* Switch backend fd fd, with info ci, over to the cached file if the copy
+   has got past off, keeping the fd number and file offset */
+static void realfd_switch(cachefdinfo_t *ci, int fd, off64_t off) {
+    struct stat64   realst, cachest;
+    char            cachepath[PATH_MAX];
+    cachefdslot_t   *slot = cachefd_slot(fd);
+    cachefdinfo_t   *newci;
+    int             cachefd, state, fl, fdfl, backendfd;
+    off64_t         pos;
+
+    /* Other fds share the file offset, they'd be left behind */
+    if(!slot || __atomic_load_n(&ci->refs, __ATOMIC_ACQUIRE) > 1) {
+        return;
+    }
+
+    cachefd_realst(ci, &realst);
+
+    state = cacheopen_prepare(&realst, cachepath);
+    if(state == CACHEINDEX_ABSENT) {
+        return;
+    }
+
+    GET_REAL_SYMBOL(open);
+    GET_REAL_SYMBOL(close);
+    cachefd = cacheopen(&cachest, &realst, O_RDONLY, cachepath, _open,
+                        realfstat64, _close);
+    if(cachefd == CACHEOPEN_DECLINED) {
+        ci->switchleft = 0;
+        return;
+    }
+    if(cachefd < 0) {
+        return;
+    }
+    newci = cachefd_new();
+    if(!newci) {
+        _close(cachefd);
+        return;
+    }
+
+    pos = lseek64(fd, 0, SEEK_CUR);
+    fl = fcntl(fd, F_GETFL);
+    fdfl = fcntl(fd, F_GETFD);
+    if(cachest.st_size <= MAX(off, pos) || pos == -1 || fl == -1 ||
+            fdfl == -1 || lseek64(cachefd, pos, SEEK_SET) == -1 ||
+            fcntl(cachefd, F_SETFL, fl & O_NONBLOCK) == -1)
+    {
+        /* Not there yet */
+        _close(cachefd);
+        cachefd_put(newci);
+        return;
+    }
+
+    /* The application never sees a different fd. The backend file is
+       still needed should the reader catch up with the copy. */
+    GET_REAL_SYMBOL(fcntl);
+    GET_REAL_SYMBOL(dup2);
+    backendfd = _fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(_dup2(cachefd, fd) == -1) {
+#ifdef DEBUG
+        perror("httpcacheopen: realfd_switch: dup2");
+#endif
+        _close(cachefd);
+        if(backendfd != -1) {
+            _close(backendfd);
+        }
+        cachefd_put(newci);
+        return;
+    }
+    fcntl(fd, F_SETFD, fdfl);
+    _close(cachefd);
+
+#ifdef DEBUG
+    fprintf(stderr, "httpcacheopen: realfd_switch fd=%d off=%lld: Switched "
+            "to cached file, size=%lld\n", fd, (long long)pos,
+            (long long)cachest.st_size);
+#endif
+
+    /* Threads using fd see either the old or the new info, never none */
+    cachefd_setcache(newci, &realst, &cachest);
+    if(backendfd != -1 && cachefd_setbackend(newci, backendfd) == -1) {
+        _close(backendfd);
+    }
+    cachefd_put(cachefd_unref(__atomic_exchange_n(&slot->ci, newci,
+                                                  __ATOMIC_ACQ_REL)));
+}
+
+
+/* amt bytes have been read from fd into data, NULL if sent elsewhere, up
+   to off if known and -1 otherwise */
+static inline void realfd_progress(int fd, const void *data, ssize_t amt,
+                                   off64_t off)
+{
+    cachefdinfo_t *ci;
+
+    if(amt <= 0 || !(ci = cachefd_get(fd))) {
+        return;
+    }
+
+    if(ci->teefd > 0) {
+        realfd_tee(ci, fd, data, amt, off);
+    }
+    else if(ci->switchleft > 0 &&
+            __atomic_sub_fetch(&ci->switchleft, amt, __ATOMIC_RELAXED) <= 0)
+    {
+        __atomic_store_n(&ci->switchleft, CACHE_SWITCH_INTERVAL,
+                         __ATOMIC_RELAXED);
+        if(off == -1) {
+            off = lseek64(fd, 0, SEEK_CUR);
+        }
+        if(off != -1) {
+            realfd_switch(ci, fd, off);
+        }
+    }
+    cachefd_put(ci);
+}
+#endif /* USE_COPYD */
+
+
+/* Open realpath, the full path of what the application asked for, from
+   the cache if it's a backend file */
+static int cache_open(const char *realpath, int oflag, mode_t mode) {
+    int                 realfd, cachefd, state;
+    struct stat64       realst, cachest;
+    char                cachepath[PATH_MAX];
+    time_t              starttime=0;
+    int                 fromcopyd=0;
+#ifdef USE_COPYD
+    cachefdinfo_t       *ci;
+#endif /* USE_COPYD */
+
+#ifdef DEBUG
+    fprintf(stderr, "open: realpath=%s\n", realpath);
+#endif
+
+#if STATCACHE_TTL > 0
+    /* If we have a fresh stat of the backend file we can serve a completely
+       cached file without involving the backend at all */
+    if((oflag & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC | O_DIRECTORY
+                 | O_NOFOLLOW | O_PATH)) == 0 &&
+            statcache_get(realpath, &realst) == 0
+            && cached_geteuid() != 0)
+    {
+        GET_REAL_SYMBOL(close);
+        cacheindex_init(_open, realfstat64, _close, 0);
+
+        state = cacheopen_prepare(&realst, cachepath);
+        if(state != CACHEINDEX_ABSENT) {
+            cachefd = cacheopen(&cachest, &realst, oflag, cachepath, _open,
+                                realfstat64, _close);
+            if(cachefd >= 0) {
+                if(cachest.st_size == realst.st_size &&
+                        cachefd_register(cachefd, &realst, &cachest) == 0)
+                {
+#ifdef DEBUG
+                    fprintf(stderr, "open: statcache hit, returning %d\n",
+                            cachefd);
+#endif
+                    return(cachefd);
+                }
+                _close(cachefd);
+            }
+            else if(cachefd == CACHEOPEN_STALE) {
+                /* Our idea of the backend file might be what's stale */
+                statcache_forget(realpath);
+            }
+        }
+    }
+#endif /* STATCACHE_TTL */
+
+    if(oflag & O_CREAT) {
+        realfd = _open(realpath, oflag, mode);
+    }
+    else {
+        realfd = _open(realpath, oflag);
+    }
+
+    if(cached_geteuid() == 0) {
+#ifdef DEBUG
+        fprintf(stderr, "open: euid == 0, skipping\n");
+#endif
+        return(realfd);
+    }
+
+    if(cacheopen_check(realpath) == -1 && !path_isbackendroot(realpath)) {
+#ifdef DEBUG
+        fprintf(stderr, "open: cacheopen_check failed\n");
+#endif
+        return(realfd);
+    }
+
+    if(realfd == -1 || oflag & (O_WRONLY | O_RDWR)) {
+#ifdef DEBUG
+        if(realfd == -1) {
+            perror("open realfd");
+        }
+        else {
+            fprintf(stderr, "open: Not read-only, oflag=%x\n", oflag);
+        }
+#endif
+        return(realfd);
+    }
+
+    if(realfstat64(realfd, &realst) == -1) {
+#ifdef DEBUG
+            perror("Unable to fstat realfd");
+#endif
+        /* Somewhere, something went very wrong */
+        return -1;
+    }
+
+#ifdef USE_COPYD
+    if(S_ISDIR(realst.st_mode)) {
+        /* openat() relative to it needs to know where it is */
+        cachefd_setdir(realfd, realpath, &realst);
+        return(realfd);
+    }
+#endif /* USE_COPYD */
+
+    if(oflag & O_PATH) {
+        /* Not for reading, nothing to serve from the cache */
+        return(realfd);
+    }
+
+#if STATCACHE_TTL > 0
+    if(S_ISREG(realst.st_mode) && realst.st_size > 0) {
+        statcache_put(realpath, &realst);
+    }
+#endif /* STATCACHE_TTL */
+
+    /* FIXME: Should probably check for realst->st_size > 0 here to avoid
+              caching zero-byte files. */
+
+    /* If we get here, there are possibillities to use a cached copy of the
+       file in the httpcache instead */
+
+    GET_REAL_SYMBOL(close);
+    cacheindex_init(_open, realfstat64, _close, 0);
+
+    state = cacheopen_prepare(&realst, cachepath);
+
+    if(state == CACHEINDEX_ABSENT) {
+        /* No use looking for it */
+        cachefd = CACHEOPEN_FAIL;
+    }
+    else {
+        cachefd = cacheopen(&cachest, &realst, oflag, cachepath, _open,
+                            realfstat64, _close);
+    }
+
+    if(cachefd == CACHEOPEN_FAIL || cachefd == CACHEOPEN_STALE) {
+        /* Either no cached file or stale cached file, initiate
+           file copy once */
+        GET_REAL_SYMBOL(read);
+        if(realst.st_size > MAX_COPY_SIZE) {
+#ifdef DEBUG
+            fprintf(stderr, "open: Filesize over copy sizelimit\n");
+#endif
+
+#ifdef USE_COPYD
+            /* Don't keep the client waiting, read the backend file until
+               the copy has caught up */
+            if((ci = realfd_register(realfd, &realst))) {
+                if(copyd_file_async(realfd, &realst, _close)
+                        == 0)
+                {
+                    ci->switchleft = CACHE_SWITCH_INTERVAL;
+                }
+                return realfd;
+            }
+
+            cachefd = copyd_file(realfd, &realst, _close);
+            if(cachefd == -1) {
+#ifdef DEBUG
+                fprintf(stderr, "open: copyd_file failed\n");
+#endif
+                return realfd;
+            }
+            if(cachefd >= 0) {
+                if(realfstat64(cachefd, &cachest) == -1) {
+                    _close(cachefd);
+                    return realfd;
+                }
+                /* Handed to us by copyd, no need to go looking for it */
+                fromcopyd = 1;
+            }
+#else /* USE_COPYD */
+            return realfd;
+#endif /* USE_COPYD */
+        }
+#ifdef USE_COPYD
+        else if(realst.st_size > 0 &&
+                (ci = realfd_register(realfd, &realst)))
+        {
+            /* Cache it as the application reads it, no need to keep it
+               waiting for the copy */
+            int destfd = copy_tee_start(&realst, cachepath, _open,
+                                        realstat64);
+
+            if(destfd >= 0) {
+                fcntl(destfd, F_SETFD, FD_CLOEXEC);
+                ci->teefd = destfd + 1;
+                return realfd;
+            }
+            cachefd_clear(realfd);
+            if(destfd == COPY_FAIL) {
+                return realfd;
+            }
+            /* Someone else is copying it, wait for it below */
+        }
+#endif /* USE_COPYD */
+        else if(copy_file(realfd, oflag, &realst, cachepath, _open,
+                          realstat64, realfstat64, _read, _close) 
+                == COPY_FAIL)
+        {
+#ifdef DEBUG
+            perror("open: copy_file COPY_FAIL");
+#endif
+            return realfd;
+        }
+        if(!fromcopyd) {
+            cachefd = cacheopen(&cachest, &realst, oflag, cachepath, _open,
+                                realfstat64, _close);
+        }
+    }
+
+    /* Loop until we've got either a file with contents or a timeout */
+    while(1) {
+        cacheindex_entry_t  *slot;
+        uint32_t            seq;
+
+        if(cachefd == CACHEOPEN_DECLINED) {
+            return realfd;
+        }
+
+        if(cachefd < 0 && !starttime) {
+            starttime = time(NULL);
+        }
+
+        /* cacheopen() fills in cachest for us */
+#ifdef USE_COPYD
+        if(cachefd < 0 || (cachest.st_size == 0 && !fromcopyd)) {
+#else /* USE_COPYD */
+        if(cachefd < 0 || cachest.st_size != realst.st_size) {
+#endif /* USE_COPYD */
+            time_t timeout = time(NULL) - CACHE_UPDATE_TIMEOUT;
+
+            if(cachefd >= 0) {
+                _close(cachefd);
+            }
+
+            if( (cachefd < 0 && starttime < timeout) ||
+                (cachefd >= 0 && cachest.st_mtime < timeout) )
+            {
+#ifdef DEBUG
+                fprintf(stderr, 
+                        "open: Timed out waiting for cached file\n");
+#endif
+                /* Caching timed out */
+                return realfd;
+            }
+            /* Sleep until the copy makes progress. We might not have found
+               the cached file due to the copy not having started yet, so
+               keep the timeout short. */
+            slot = cacheindex_getslot(&realst);
+            seq = cacheindex_waitseq(slot);
+            cacheindex_wait(slot, seq, CACHE_LOOP_SLEEP);
+            /* And again! */
+            cachefd = cacheopen(&cachest, &realst, oflag, cachepath, _open,
+                                realfstat64, _close);
+            continue;
+        }
+
+        /* We're done */
+        break;
+    }
+
+#ifdef USE_COPYD
+    if(cachefd_register(cachefd, &realst, &cachest) == -1) {
+        /* No place in struct, do the best of the situation */
+        if(realst.st_size != cachest.st_size) {
+            _close(cachefd);
+            return(realfd);
+        }
+    }
+    else if(cachefd_keepbackend(cachefd, realfd) == 0) {
+        return(cachefd);
+    }
+#endif /* USE_COPYD */
+
+    /* Victory! */
+    _close(realfd);
+    return(cachefd);
+}
+
+
+int open(const char *path, int oflag, /* mode_t mode */...) {
+    va_list ap;
+    mode_t  mode = 0;
+    char    realpath[PATH_MAX];
+
+#ifdef DEBUG
+    fprintf(stderr, "open: path=%s\n", path);
+#endif
+
+    GET_REAL_SYMBOL(open);
+
+    if(oflag & O_CREAT) {
+        va_start(ap, oflag);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    /* Most of what gets opened is nowhere near the backend */
+    if(path_notbackend(path) &&
+            !(oflag & O_DIRECTORY && path_backendroot(path)))
+    {
+        if(chrootdir) {
+            if(get_full_path(realpath, path) == -1) {
+                return -1;
+            }
+            path = realpath;
+        }
+        if(oflag & O_CREAT) {
+            return _open(path, oflag, mode);
+        }
+        return _open(path, oflag);
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+#ifdef DEBUG
+        perror("open: get_full_path failed");
+#endif
+        return -1;
+    }
+
+    return cache_open(realpath, oflag, mode);
+}
+
+
+int open64(const char *path, int oflag, /* mode_t mode */...){
+    int tmp;
+    va_list ap;
+    mode_t mode;
+
+    oflag |= O_LARGEFILE;
+
+    if(oflag & O_CREAT) {
+        va_start(ap, oflag);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+        tmp = open(path, oflag, mode);
+    }
+    else {
+        tmp = open(path, oflag);
+    }
+
+    return tmp;
+}
+
+
+int __open(const char *path, int oflag, /* mode_t mode */...){
+    int tmp;
+    va_list ap;
+    mode_t mode;
+
+    if(oflag & O_CREAT) {
+        va_start(ap, oflag);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+        tmp = open(path, oflag, mode);
+    }
+    else {
+        tmp = open(path, oflag);
+    }
+
+    return tmp;
+}
+
+
+int __open64(const char *path, int oflag, /* mode_t mode */...){
+    int tmp;
+    va_list ap;
+    mode_t mode;
+
+    oflag |= O_LARGEFILE;
+
+    if(oflag & O_CREAT) {
+        va_start(ap, oflag);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+        tmp = open(path, oflag, mode);
+    }
+    else {
+        tmp = open(path, oflag);
+    }
+
+    return tmp;
+}
+
+
+/* New in glibc 2.7 */
+int __open64_2(const char *path, int oflag) {
+    int tmp;
+
+    oflag |= O_LARGEFILE;
+
+    tmp = open(path, oflag);
+
+    return tmp;
+}
+
+
+/* New in glibc 2.7 */
+int __open_2(const char *path, int oflag) {
+    int tmp;
+
+    tmp = open(path, oflag);
+
+    return tmp;
+}
+
+
+int openat(int dirfd, const char *path, int oflag, /* mode_t mode */...) {
+    va_list         ap;
+    mode_t          mode = 0;
+#ifdef USE_COPYD
+    char            realpath[PATH_MAX];
+    cachefdinfo_t   *ci;
+    struct stat64   st;
+    size_t          len;
+#endif /* USE_COPYD */
+
+    if(oflag & O_CREAT) {
+        va_start(ap, oflag);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    /* Nothing different from open() unless relative to a directory */
+    if(dirfd == AT_FDCWD || path[0] == '/') {
+        return open(path, oflag, mode);
+    }
+
+    GET_REAL_SYMBOL(openat);
+
+#ifdef USE_COPYD
+    /* Only read-only opens are ever served from the cache, and only those
+       relative to a directory under the backend root we opened, which we
+       know the path of. Directories are opened through cache_open() too,
+       so what's below them can be. */
+    if((oflag & (O_WRONLY | O_RDWR | O_CREAT)) == 0 &&
+            (ci = cachefd_get(dirfd)))
+    {
+        realpath[0] = '\0';
+        /* Unless dirfd was closed behind our back and the number reused */
+        if(ci->dirpath && realfstat64(dirfd, &st) == 0 &&
+                st.st_dev == ci->dev && st.st_ino == ci->ino &&
+                (len = strlen(ci->dirpath)) + strlen(path) + 2 <=
+                sizeof(realpath))
+        {
+            memcpy(realpath, ci->dirpath, len);
+            realpath[len] = '/';
+            strcpy(realpath + len + 1, path);
+            cleanpath(realpath);
+        }
+        cachefd_put(ci);
+        if(realpath[0] && (cacheopen_check(realpath) == 0 ||
+                           path_isbackendroot(realpath)))
+        {
+            return cache_open(realpath, oflag, mode);
+        }
+    }
+#endif /* USE_COPYD */
+
+    return _openat(dirfd, path, oflag, mode);
+}
+
+
+int openat64(int dirfd, const char *path, int oflag, /* mode_t mode */...) {
+    va_list ap;
+    mode_t  mode = 0;
+
+    oflag |= O_LARGEFILE;
+
+    if(oflag & O_CREAT) {
+        va_start(ap, oflag);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    return openat(dirfd, path, oflag, mode);
+}
+
+
+/* New in glibc 2.7 */
+int __openat_2(int dirfd, const char *path, int oflag) {
+
+    return openat(dirfd, path, oflag);
+}
+
+
+/* New in glibc 2.7 */
+int __openat64_2(int dirfd, const char *path, int oflag) {
+
+    return openat(dirfd, path, oflag | O_LARGEFILE);
+}
+
+
+FILE *fopen(const char *filename, const char *mode) {
+
+    if(!filename || !mode) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    /* The only readonly-mode is r and rb */
+    if(strncmp(mode,"r+", 2) && strncmp(mode,"rb+", 3) &&
+            !strncmp(mode, "r", 1)) 
+    {
+        int fd;
+
+        fd = open64(filename, O_RDONLY);
+        if(fd == -1) {
+            return NULL;
+        }
+        return fdopen(fd, mode);
+    }
+
+    GET_REAL_SYMBOL(fopen);
+    if(chrootdir) {
+        char fullpath[PATH_MAX];
+
+        if(get_full_path(fullpath, filename) == -1) {
+#ifdef DEBUG
+            perror("httpcacheopen: fopen: get_full_path failed");
+#endif
+            return NULL;
+        }
+
+        return _fopen(fullpath, mode);
+    }
+
+    return _fopen(filename, mode);
+}
+
+
+FILE *fopen64(const char *filename, const char *mode) {
+
+    if(!filename || !mode) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    /* The only readonly-mode is r and rb */
+    if(strncmp(mode,"r+", 2) && strncmp(mode,"rb+", 3) &&
+            !strncmp(mode, "r", 1)) 
+    {
+        int fd;
+
+        fd = open64(filename, O_RDONLY);
+        if(fd == -1) {
+            return NULL;
+        }
+        return fdopen(fd, mode);
+    }
+
+    GET_REAL_SYMBOL(fopen64);
+    if(chrootdir) {
+        char fullpath[PATH_MAX];
+
+        if(get_full_path(fullpath, filename) == -1) {
+#ifdef DEBUG
+            perror("httpcacheopen: fopen64: get_full_path failed");
+#endif
+            return NULL;
+        }
+
+        return _fopen64(fullpath, mode);
+    }
+
+    return _fopen64(filename, mode);
+}
+
+
+int chdir(const char *path) {
+    char fullpath[PATH_MAX], newwd[PATH_MAX*2];
+    char *wd;
+    int rc;
+
+    GET_REAL_SYMBOL(chdir);
+
+    if(get_full_path(fullpath, path) == -1) {
+#ifdef DEBUG
+        perror("httpcacheopen: chdir: get_full_path failed");
+#endif
+        return -1;
+    }
+
+    rc = _chdir(fullpath);
+    if(rc == -1) {
+        return -1;
+    }
+
+    /* Rely on _chdir having done max path length checking for us */
+    if(path[0] == '/') {
+        strcpy(newwd, path);
+    }
+    else {
+        path_enter();
+        wd = __atomic_load_n(&cachedwd, __ATOMIC_SEQ_CST);
+        strcpy(newwd, wd ? wd : "");
+        path_leave();
+        strcat(newwd, "/");
+        strcat(newwd, path);
+    }
+
+    /* Remove . .. // */
+    cleanpath(newwd);
+
+    wd = strdup(newwd);
+    if(wd == NULL) {
+        return -1;
+    }
+    path_set(&cachedwd, wd);
+
+#ifdef DEBUG
+    fprintf(stderr, "httpcacheopen: chdir: Cached %s\n", newwd);
+#endif
+
+    return(rc);
+}
+
+
+char *getcwd(char *buffer, size_t size) {
+    char    *wd;
+    size_t  cwdlen;
+
+    /* Check if we have cached the working directory, if not do it the
+       lazy way by calling our chdir that caches it :) */
+    if(!__atomic_load_n(&cachedwd, __ATOMIC_ACQUIRE)) {
+        char mycwd[PATH_MAX];
+
+        GET_REAL_SYMBOL(getcwd);
+        if(_getcwd(mycwd, PATH_MAX) == NULL) {
+            return NULL;
+        }
+        if(chdir(mycwd) == -1) {
+            return NULL;
+        }
+    }
+
+    path_enter();
+    wd = __atomic_load_n(&cachedwd, __ATOMIC_SEQ_CST);
+    cwdlen = strlen(wd) + 1;
+
+    if(!(buffer == NULL && size == 0) && cwdlen > size) {
+        path_leave();
+        errno = ERANGE;
+        return NULL;
+    }
+
+    /* Handle linux extension of allocating when buffer == NULL */
+    if(buffer == NULL) {
+        if(size == 0) {
+            size = cwdlen;
+        }
+        buffer = malloc(size);
+        if(buffer == NULL) {
+            path_leave();
+            return NULL;
+        }
+    }
+    strcpy(buffer, wd);
+    path_leave();
+
+#ifdef DEBUG
+    fprintf(stderr, "httpcacheopen: getcwd: %s\n", buffer);
+#endif
+
+    return buffer;
+}
+
+
+/* Changing uid invalidates our idea of the euid */
+int setuid(uid_t uid) {
+    int rc;
+
+    GET_REAL_SYMBOL(setuid);
+    rc = _setuid(uid);
+    euid_forget();
+
+    return rc;
+}
+
+
+int seteuid(uid_t euid) {
+    int rc;
+
+    GET_REAL_SYMBOL(seteuid);
+    rc = _seteuid(euid);
+    euid_forget();
+
+    return rc;
+}
+
+
+int setreuid(uid_t ruid, uid_t euid) {
+    int rc;
+
+    GET_REAL_SYMBOL(setreuid);
+    rc = _setreuid(ruid, euid);
+    euid_forget();
+
+    return rc;
+}
+
+
+#ifdef __linux
+int setresuid(uid_t ruid, uid_t euid, uid_t suid) {
+    int rc;
+
+    GET_REAL_SYMBOL(setresuid);
+    rc = _setresuid(ruid, euid, suid);
+    euid_forget();
+
+    return rc;
+}
+#endif /* __linux */
+
+
+/* We emulate chroot in order to support FTP daemons and other thingies that
+   implements a virtual root by doing chroot. */
+int chroot(const char *path) {
+    struct stat64 st;
+    char newdir[PATH_MAX], *root;
+
+    if(get_full_path(newdir, path) == -1) {
+        return(-1);
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "httpcacheopen: chroot: newdir=%s\n", newdir);
+#endif
+
+    /* Do (very) basic checks */
+    if((realstat64(newdir, &st)) == -1) {
+        /* Failure, when your best just isn't good enough */
+#ifdef DEBUG
+        perror("httpcacheopen: chroot: stat");
+#endif
+        return(-1);
+    }
+    if(!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+#ifdef DEBUG
+        perror("httpcacheopen: chroot");
+#endif
+        return(-1);
+    }
+
+    /* Success, set the new chrootdir and go! */
+    root = strdup(newdir);
+    if(root == NULL) {
+        return -1;
+    }
+    path_set(&chrootdir, root);
+
+    /* Need to update the cwd so it's correct. */
+    /* FIXME: In practice we only need to do this when chdir:ing to "."
+       since when chdir:ing to some other directory you have to do
+       "chdir /" directly afterwards. So we cheat. */
+    if(!strcmp(path, ".")) {
+        if(chdir("/") < 0) {
+            perror("httpcacheopen: chdir /");
+        }
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "httpcacheopen: chroot: chrootdir=%s\n", newdir);
+#endif
+
+    return(0);
+}
+
+/* Ugh. Linux uses inlined wrappers for the stat-functions, so we 
+   need to catch __*stat* instead. Code duplication for the win */
+
+#ifndef WRAPPER_STAT_NOWRAP /* FIXME: Solaris kludge */
+#ifdef __linux
+
+int __xstat (int __ver, __const char *path, struct stat *buffer) {
+    char realpath[PATH_MAX];
+
+    GET_REAL_SYMBOL(__xstat);
+
+    /* Check for ABI mismatch */
+    if(__ver != _STAT_VER) {
+        fprintf(stderr, "httpcacheopen: __xstat(): stat version mismatch\n");
+        exit(2);
+    }
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return ___xstat(__ver, path, buffer);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return ___xstat(_STAT_VER, realpath, buffer);
+}
+
+
+int __lxstat (int __ver, __const char *path, struct stat *buffer) {
+    char realpath[PATH_MAX];
+
+    GET_REAL_SYMBOL(__lxstat);
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return ___lxstat(__ver, path, buffer);
+    }
+
+    /* Check for ABI mismatch */
+    if(__ver != _STAT_VER) {
+        fprintf(stderr, "httpcacheopen: __lxstat(): stat version mismatch\n");
+        exit(2);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return ___lxstat(__ver, realpath, buffer);
+}
+#endif /* __linux */
+
+
+int stat(const char *path, struct stat *buffer) {
+    char realpath[PATH_MAX];
+
+    GET_REAL_SYMBOL(stat);
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return _stat(path, buffer);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return _stat(realpath, buffer);
+}
+
+int lstat(const char *path, struct stat *buffer) {
+    char realpath[PATH_MAX];
+
+    GET_REAL_SYMBOL(lstat);
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return _lstat(path, buffer);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return _lstat(realpath, buffer);
+}
+#endif /* WRAPPER_STAT_NOWRAP */
+
+
+#ifdef __linux
+int __xstat64 (int __ver, __const char *path, struct stat64 *buffer) {
+    char realpath[PATH_MAX];
+
+    /* Check for ABI mismatch */
+    if(__ver != _STAT_VER) {
+        fprintf(stderr, "httpcacheopen: __xstat64(): stat version mismatch\n");
+        exit(2);
+    }
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return realstat64(path, buffer);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return realstat64(realpath, buffer);
+}
+
+
+int __lxstat64 (int __ver, __const char *path, struct stat64 *buffer) {
+    char realpath[PATH_MAX];
+
+    GET_REAL_SYMBOL(__lxstat64);
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return ___lxstat64(__ver, path, buffer);
+    }
+
+    /* Check for ABI mismatch */
+    if(__ver != _STAT_VER) {
+        fprintf(stderr, "httpcacheopen: __lxstat64(): stat version mismatch\n");
+        exit(2);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return ___lxstat64(__ver, realpath, buffer);
+}
+#endif /* __linux */
+
+
+int stat64(const char *path, struct stat64 *buffer) {
+    char realpath[PATH_MAX];
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return realstat64(path, buffer);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return realstat64(realpath, buffer);
+}
+
+
+/* Provide a wrapper for the rest of our code */
+static int realstat64(const char *path, struct stat64 *buffer) {
+#ifdef __linux
+    /* Before glibc 2.33 there's only __xstat64 */
+    if(!_stat64) {
+        GET_REAL_SYMBOL(__xstat64);
+        return ___xstat64 (_STAT_VER, path, buffer);
+    }
+#endif /* __linux */
+    GET_REAL_SYMBOL(stat64);
+    return _stat64(path, buffer);
+}
+
+
+int lstat64(const char *path, struct stat64 *buffer) {
+    char realpath[PATH_MAX];
+
+    GET_REAL_SYMBOL(lstat64);
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return _lstat64(path, buffer);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return _lstat64(realpath, buffer);
+}
+
+
+/* The path the *at() calls should use. Only absolute and AT_FDCWD-relative
+   paths need the chroot applied, dirfd was opened through it already.
+   Returns NULL with errno set on failure. */
+static const char *at_path(int dirfd, const char *path, char *realpath) {
+    if(chrootdir == NULL || path[0] == '\0' ||
+            (dirfd != AT_FDCWD && path[0] != '/'))
+    {
+        return path;
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return NULL;
+    }
+
+    return realpath;
+}
+
+
+#ifndef WRAPPER_STAT_NOWRAP
+int fstatat(int dirfd, const char *path, struct stat *buffer, int flags) {
+    char realpath[PATH_MAX];
+#ifdef USE_COPYD
+    cachefdinfo_t *ci;
+#endif /* USE_COPYD */
+    int rc;
+
+    GET_REAL_SYMBOL(fstatat);
+
+    if((path = at_path(dirfd, path, realpath)) == NULL) {
+        return -1;
+    }
+
+    rc = _fstatat(dirfd, path, buffer, flags);
+#ifdef USE_COPYD
+    if(rc == 0 && path[0] == '\0' && (flags & AT_EMPTY_PATH) &&
+            (ci = cachefd_spoofing(dirfd)))
+    {
+        CACHEFD_SPOOF(buffer, ci);
+        cachefd_put(ci);
+    }
+#endif /* USE_COPYD */
+
+    return rc;
+}
+#endif /* WRAPPER_STAT_NOWRAP */
+
+
+int fstatat64(int dirfd, const char *path, struct stat64 *buffer, int flags) {
+    char realpath[PATH_MAX];
+#ifdef USE_COPYD
+    cachefdinfo_t *ci;
+#endif /* USE_COPYD */
+    int rc;
+
+    GET_REAL_SYMBOL(fstatat64);
+
+    if((path = at_path(dirfd, path, realpath)) == NULL) {
+        return -1;
+    }
+
+    rc = _fstatat64(dirfd, path, buffer, flags);
+#ifdef USE_COPYD
+    if(rc == 0 && path[0] == '\0' && (flags & AT_EMPTY_PATH) &&
+            (ci = cachefd_spoofing(dirfd)))
+    {
+        CACHEFD_SPOOF(buffer, ci);
+        cachefd_put(ci);
+    }
+#endif /* USE_COPYD */
+
+    return rc;
+}
+
+
+#if defined(__linux) && defined(STATX_BASIC_STATS)
+int statx(int dirfd, const char *path, int flags, unsigned int mask,
+          struct statx *buffer)
+{
+    char realpath[PATH_MAX];
+#ifdef USE_COPYD
+    cachefdinfo_t *ci;
+#endif /* USE_COPYD */
+    int rc;
+
+    GET_REAL_SYMBOL(statx);
+
+    if((path = at_path(dirfd, path, realpath)) == NULL) {
+        return -1;
+    }
+
+    rc = _statx(dirfd, path, flags, mask, buffer);
+#ifdef USE_COPYD
+    if(rc == 0 && path[0] == '\0' && (flags & AT_EMPTY_PATH) &&
+            (ci = cachefd_spoofing(dirfd)))
+    {
+        buffer->stx_dev_major = major(ci->dev);
+        buffer->stx_dev_minor = minor(ci->dev);
+        buffer->stx_ino = ci->ino;
+        buffer->stx_mode = ci->mode;
+        buffer->stx_size = ci->size;
+        buffer->stx_blocks = (ci->size + 511) / 512;
+        buffer->stx_mtime.tv_sec = ci->mtime;
+        buffer->stx_mtime.tv_nsec = 0;
+        cachefd_put(ci);
+    }
+#endif /* USE_COPYD */
+
+    return rc;
+}
+#endif /* defined(__linux) && defined(STATX_BASIC_STATS) */
+
+
+#ifdef _AIX
+/* AIX native uses the old BSD typing. See comment at beginning of this file */
+int
+#else
+ssize_t 
+#endif
+readlink(const char *path, char *buffer, size_t buffersize) {
+    char realpath[PATH_MAX];
+
+    GET_REAL_SYMBOL(readlink);
+
+    /* Do it the quick way if not chroot */
+    if(chrootdir == NULL) {
+        return _readlink(path, buffer, buffersize);
+    }
+
+    if(strlen(path) +1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(get_full_path(realpath, path) == -1) {
+        return -1;
+    }
+
+    return _readlink(path, buffer, buffersize);
+}
+
+
+#ifdef USE_COPYD
+
+
+/* Check if cachefd is complete.
+   Returns
+           -1 on error.
+            0 if file is NOT complete.
+            1 if file complete.
+ */
+static int cache_file_complete(int fd, struct stat64 *st) {
+    cachefdinfo_t   *ci = cachefd_get(fd);
+    int             rc = 0;
+
+    /* Zero size means not a cachefd */
+    if(!ci || ci->size <= 0 ||
+            __atomic_load_n(&ci->complete, __ATOMIC_ACQUIRE))
+    {
+        rc = 1;
+    }
+    else if(realfstat64(fd, st)) {
+#ifdef DEBUG
+        perror("cache_file_complete: fstat64");
+#endif
+        rc = -1;
+    }
+    else if(st->st_size >= ci->size) {
+        if(!__atomic_exchange_n(&ci->complete, 1, __ATOMIC_ACQ_REL)) {
+            __atomic_sub_fetch(&cachefd_incomplete, 1, __ATOMIC_RELAXED);
+        }
+        cachefd_dropbackend(ci);
+        rc = 1;
+    }
+    cachefd_put(ci);
+
+    return rc;
+}
+
+
+/* Let the copy know that fd is still being read, if it's a cachefd being
+   copied or a backend fd waiting for copyd. Copies nobody reads are
+   demoted and eventually abandoned. */
+static inline void cachefd_reading(int fd) {
+    cachefdinfo_t   *ci = cachefd_get(fd);
+    struct stat64   realst;
+    time_t          now;
+
+    if(ci && ci->size > 0 && (!ci->complete || ci->switchleft > 0) &&
+            ci->readtime != (now = time(NULL)))
+    {
+        ci->readtime = now;
+        cachefd_realst(ci, &realst);
+        cacheindex_reading(cacheindex_getslot(&realst), &realst, now);
+    }
+    cachefd_put(ci);
+}
+
+
+#ifdef USE_CACHERANGES
+/* Number of bytes available at off in the sidecar of cachefd fd. The
+   sidecar is only looked for when the copy is far behind off, since
+   that's the only time copyd bothers to fetch anything out of order. */
+static off64_t cachefd_rangeavail(int fd, off64_t off, struct stat64 *st) {
+    cachefdinfo_t   *ci = cachefd_get(fd);
+    struct stat64   realst;
+    char            cachepath[PATH_MAX];
+    cacheranges_t   *cr;
+    off64_t         avail = 0;
+
+    if(!ci || ci->size <= 0) {
+        goto out;
+    }
+
+    cr = &ci->ranges;
+    if(!cr->hdr) {
+        if(off < st->st_size + CACHE_RANGE_CHUNK) {
+            goto out;
+        }
+        GET_REAL_SYMBOL(open);
+        GET_REAL_SYMBOL(close);
+        cachefd_realst(ci, &realst);
+        cacheopen_prepare(&realst, cachepath);
+        if(cacheranges_open(cr, cachepath, &realst, _open,
+                            realfstat64, _close) == -1)
+        {
+            goto out;
+        }
+#ifdef DEBUG
+        fprintf(stderr, "httpcacheopen: cachefd_rangeavail fd=%d: Opened "
+                "sidecar\n", fd);
+#endif
+    }
+    avail = cacheranges_avail(cr, off);
+
+out:
+    cachefd_put(ci);
+    return avail;
+}
 
-    /* The only readonly-mode is r and rb */
-    if(strncmp(mode,"r+", 2) && strncmp(mode,"rb+", 3) &&
-            !strncmp(mode, "r", 1)) 
-    {
-        int fd;
 
-        fd = open64(filename, O_RDONLY);
-        if(fd == -1) {
-            return NULL;
-        }
-        return fdopen(fd, mode);
+/* Ask copyd to fetch the data at off out of order if the copy is far
+   behind */
+static void cachefd_want(int fd, off64_t off, struct stat64 *st) {
+    cachefdinfo_t   *ci = cachefd_get(fd);
+    struct stat64   realst;
+
+    if(ci && ci->size > 0 && off >= st->st_size + CACHE_RANGE_CHUNK) {
+        cachefd_realst(ci, &realst);
+        cacheindex_want(cacheindex_getslot(&realst), &realst, off);
     }
+    cachefd_put(ci);
+}
 
-    GET_REAL_SYMBOL(fopen64);
-    if(chrootdir) {
-        char fullpath[PATH_MAX];
 
-        if(get_full_path(fullpath, filename) == -1) {
-#ifdef DEBUG
-            perror("httpcacheopen: fopen64: get_full_path failed");
-#endif
-            return NULL;
-        }
+/* The fd and offset to use for reading the data at *off of cachefd fd,
+   which is the sidecar if the cached file doesn't have it yet. The caller
+   holds fd's info for as long as it uses the sidecar. */
+static int cachefd_rangefd(int fd, off64_t *off, struct stat64 *st) {
+    cachefdinfo_t   *ci = cachefd_get(fd);
+    cacheranges_t   *cr;
+    int             rangefd = fd;
 
-        return _fopen64(fullpath, mode);
+    if(ci && *off >= st->st_size) {
+        cr = &ci->ranges;
+        if(cr->hdr && cacheranges_avail(cr, *off) > 0) {
+            *off += cr->hdr->datastart;
+            rangefd = cr->fd;
+        }
     }
+    cachefd_put(ci);
 
-    return _fopen64(filename, mode);
+    return rangefd;
+}
+#else /* USE_CACHERANGES */
+static inline off64_t cachefd_rangeavail(int fd, off64_t off,
+                                         struct stat64 *st)
+{
+    (void) fd; (void) off; (void) st;
+    return 0;
 }
 
+static inline void cachefd_want(int fd, off64_t off, struct stat64 *st) {
+    (void) fd; (void) off; (void) st;
+}
 
-int chdir(const char *path) {
-    char fullpath[PATH_MAX];
-    int rc;
+static inline int cachefd_rangefd(int fd, off64_t *off, struct stat64 *st) {
+    (void) off; (void) st;
+    return fd;
+}
+#endif /* USE_CACHERANGES */
 
-    GET_REAL_SYMBOL(chdir);
 
-    if(get_full_path(fullpath, path) == -1) {
+/* Read from cachefd fd at off, which is past the end of the cached file,
+   from the sidecar. Returns 0 if the sidecar doesn't have it. */
+static ssize_t cachefd_rangeread(int fd, void *buf, size_t count, off64_t off,
+                                 struct stat64 *st)
+{
+    cachefdinfo_t   *ci;
+    off64_t         avail, rangeoff = off;
+    ssize_t         amt = 0;
+    int             rangefd;
+
+    avail = cachefd_rangeavail(fd, off, st);
+    if(avail <= 0) {
+        return 0;
+    }
+    ci = cachefd_get(fd);
+    rangefd = cachefd_rangefd(fd, &rangeoff, st);
+    if(rangefd != fd) {
+        amt = pread64(rangefd, buf, MIN((off64_t)count, avail), rangeoff);
+        if(amt > 0) {
+            /* Keep the file offset in sync, seeking past EOF is fine */
+            lseek64(fd, off + amt, SEEK_SET);
+        }
 #ifdef DEBUG
-        perror("httpcacheopen: chdir: get_full_path failed");
+        fprintf(stderr, "httpcacheopen: cachefd_rangeread fd=%d off=%lld: "
+                "Read %zd from sidecar\n", fd, (long long)off, amt);
 #endif
-        return -1;
     }
+    cachefd_put(ci);
 
-    rc = _chdir(fullpath);
-    if(rc == -1) {
-        return -1;
-    }
+    return amt;
+}
 
-    if(!cachedwd) {
-        cachedwd = malloc(PATH_MAX*2);
-        if(cachedwd == NULL) {
-            return -1;
-        }
-        cachedwd[0] = '\0';
-    }
 
-    /* Rely on _chdir having done max path length checking for us */
-    if(path[0] == '/') {
-        strcpy(cachedwd, path);
-    }
-    else {
-        strcat(cachedwd, "/");
-        strcat(cachedwd, path);
+/* Read from the backend file of cachefd fd at off, which the copy hasn't
+   got to yet. Returns 0 if there is no backend fd to read from. */
+static ssize_t cachefd_backendread(int fd, void *buf, size_t count,
+                                   off64_t off)
+{
+    cachefdinfo_t   *ci = cachefd_get(fd);
+    ssize_t         amt = 0;
+    int             backendfd;
+
+    if(!ci || (backendfd = __atomic_load_n(&ci->backendfd,
+                                           __ATOMIC_ACQUIRE)) <= 0)
+    {
+        goto out;
     }
 
-    /* Remove . .. // */
-    cleanpath(cachedwd);
+    amt = pread64(backendfd - 1, buf, count, off);
+    if(amt <= 0) {
+#ifdef DEBUG
+        perror("httpcacheopen: cachefd_backendread: pread64");
+#endif
+        /* Wait for the copy like everyone else */
+        cachefd_dropbackend(ci);
+        amt = 0;
+        goto out;
+    }
+    /* Keep the file offset in sync, seeking past EOF is fine */
+    lseek64(fd, off + amt, SEEK_SET);
 
 #ifdef DEBUG
-    fprintf(stderr, "httpcacheopen: chdir: Cached %s\n", cachedwd);
+    fprintf(stderr, "httpcacheopen: cachefd_backendread fd=%d off=%lld: "
+            "Read %zd from backend\n", fd, (long long)off, amt);
 #endif
 
-    return(rc);
+out:
+    cachefd_put(ci);
+    return amt;
 }
 
 
-char *getcwd(char *buffer, size_t size) {
-    size_t cwdlen;
+/* -1 == error, 0 == timeout, 1 == data. If ranged is set data in the
+   sidecar counts, and we ask for it to be fetched out of order. */
+int wait_for_io(int fd, off64_t off, struct stat64 *st, int ranged) {
+    cachefdinfo_t       *ci = cachefd_get(fd);
+    cacheindex_entry_t  *slot = NULL;
+    struct stat64       realst;
+    uint32_t            seq;
 
-    /* Check if we have cached the working directory, if not do it the
-       lazy way by calling our chdir that caches it :) */
-    if(!cachedwd) {
-        char mycwd[PATH_MAX];
+    /* If the copy is in the cache index we can sleep until it tells us
+       there's new data instead of polling the file */
+    if(ci && ci->size > 0) {
+        cachefd_realst(ci, &realst);
+        slot = cacheindex_getslot(&realst);
+    }
+    cachefd_put(ci);
 
-        GET_REAL_SYMBOL(getcwd);
-        if(_getcwd(mycwd, PATH_MAX) == NULL) {
-            return NULL;
+    while(1) {
+        /* Blocked readers are readers too */
+        cachefd_reading(fd);
+        seq = cacheindex_waitseq(slot);
+        if(realfstat64(fd, st) < 0) {
+#ifdef DEBUG
+            perror("httpcacheopen: wait_for_io: fstat64");
+#endif
+            return -1;
         }
-        if(chdir(mycwd) == -1) {
-            return NULL;
+        if(st->st_size <= off) {
+            if(ranged) {
+                if(cachefd_rangeavail(fd, off, st) > 0) {
+                    break;
+                }
+                cachefd_want(fd, off, st);
+            }
+
+            /* Check if file has gone stale */
+            if(st->st_nlink == 0 || st->st_mtime != st->st_ctime ||
+                    st->st_mtime < time(NULL) - CACHE_UPDATE_TIMEOUT) 
+            {
+#ifdef DEBUG
+                fprintf(stderr, "httpcacheopen: wait_for_io: timeout\n");
+#endif
+                return 0;
+            }
+
+            cacheindex_wait(slot, seq,
+                            slot ? CACHE_PROGRESS_WAIT : CACHE_LOOP_SLEEP);
+            continue;
         }
+        break;
     }
 
-    cwdlen = strlen(cachedwd) + 1;
+    return 1;
+}
+
 
-    if(!(buffer == NULL && size == 0) && cwdlen > size) {
-        errno = ERANGE;
-        return NULL;
-    }
+#ifdef __linux
+/* Support for event loops.
+
+   A cachefd still being copied is a regular file, so poll() and friends
+   consider it always readable while read() returns EAGAIN when
+   non-blocking, and epoll refuses it altogether. The same goes for a
+   non-blocking socket that sendfile() returns EAGAIN on since the cached
+   file has no more data yet.
+
+   We fix this by letting an inotify fd watching the cached file stand in
+   for the fd we're waiting for when calling the real poll(), select()
+   and epoll_wait(), and only report the fd as ready when there actually
+   is data to be had.
+ */
 
-    /* Handle linux extension of allocating when buffer == NULL */
-    if(buffer == NULL) {
-        if(size == 0) {
-            size = cwdlen;
-        }
-        buffer = malloc(size);
-        if(buffer == NULL) {
-            return NULL;
-        }
+/* Tags the epoll data of our inotify fds, the inotify fd goes in the low
+   bits. Hopefully nobody else uses pointers/values like this. */
+#define EPOLL_TAG           0xcac4000000000000ULL
+#define EPOLL_TAGMASK       0xffff000000000000ULL
+
+typedef struct cachewatch_t {
+    int             epfd;       /* epoll instance */
+    int             fd;         /* The fd as registered by the application */
+    int             cachefd;    /* Incomplete cachefd we're waiting for */
+    uint32_t        events;     /* Events requested by the application */
+    epoll_data_t    data;       /* Data registered by the application */
+    int             reported;   /* Reported in this epoll_wait() round */
+} cachewatch_t;
+
+/* The watches of all threads. Only cachewatch_num is looked at without
+   holding cachewatch_lock, to skip it all when there are none. The lock
+   is only held while looking at or changing the list. Anything that
+   touches the cached files, like checking if there's data or setting up
+   an inotify fd, is done on a copy or before taking it. */
+static cachewatch_t *cachewatch;
+static int          cachewatch_num, cachewatch_max;
+
+
+static inline void cachewatch_enter(void) {
+
+    while(__atomic_test_and_set(&cachewatch_lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
     }
-    strcpy(buffer, cachedwd);
+}
 
-#ifdef DEBUG
-    fprintf(stderr, "httpcacheopen: getcwd: %s\n", buffer);
-#endif
 
-    return buffer;
+static inline void cachewatch_leave(void) {
+
+    __atomic_clear(&cachewatch_lock, __ATOMIC_RELEASE);
 }
 
 
-/* We emulate chroot in order to support FTP daemons and other thingies that
-   implements a virtual root by doing chroot. */
-int chroot(const char *path) {
-    struct stat64 st;
-    char newdir[PATH_MAX];
+/* inotify fd signalling changes of cachefd, created on demand */
+static int cachefd_notify(int cachefd) {
+    cachefdinfo_t   *ci = cachefd_get(cachefd);
+    char            procpath[64];
+    int             nfd, oldfd = -1;
 
-    if(!chrootdir) {
-        chrootdir = malloc(PATH_MAX);
-        if(chrootdir == NULL) {
-            return -1;
-        }
-        chrootdir[0] = '\0';
+    if(!ci) {
+        return -1;
     }
-
-    if(get_full_path(newdir, path) == -1) {
-        return(-1);
+    nfd = __atomic_load_n(&ci->notifyfd, __ATOMIC_ACQUIRE);
+    if(nfd >= 0) {
+        goto out;
     }
 
+    nfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(nfd == -1) {
 #ifdef DEBUG
-    fprintf(stderr, "httpcacheopen: chroot: newdir=%s\n", newdir);
+        perror("httpcacheopen: cachefd_notify: inotify_init1");
 #endif
+        goto out;
+    }
+    GET_REAL_SYMBOL(close);
 
-    /* Do (very) basic checks */
-    if((realstat64(newdir, &st)) == -1) {
-        /* Failure, when your best just isn't good enough */
+    snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", cachefd);
+    if(inotify_add_watch(nfd, procpath, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+                         | IN_DELETE_SELF) == -1)
+    {
 #ifdef DEBUG
-        perror("httpcacheopen: chroot: stat");
+        perror("httpcacheopen: cachefd_notify: inotify_add_watch");
 #endif
-        return(-1);
+        _close(nfd);
+        nfd = -1;
+        goto out;
     }
-    if(!S_ISDIR(st.st_mode)) {
-        errno = ENOTDIR;
-#ifdef DEBUG
-        perror("httpcacheopen: chroot");
-#endif
-        return(-1);
+    /* Another thread may have beaten us to it */
+    if(!__atomic_compare_exchange_n(&ci->notifyfd, &oldfd, nfd, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        _close(nfd);
+        nfd = oldfd;
     }
 
-    /* Success, set the new chrootdir and go! */
-    strcpy(chrootdir, newdir);
+out:
+    cachefd_put(ci);
+    return nfd;
+}
 
-    /* Need to update the cwd so it's correct. */
-    /* FIXME: In practice we only need to do this when chdir:ing to "."
-       since when chdir:ing to some other directory you have to do
-       "chdir /" directly afterwards. So we cheat. */
-    if(!strcmp(path, ".")) {
-        if(chdir("/") < 0) {
-            perror("httpcacheopen: chdir /");
-        }
-    }
 
-#ifdef DEBUG
-    fprintf(stderr, "httpcacheopen: chroot: chrootdir=%s\n", chrootdir);
-#endif
+static void cachefd_drain(int nfd) {
+    char buf[4096];
 
-    return(0);
-}
+    GET_REAL_SYMBOL(read);
 
-/* Ugh. Linux uses inlined wrappers for the stat-functions, so we 
-   need to catch __*stat* instead. Code duplication for the win */
+    while(_read(nfd, buf, sizeof(buf)) > 0);
+}
 
-#ifndef WRAPPER_STAT_NOWRAP /* FIXME: Solaris kludge */
-#ifdef __linux
 
-int __xstat (int __ver, __const char *path, struct stat *buffer) {
-    char realpath[PATH_MAX];
+/* Returns 1 if a read on the cachefd at off (-1 for the file offset)
+   won't block (data available, at EOF or an error to report), 0 if it
+   would */
+static int cachefd_ready(int fd, off64_t off) {
+    struct stat64   st;
+    int             rc;
 
-    GET_REAL_SYMBOL(__xstat);
+    cachefdinfo_t   *ci;
+    int             backendfd;
 
-    /* Check for ABI mismatch */
-    if(__ver != _STAT_VER) {
-        fprintf(stderr, "httpcacheopen: __xstat(): stat version mismatch\n");
-        exit(2);
+    rc = cache_file_complete(fd, &st);
+    if(rc != 0) {
+        return 1;
     }
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return ___xstat(__ver, path, buffer);
+    /* Reads past the copy go to the backend. Closed meanwhile, let read()
+       tell. */
+    ci = cachefd_get(fd);
+    backendfd = ci ? __atomic_load_n(&ci->backendfd, __ATOMIC_ACQUIRE) : 1;
+    cachefd_put(ci);
+    if(backendfd > 0) {
+        return 1;
     }
 
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
-        return -1;
+    if(off < 0) {
+        off = lseek64(fd, 0, SEEK_CUR);
+    }
+    if(off == -1 || st.st_size > off || cachefd_rangeavail(fd, off, &st) > 0) {
+        return 1;
     }
 
-    if(get_full_path(realpath, path) == -1) {
-        return -1;
+    /* Let read() report that the copy has gone stale */
+    if(st.st_nlink == 0 || st.st_mtime != st.st_ctime ||
+            st.st_mtime < time(NULL) - CACHE_UPDATE_TIMEOUT) 
+    {
+        return 1;
     }
 
-    return ___xstat(_STAT_VER, realpath, buffer);
+    return 0;
 }
 
 
-int __lxstat (int __ver, __const char *path, struct stat *buffer) {
-    char realpath[PATH_MAX];
-
-    GET_REAL_SYMBOL(__lxstat);
+/* Returns the incomplete cachefd a poll on fd for events must wait for,
+   the offset it waits for in off and the events involved in mask. -1 if
+   none. */
+static int cachefd_blocking(int fd, short events, short *mask, off64_t *off) {
+    cachefdslot_t   *slot = cachefd_slot(fd);
+    cachefdinfo_t   *ci;
+    int             cachefd = -1, incomplete;
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return ___lxstat(__ver, path, buffer);
+    if(!slot) {
+        return -1;
     }
 
-    /* Check for ABI mismatch */
-    if(__ver != _STAT_VER) {
-        fprintf(stderr, "httpcacheopen: __lxstat(): stat version mismatch\n");
-        exit(2);
+    ci = cachefd_get(fd);
+    incomplete = ci && ci->size > 0 && !ci->complete;
+    cachefd_put(ci);
+    if(events & (POLLIN | POLLRDNORM) && incomplete) {
+        *mask = POLLIN | POLLRDNORM;
+        cachefd = fd;
+        *off = -1;
     }
-
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
+    else if(events & (POLLOUT | POLLWRNORM) && slot->stallfd > 0) {
+        *mask = POLLOUT | POLLWRNORM;
+        cachefd = slot->stallfd - 1;
+        *off = slot->stalloff;
+        ci = cachefd_get(cachefd);
+        if(!ci || ci->size == 0 || ci->complete) {
+            cachefd = -1;
+        }
+        cachefd_put(ci);
+    }
+    if(cachefd == -1) {
         return -1;
     }
 
-    if(get_full_path(realpath, path) == -1) {
+    if(cachefd_ready(cachefd, *off)) {
         return -1;
     }
 
-    return ___lxstat(__ver, realpath, buffer);
+    return cachefd;
 }
 
-#else /* __linux */
 
-int stat(const char *path, struct stat *buffer) {
-    char realpath[PATH_MAX];
+/* Add a watch, called with cachewatch_lock held like the rest of the
+   cachewatch_ functions */
+static void cachewatch_add(int epfd, int fd, int cachefd, uint32_t events,
+                           epoll_data_t data)
+{
+    cachewatch_t *w;
 
-    GET_REAL_SYMBOL(stat);
+    if(cachewatch_num == cachewatch_max) {
+        w = realloc(cachewatch, (cachewatch_max+16) * sizeof(cachewatch_t));
+        if(!w) {
+            return;
+        }
+        cachewatch = w;
+        cachewatch_max += 16;
+    }
+    w = &cachewatch[cachewatch_num++];
+    w->epfd = epfd;
+    w->fd = fd;
+    w->cachefd = cachefd;
+    w->events = events;
+    w->data = data;
+    w->reported = 0;
+}
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return _stat(path, buffer);
+
+/* Index of the watch of fd in epfd, cachewatch_num if none */
+static int cachewatch_lookup(int epfd, int fd) {
+    int i;
+
+    for(i=0; i<cachewatch_num; i++) {
+        if(cachewatch[i].epfd == epfd && cachewatch[i].fd == fd) {
+            break;
+        }
     }
 
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
-        return -1;
+    return i;
+}
+
+
+/* Remove watch i, and our inotify fd from the epoll instance unless
+   another watch needs it */
+static void cachewatch_del(int i) {
+    int             j, epfd = cachewatch[i].epfd;
+    cachefdinfo_t   *ci = cachefd_get(cachewatch[i].cachefd);
+
+    cachewatch[i] = cachewatch[--cachewatch_num];
+
+    /* dup:ed cachefds share the inotify fd */
+    for(j=0; j<cachewatch_num; j++) {
+        if(cachewatch[j].epfd == epfd &&
+                cachefd_peek(cachewatch[j].cachefd) == ci)
+        {
+            break;
+        }
+    }
+    if(j == cachewatch_num && ci && ci->notifyfd >= 0) {
+        _epoll_ctl(epfd, EPOLL_CTL_DEL, ci->notifyfd, NULL);
     }
+    cachefd_put(ci);
+}
 
-    if(get_full_path(realpath, path) == -1) {
+
+/* Make sure our inotify fd for cachefd is in the epoll instance */
+static int cachewatch_arm(int epfd, int cachefd) {
+    struct epoll_event  ev;
+    int                 nfd;
+
+    nfd = cachefd_notify(cachefd);
+    if(nfd == -1) {
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u64 = EPOLL_TAG | (unsigned) nfd;
+    if(_epoll_ctl(epfd, EPOLL_CTL_ADD, nfd, &ev) == -1 && errno != EEXIST) {
         return -1;
     }
 
-    return _stat(realpath, buffer);
+    return 0;
+}
+
+
+/* A sendfile() from cachefd at off to outfd would block due to lack of
+   data */
+static void cachefd_stall(int outfd, int cachefd, off64_t off) {
+    cachefdslot_t *slot = cachefd_slotalloc(outfd);
+
+    if(!slot) {
+        return;
+    }
+    slot->stalloff = off;
+    if(__atomic_exchange_n(&slot->stallfd, cachefd + 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_add_fetch(&cachefd_stalled, 1, __ATOMIC_RELAXED);
+    }
+
+    /* If outfd is in an epoll set, wake it when there's data */
+    if(slot->epfd > 0) {
+        int epfd = slot->epfd - 1;
+
+        cachewatch_enter();
+        if(cachewatch_lookup(epfd, outfd) < cachewatch_num) {
+            cachewatch_leave();
+            return;
+        }
+        cachewatch_leave();
+
+        if(cachewatch_arm(epfd, cachefd) == 0) {
+            cachewatch_enter();
+            if(cachewatch_lookup(epfd, outfd) == cachewatch_num) {
+                cachewatch_add(epfd, outfd, cachefd, slot->events,
+                               slot->data);
+            }
+            cachewatch_leave();
+        }
+    }
 }
 
-int lstat(const char *path, struct stat *buffer) {
-    char realpath[PATH_MAX];
 
-    GET_REAL_SYMBOL(lstat);
+/* outfd no longer waits for a cachefd, drop its watches */
+static void cachewatch_unstall(int outfd) {
+    cachefdslot_t   *slot = cachefd_slot(outfd);
+    int             i;
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return _lstat(path, buffer);
+    if(!slot) {
+        return;
     }
-
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
-        return -1;
+    if(slot->stallfd > 0 &&
+            __atomic_exchange_n(&slot->stallfd, 0, __ATOMIC_ACQ_REL) > 0)
+    {
+        __atomic_sub_fetch(&cachefd_stalled, 1, __ATOMIC_RELAXED);
     }
 
-    if(get_full_path(realpath, path) == -1) {
-        return -1;
+    for(i=cachewatch_num-1; i>=0; i--) {
+        if(cachewatch[i].fd == outfd && cachewatch[i].cachefd != outfd) {
+            cachewatch_del(i);
+        }
     }
-
-    return _lstat(realpath, buffer);
 }
 
-#endif /* __linux */
-#endif /* WRAPPER_STAT_NOWRAP */
 
+static void cachefd_unstall(int outfd) {
 
-#ifdef __linux
-int __xstat64 (int __ver, __const char *path, struct stat64 *buffer) {
-    char realpath[PATH_MAX];
+    cachewatch_enter();
+    cachewatch_unstall(outfd);
+    cachewatch_leave();
+}
 
-    /* Check for ABI mismatch */
-    if(__ver != _STAT_VER) {
-        fprintf(stderr, "httpcacheopen: __xstat64(): stat version mismatch\n");
-        exit(2);
-    }
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return realstat64(path, buffer);
-    }
+/* fd is being closed, forget everything about it */
+static void cachefd_forget(int fd) {
+    int i;
 
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
-        return -1;
+    /* Nothing stalled nor watched, as in most processes */
+    if(fd < 0 || (__atomic_load_n(&cachewatch_num, __ATOMIC_RELAXED) == 0 &&
+                  __atomic_load_n(&cachefd_stalled, __ATOMIC_RELAXED) == 0))
+    {
+        return;
     }
 
-    if(get_full_path(realpath, path) == -1) {
-        return -1;
-    }
+    cachewatch_enter();
+    cachewatch_unstall(fd);
 
-    return realstat64(realpath, buffer);
+    for(i=0; i<cachewatch_num; ) {
+        if(cachewatch[i].epfd == fd) {
+            /* The epoll instance itself, nothing to deregister from */
+            cachewatch[i] = cachewatch[--cachewatch_num];
+        }
+        else if(cachewatch[i].cachefd == fd &&
+                cachewatch[i].fd != cachewatch[i].cachefd)
+        {
+            /* Modifies the list, start over */
+            cachewatch_unstall(cachewatch[i].fd);
+            i = 0;
+        }
+        else if(cachewatch[i].fd == fd || cachewatch[i].cachefd == fd) {
+            cachewatch_del(i);
+        }
+        else {
+            i++;
+        }
+    }
+    cachewatch_leave();
 }
 
 
-/* Provide a wrapper for the rest of our code */
-static int realstat64(const char *path, struct stat64 *buffer) {
-    GET_REAL_SYMBOL(__xstat64);
-    return ___xstat64 (_STAT_VER, path, buffer);
+/* Nobody uses ci any more, nor does any fd refer to it */
+static void cachefd_release(cachefdinfo_t *ci) {
+
+    if(ci->size > 0) {
+        if(!__atomic_exchange_n(&ci->complete, 1, __ATOMIC_ACQ_REL)) {
+            __atomic_sub_fetch(&cachefd_incomplete, 1, __ATOMIC_RELAXED);
+        }
+        if(ci->notifyfd >= 0) {
+            _close(ci->notifyfd);
+        }
+#ifdef USE_CACHERANGES
+        cacheranges_close(&ci->ranges, _close);
+#endif /* USE_CACHERANGES */
+    }
 }
 
 
-int __lxstat64 (int __ver, __const char *path, struct stat64 *buffer) {
-    char realpath[PATH_MAX];
+/* poll() that knows about cachefds. Incomplete cachefds and stalled
+   sendfile() destinations have the events they're waiting for masked out,
+   and the inotify fd of the cachefd appended instead. */
+static int cache_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    struct pollfd   *tmp;
+    struct {
+        nfds_t  idx;
+        int     cachefd;
+        off64_t off;
+        short   mask;
+    }               *extra;
+    nfds_t          i, nextra;
+    int             rc, n, cachefd;
+    short           mask;
+    off64_t         off;
+    struct timespec now, end;
 
-    GET_REAL_SYMBOL(__lxstat64);
+    GET_REAL_SYMBOL(poll);
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return ___lxstat64(__ver, path, buffer);
+    if(__atomic_load_n(&cachefd_incomplete, __ATOMIC_RELAXED) <= 0 &&
+            __atomic_load_n(&cachefd_stalled, __ATOMIC_RELAXED) <= 0)
+    {
+        return _poll(fds, nfds, timeout);
     }
 
-    /* Check for ABI mismatch */
-    if(__ver != _STAT_VER) {
-        fprintf(stderr, "httpcacheopen: __lxstat64(): stat version mismatch\n");
-        exit(2);
+    for(i=0; i<nfds; i++) {
+        if(cachefd_blocking(fds[i].fd, fds[i].events, &mask, &off) >= 0) {
+            break;
+        }
+    }
+    if(i == nfds) {
+        return _poll(fds, nfds, timeout);
     }
 
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
-        return -1;
+    tmp = malloc(2 * nfds * sizeof(struct pollfd));
+    extra = malloc(nfds * sizeof(*extra));
+    if(!tmp || !extra) {
+        free(tmp);
+        free(extra);
+        return _poll(fds, nfds, timeout);
     }
 
-    if(get_full_path(realpath, path) == -1) {
-        return -1;
+    if(timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        end.tv_sec += timeout / 1000;
+        end.tv_nsec += (timeout % 1000) * 1000000;
+        if(end.tv_nsec >= 1000000000) {
+            end.tv_sec++;
+            end.tv_nsec -= 1000000000;
+        }
     }
 
-    return ___lxstat64(__ver, realpath, buffer);
-}
+    while(1) {
+        memcpy(tmp, fds, nfds * sizeof(struct pollfd));
+        nextra = 0;
+        for(i=0; i<nfds; i++) {
+            cachefd = cachefd_blocking(fds[i].fd, fds[i].events, &mask, &off);
+            if(cachefd < 0) {
+                continue;
+            }
+            tmp[nfds+nextra].fd = cachefd_notify(cachefd);
+            if(tmp[nfds+nextra].fd < 0) {
+                /* No notification, fall back to report it as ready */
+                continue;
+            }
+            tmp[nfds+nextra].events = POLLIN;
+            tmp[i].events &= ~mask;
+            extra[nextra].idx = i;
+            extra[nextra].cachefd = cachefd;
+            extra[nextra].off = off;
+            extra[nextra].mask = mask;
+            nextra++;
+        }
 
-#else /* __linux */
+        rc = _poll(tmp, nfds + nextra, timeout);
+        if(rc < 0) {
+            break;
+        }
 
-int stat64(const char *path, struct stat64 *buffer) {
-    char realpath[PATH_MAX];
+        for(i=0; i<nfds; i++) {
+            fds[i].revents = tmp[i].revents;
+        }
+        for(i=0; i<nextra; i++) {
+            if(tmp[nfds+i].revents) {
+                cachefd_drain(tmp[nfds+i].fd);
+                if(cachefd_ready(extra[i].cachefd, extra[i].off)) {
+                    fds[extra[i].idx].revents |= 
+                            fds[extra[i].idx].events & extra[i].mask;
+                }
+            }
+        }
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return realstat64(path, buffer);
-    }
+        for(i=0, n=0; i<nfds; i++) {
+            if(fds[i].revents) {
+                n++;
+            }
+        }
+        if(n > 0 || timeout == 0) {
+            rc = n;
+            break;
+        }
 
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
-        return -1;
+        /* Spurious wakeup, go again with whatever time is left */
+        if(timeout > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout = (end.tv_sec - now.tv_sec) * 1000 +
+                      (end.tv_nsec - now.tv_nsec) / 1000000;
+            if(timeout <= 0) {
+                rc = 0;
+                break;
+            }
+        }
     }
 
-    if(get_full_path(realpath, path) == -1) {
-        return -1;
-    }
+    free(tmp);
+    free(extra);
 
-    return realstat64(realpath, buffer);
+    return rc;
 }
 
 
-/* Provide a wrapper for the rest of our code */
-static int realstat64(const char *path, struct stat64 *buffer) {
-    GET_REAL_SYMBOL(stat64);
-    return _stat64(path, buffer);
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+
+    return cache_poll(fds, nfds, timeout);
 }
 
 
-int lstat64(const char *path, struct stat64 *buffer) {
-    char realpath[PATH_MAX];
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+           struct timeval *timeout)
+{
+    struct pollfd   *pfds;
+    int             i, n, rc, ms;
+    struct timespec start, now;
 
-    GET_REAL_SYMBOL(lstat64);
+    GET_REAL_SYMBOL(select);
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return _lstat64(path, buffer);
+    if(__atomic_load_n(&cachefd_incomplete, __ATOMIC_RELAXED) <= 0 &&
+            __atomic_load_n(&cachefd_stalled, __ATOMIC_RELAXED) <= 0)
+    {
+        return _select(nfds, readfds, writefds, exceptfds, timeout);
     }
 
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
-        return -1;
+    /* Do it the poll() way, so we only need to know how to do it once */
+    pfds = malloc(nfds * sizeof(struct pollfd));
+    if(!pfds) {
+        return _select(nfds, readfds, writefds, exceptfds, timeout);
     }
+    for(i=0, n=0; i<nfds; i++) {
+        short events = 0;
 
-    if(get_full_path(realpath, path) == -1) {
-        return -1;
+        if(readfds && FD_ISSET(i, readfds)) {
+            events |= POLLIN;
+        }
+        if(writefds && FD_ISSET(i, writefds)) {
+            events |= POLLOUT;
+        }
+        if(exceptfds && FD_ISSET(i, exceptfds)) {
+            events |= POLLPRI;
+        }
+        if(events) {
+            pfds[n].fd = i;
+            pfds[n].events = events;
+            pfds[n].revents = 0;
+            n++;
+        }
     }
 
-    return _lstat64(realpath, buffer);
-}
-#endif /* __linux */
-
+    if(timeout) {
+        ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    else {
+        ms = -1;
+    }
 
-#ifdef _AIX
-/* AIX native uses the old BSD typing. See comment at beginning of this file */
-int
-#else
-ssize_t 
-#endif
-readlink(const char *path, char *buffer, size_t buffersize) {
-    char realpath[PATH_MAX];
+    rc = cache_poll(pfds, n, ms);
 
-    GET_REAL_SYMBOL(readlink);
+    if(rc >= 0) {
+        if(readfds) {
+            FD_ZERO(readfds);
+        }
+        if(writefds) {
+            FD_ZERO(writefds);
+        }
+        if(exceptfds) {
+            FD_ZERO(exceptfds);
+        }
+        for(i=0, rc=0; i<n; i++) {
+            short revents = pfds[i].revents;
 
-    /* Do it the quick way if not chroot */
-    if(chrootdir == NULL) {
-        return _readlink(path, buffer, buffersize);
+            if(revents & POLLNVAL) {
+                errno = EBADF;
+                rc = -1;
+                break;
+            }
+            /* Errors are reported as the fd being ready */
+            if(revents & (POLLERR | POLLHUP)) {
+                revents |= pfds[i].events & (POLLIN | POLLOUT);
+            }
+            if(readfds && revents & (POLLIN | POLLRDNORM)) {
+                FD_SET(pfds[i].fd, readfds);
+                rc++;
+            }
+            if(writefds && revents & (POLLOUT | POLLWRNORM)) {
+                FD_SET(pfds[i].fd, writefds);
+                rc++;
+            }
+            if(exceptfds && revents & POLLPRI) {
+                FD_SET(pfds[i].fd, exceptfds);
+                rc++;
+            }
+        }
     }
 
-    if(strlen(path) +1 > PATH_MAX) {
-        errno = ENAMETOOLONG;
-        return -1;
+    /* Linux updates timeout with the time not slept */
+    if(timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms -= (now.tv_sec - start.tv_sec) * 1000 + 
+              (now.tv_nsec - start.tv_nsec) / 1000000;
+        if(ms < 0) {
+            ms = 0;
+        }
+        timeout->tv_sec = ms / 1000;
+        timeout->tv_usec = (ms % 1000) * 1000;
     }
 
-    if(get_full_path(realpath, path) == -1) {
-        return -1;
-    }
+    free(pfds);
 
-    return _readlink(path, buffer, buffersize);
+    return rc;
 }
 
 
-#ifdef USE_COPYD
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    cachefdinfo_t   *ci = cachefd_get(fd);
+    cachefdslot_t   *slot;
+    int             i, rc, cached, complete;
 
+    GET_REAL_SYMBOL(epoll_ctl);
 
-/* Check if cachefd is complete.
-   Returns
-           -1 on error.
-            0 if file is NOT complete.
-            1 if file complete.
- */
-static int cache_file_complete(int fd, struct stat64 *st) {
-    /* fd's that don't fit into the array are always complete */
-    if(fd >= CACHE_MAXFD || fd < 0) {
-        return 1;
+    cached = ci && ci->size > 0;
+    complete = ci && __atomic_load_n(&ci->complete, __ATOMIC_ACQUIRE);
+    cachefd_put(ci);
+
+    if(cached) {
+        /* epoll doesn't do regular files, watch our inotify fd instead */
+        rc = 0;
+        if(op == EPOLL_CTL_ADD && !complete &&
+                cachewatch_arm(epfd, fd) == -1)
+        {
+            return -1;
+        }
+        cachewatch_enter();
+        i = cachewatch_lookup(epfd, fd);
+        if(i == cachewatch_num && complete) {
+            /* Complete and not watched since it wasn't, nothing to wait
+               for. Left for epoll to refuse like any regular file,
+               rather than setting up an inotify fd that is slow to
+               close. */
+            cachewatch_leave();
+            return _epoll_ctl(epfd, op, fd, event);
+        }
+        if(op == EPOLL_CTL_ADD) {
+            if(i < cachewatch_num) {
+                errno = EEXIST;
+                rc = -1;
+            }
+            else {
+                cachewatch_add(epfd, fd, fd, event->events, event->data);
+            }
+        }
+        else if(i == cachewatch_num) {
+            errno = ENOENT;
+            rc = -1;
+        }
+        else if(op == EPOLL_CTL_MOD) {
+            cachewatch[i].events = event->events;
+            cachewatch[i].data = event->data;
+        }
+        else if(op == EPOLL_CTL_DEL) {
+            cachewatch_del(i);
+        }
+        cachewatch_leave();
+        return rc;
     }
 
-    /* Zero size means not a cachefd */
-    if(cachefdinfo[fd].realst.st_size <= 0) {
-        return 1;
+    /* Remember the registration, so we know what to report when a
+       sendfile() to fd is stalled */
+    rc = _epoll_ctl(epfd, op, fd, event);
+    if(rc == 0) {
+        if(op == EPOLL_CTL_DEL) {
+            if((slot = cachefd_slot(fd))) {
+                slot->epfd = 0;
+                cachefd_unstall(fd);
+            }
+        }
+        else if((slot = cachefd_slotalloc(fd))) {
+            slot->epfd = epfd + 1;
+            slot->events = event->events;
+            slot->data = event->data;
+        }
     }
 
-    if(cachefdinfo[fd].complete) {
-        return 1;
+    return rc;
+}
+
+
+/* Copy the watches of epfd to *ws, growing it as needed, so they can be
+   checked without holding cachewatch_lock. Returns the number copied, -1
+   if out of memory. */
+static int cachewatch_copy(int epfd, cachewatch_t **ws, int *max) {
+    cachewatch_t    *w;
+    int             i, n;
+
+    while(1) {
+        cachewatch_enter();
+        if(cachewatch_num <= *max) {
+            for(i=0, n=0; i<cachewatch_num; i++) {
+                if(cachewatch[i].epfd == epfd) {
+                    (*ws)[n++] = cachewatch[i];
+                }
+            }
+            cachewatch_leave();
+            return n;
+        }
+        n = cachewatch_num;
+        cachewatch_leave();
+
+        w = realloc(*ws, n * sizeof(cachewatch_t));
+        if(!w) {
+            return -1;
+        }
+        *ws = w;
+        *max = n;
     }
+}
 
-    if(realfstat64(fd, st)) {
-#ifdef DEBUG
-        perror("cache_file_complete: fstat64");
-#endif
-        return -1;
+
+/* The watch ws was copied from, if it's still there */
+static cachewatch_t *cachewatch_match(const cachewatch_t *ws) {
+    int i;
+
+    for(i=0; i<cachewatch_num; i++) {
+        if(cachewatch[i].epfd == ws->epfd && cachewatch[i].fd == ws->fd &&
+                cachewatch[i].cachefd == ws->cachefd)
+        {
+            return &cachewatch[i];
+        }
     }
 
-    if(st->st_size >= cachefdinfo[fd].realst.st_size) {
-        cachefdinfo[fd].complete = 1;
-        return 1;
+    return NULL;
+}
+
+
+/* Find the watch for the application registration epfd/data */
+static cachewatch_t *cachewatch_find(int epfd, epoll_data_t data) {
+    int i;
+
+    for(i=0; i<cachewatch_num; i++) {
+        if(cachewatch[i].epfd == epfd && cachewatch[i].data.u64 == data.u64) {
+            return &cachewatch[i];
+        }
     }
 
-    return 0;
+    return NULL;
 }
 
 
-/* -1 == error, 0 == timeout, 1 == data */
-int wait_for_io(int fd, off64_t off, struct stat64 *st) {
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout)
+{
+    int             i, j, n, rc, nws, maxws = 0;
+    cachewatch_t    *w, *ws = NULL;
+    cachefdslot_t   *slot;
+    struct timespec now, end;
+
+    GET_REAL_SYMBOL(epoll_wait);
+
+    if(__atomic_load_n(&cachewatch_num, __ATOMIC_RELAXED) == 0) {
+        return _epoll_wait(epfd, events, maxevents, timeout);
+    }
+
+    if(timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        end.tv_sec += timeout / 1000;
+        end.tv_nsec += (timeout % 1000) * 1000000;
+        if(end.tv_nsec >= 1000000000) {
+            end.tv_sec++;
+            end.tv_nsec -= 1000000000;
+        }
+    }
 
     while(1) {
-        if(realfstat64(fd, st) < 0) {
-#ifdef DEBUG
-            perror("httpcacheopen: wait_for_io: fstat64");
-#endif
-            return -1;
+        /* Check the watches that are ready on a copy, it takes looking at
+           the cached files */
+        nws = cachewatch_copy(epfd, &ws, &maxws);
+        if(nws < 0) {
+            rc = -1;
+            break;
+        }
+        for(i=0; i<nws; i++) {
+            slot = cachefd_slot(ws[i].fd);
+            ws[i].reported = cachefd_ready(ws[i].cachefd,
+                    ws[i].fd == ws[i].cachefd || !slot ? -1 : slot->stalloff);
         }
-        if(st->st_size <= off) {
-            struct timespec     delay;
 
-            /* Check if file has gone stale */
-            if(st->st_nlink == 0 || st->st_mtime != st->st_ctime ||
-                    st->st_mtime < time(NULL) - CACHE_UPDATE_TIMEOUT) 
+        /* Report the watches that are ready and still there. Regular
+           files are level triggered, and so are we. Only what's reported
+           in this pass counts, the scan may stop short. */
+        cachewatch_enter();
+        for(i=0; i<cachewatch_num; i++) {
+            cachewatch[i].reported = 0;
+        }
+        for(i=0, n=0; i<nws && n < maxevents; i++) {
+            if(!ws[i].reported || !(w = cachewatch_match(&ws[i]))) {
+                continue;
+            }
+            if(w->fd == w->cachefd) {
+                events[n].events = w->events & (EPOLLIN | EPOLLRDNORM);
+            }
+            else {
+                events[n].events = w->events & (EPOLLOUT | EPOLLWRNORM);
+            }
+            events[n].data = w->data;
+            w->reported = 1;
+            n++;
+        }
+
+        /* Stalled sendfile()s that can go on doesn't need watching anymore */
+        for(i=cachewatch_num-1; i>=0; i--) {
+            if(cachewatch[i].reported &&
+                    cachewatch[i].fd != cachewatch[i].cachefd)
             {
-#ifdef DEBUG
-                fprintf(stderr, "httpcacheopen: wait_for_io: timeout\n");
-#endif
-                return 0;
+                cachewatch_unstall(cachewatch[i].fd);
+            }
+        }
+        cachewatch_leave();
+
+        if(n == maxevents) {
+            rc = n;
+            break;
+        }
+
+        rc = _epoll_wait(epfd, events+n, maxevents-n, n ? 0 : timeout);
+        if(rc < 0) {
+            rc = n ? n : rc;
+            break;
+        }
+
+        cachewatch_enter();
+        for(i=n, j=n; i<n+rc; i++) {
+            if((events[i].data.u64 & EPOLL_TAGMASK) == EPOLL_TAG) {
+                /* One of our inotify fds, report it next round */
+                cachefd_drain(events[i].data.u64 & ~EPOLL_TAGMASK);
+                continue;
+            }
+            w = cachewatch_find(epfd, events[i].data);
+            if(w && w->fd != w->cachefd) {
+                /* The fd a stalled sendfile() writes to, it being writable
+                   isn't news */
+                events[i].events &= ~(EPOLLOUT | EPOLLWRNORM);
+                if(events[i].events == 0) {
+                    continue;
+                }
             }
+            events[j++] = events[i];
+        }
+        cachewatch_leave();
+        n = j;
+
+        if(n > 0 || timeout == 0) {
+            rc = n;
+            break;
+        }
 
-            delay.tv_sec = 0;
-            delay.tv_nsec = CACHE_LOOP_SLEEP*1000000;
-            nanosleep(&delay, NULL);
+        if(rc > 0) {
+            /* Only our own events, check if there's something to report */
             continue;
         }
-        break;
+
+        if(timeout > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout = (end.tv_sec - now.tv_sec) * 1000 +
+                      (end.tv_nsec - now.tv_nsec) / 1000000;
+            if(timeout <= 0) {
+                rc = 0;
+                break;
+            }
+        }
     }
 
-    return 1;
+    free(ws);
+
+    return rc;
 }
+#endif /* __linux */
 
 
 ssize_t read(int fd, void *buf, size_t count) {
+    cachefdinfo_t   *ci;
     ssize_t         amt;
     int             flags, rc;
     struct stat64   st;
-    off64_t         off;
+    off64_t         off, size;
 
     GET_REAL_SYMBOL(read);
 
+    cachefd_reading(fd);
     amt = _read(fd, buf, count);
 
 #ifdef DEBUG
@@ -1053,6 +3781,7 @@ ssize_t read(int fd, void *buf, size_t count) {
 
     /* Nothing fancy needed if we got data or error :) */
     if(amt != 0) {
+        realfd_progress(fd, buf, amt, -1);
         return amt;
     }
 
@@ -1068,34 +3797,53 @@ ssize_t read(int fd, void *buf, size_t count) {
         return -1;
     }
 
-    /* OK, there will be more data soon. First check if we are non-blocking */
-    /* FIXME: Is this really smart? The fd will return as readable by select
-              which will probably create a nice ping-pong effect. Kludge it
-              by waiting a bit before we return?
-     */
+    off = lseek64(fd, 0, SEEK_CUR);
+    if(off == -1) {
+#ifdef DEBUG
+        perror("httpcacheopen: read: lseek64");
+#endif
+        return -1;
+    }
+
+    /* Nothing more to wait for at the end of the real file */
+    ci = cachefd_get(fd);
+    size = ci ? ci->size : 0;
+    cachefd_put(ci);
+    if(off >= size) {
+        return 0;
+    }
+
+    /* Might have been fetched out of order */
+    amt = cachefd_rangeread(fd, buf, count, off, &st);
+    if(amt != 0) {
+        return amt;
+    }
+
+    /* No need to wait for the copy if we can read the backend file */
+    amt = cachefd_backendread(fd, buf, count, off);
+    if(amt != 0) {
+        return amt;
+    }
+
+    /* OK, there will be more data soon. First check if we are non-blocking,
+       poll() and friends won't report the fd readable until there is data */
     flags = fcntl(fd, F_GETFL);
     if(flags < 0) {
         return -1;
     }
     if(flags & O_NONBLOCK) {
+        cachefd_want(fd, off, &st);
         errno = EAGAIN;
         return -1;
     }
 
     /* OK. Let's wait for some action then... */
-    off = lseek64(fd, 0, SEEK_CUR);
-    if(off == -1) {
-#ifdef DEBUG
-        perror("httpcacheopen: read: lseek64");
-#endif
-        return -1;
-    }
 
 #ifdef DEBUG
     fprintf(stderr, "httpcacheopen: read fd=%d off=%lld: Hit EOF but file not complete\n", fd, (long long)off);
 #endif
 
-    rc = wait_for_io(fd, off, &st);
+    rc = wait_for_io(fd, off, &st, 1);
     if(rc == -1) {
         return -1;
     }
@@ -1109,11 +3857,37 @@ ssize_t read(int fd, void *buf, size_t count) {
             fd, (long long)st.st_size);
 #endif
 
+    if(st.st_size <= off) {
+        return cachefd_rangeread(fd, buf, count, off, &st);
+    }
+
     /* Assume read will succeed now (assuming makes an ass out of u and me) */
     return _read(fd, buf, count);
 }
 
 
+/* fd is being closed, drop whatever we have hanging off it */
+static void cachefd_close(int fd) {
+    cachefdinfo_t *ci;
+
+    if(fd < 0) {
+        return;
+    }
+
+    copyd_closed(fd);
+#ifdef __linux
+    cachefd_forget(fd);
+#endif /* __linux */
+    /* Whatever hangs off the open file description goes with the last fd
+       referring to it, once no other thread is using it */
+    ci = cachefd_detach(fd);
+    if(ci) {
+        realfd_teedone(ci, fd, 1);
+        cachefd_put(ci);
+    }
+}
+
+
 int close(int fd) {
 
 #ifdef DEBUG
@@ -1122,18 +3896,150 @@ int close(int fd) {
 
     GET_REAL_SYMBOL(close);
 
-    if(fd < CACHE_MAXFD) {
-        /* Clear the entire struct to return it to default state */
-        memset(&cachefdinfo[fd].realst, 0, sizeof(struct stat64));
-    }
+    cachefd_close(fd);
 
     return _close(fd);
 }
 
 
+#ifdef __GNUC__
+static void wrapper_fini(void) __attribute__((destructor));
+#endif /* __GNUC__ */
+static void wrapper_fini(void) {
+    realfd_teeall();
+}
+
+
+int execve(const char *path, char *const argv[], char *const envp[]) {
+    GET_REAL_SYMBOL(execve);
+
+    realfd_teeall();
+
+    return _execve(path, argv, envp);
+}
+
+
+int execv(const char *path, char *const argv[]) {
+    GET_REAL_SYMBOL(execv);
+
+    realfd_teeall();
+
+    return _execv(path, argv);
+}
+
+
+int execvp(const char *file, char *const argv[]) {
+    GET_REAL_SYMBOL(execvp);
+
+    realfd_teeall();
+
+    return _execvp(file, argv);
+}
+
+
+#ifdef __linux
+int execvpe(const char *file, char *const argv[], char *const envp[]) {
+    GET_REAL_SYMBOL(execvpe);
+
+    realfd_teeall();
+
+    return _execvpe(file, argv, envp);
+}
+
+
+int fexecve(int fd, char *const argv[], char *const envp[]) {
+    GET_REAL_SYMBOL(fexecve);
+
+    realfd_teeall();
+
+    return _fexecve(fd, argv, envp);
+}
+#endif /* __linux */
+
+
+/* The execl() family collects its arguments on the stack, malloc() isn't
+   to be trusted in the child of a threaded process, and goes on as the
+   execv() one */
+static int execl_argc(va_list *ap) {
+    int argc = 1;
+
+    while(va_arg(*ap, char *)) {
+        argc++;
+    }
+
+    return argc;
+}
+
+
+static void execl_argv(char **argv, const char *arg0, va_list *ap) {
+
+    *argv = (char *)arg0;
+    while((*++argv = va_arg(*ap, char *)));
+}
+
+
+int execl(const char *path, const char *arg, ...) {
+    va_list ap;
+    int     argc;
+
+    va_start(ap, arg);
+    argc = execl_argc(&ap);
+    va_end(ap);
+
+    char *argv[argc + 1];
+
+    va_start(ap, arg);
+    execl_argv(argv, arg, &ap);
+    va_end(ap);
+
+    return execv(path, argv);
+}
+
+
+int execlp(const char *file, const char *arg, ...) {
+    va_list ap;
+    int     argc;
+
+    va_start(ap, arg);
+    argc = execl_argc(&ap);
+    va_end(ap);
+
+    char *argv[argc + 1];
+
+    va_start(ap, arg);
+    execl_argv(argv, arg, &ap);
+    va_end(ap);
+
+    return execvp(file, argv);
+}
+
+
+int execle(const char *path, const char *arg, ...) {
+    va_list     ap;
+    char *const *envp;
+    int         argc;
+
+    va_start(ap, arg);
+    argc = execl_argc(&ap);
+    va_end(ap);
+
+    char *argv[argc + 1];
+
+    va_start(ap, arg);
+    execl_argv(argv, arg, &ap);
+    envp = va_arg(ap, char *const *);
+    va_end(ap);
+
+    return execve(path, argv, envp);
+}
+
+
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
-    int fd = fileno(stream), rc;
+    int fd = fileno(stream), rc, backendfd;
     struct stat64 st;
+    cachefdinfo_t *ci;
+    size_t nread;
+    off64_t end;
 
 #ifdef DEBUG
     fprintf(stderr, "httpcacheopen: fread\n");
@@ -1144,6 +4050,7 @@ size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     if(fd == -1) {
         return 0;
     }
+    cachefd_reading(fd);
     rc = cache_file_complete(fd, &st);
     if(rc == -1) {
         return 0;
@@ -1160,11 +4067,41 @@ size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
             pos = 0;
         }
 
+        ci = cachefd_get(fd);
+        if(st.st_size < pos + (off_t) (size*nmemb) && size > 0 && ci &&
+                (backendfd = __atomic_load_n(&ci->backendfd,
+                                             __ATOMIC_ACQUIRE)) > 0)
+        {
+            size_t  tot = 0;
+            ssize_t amt;
+
+            /* Read it from the backend file instead, seeking drops
+               whatever the stream has buffered */
+            while(tot < size*nmemb) {
+                amt = pread64(backendfd - 1, (char *) ptr + tot,
+                              size*nmemb - tot, pos + tot);
+                if(amt <= 0) {
+                    break;
+                }
+                tot += amt;
+            }
+            if(tot >= size) {
+#ifdef DEBUG
+                fprintf(stderr, "httpcacheopen: fread: read %zu bytes from "
+                        "backend\n", tot);
+#endif
+                cachefd_put(ci);
+                fseeko64(stream, pos + tot/size*size, SEEK_SET);
+                return tot/size;
+            }
+        }
+        cachefd_put(ci);
+
         if(st.st_size < pos + (off_t) (size*nmemb)) {
 #ifdef DEBUG
             fprintf(stderr, "httpcacheopen: fread: Wait for data\n");
 #endif
-            rc = wait_for_io(fd, pos + size*nmemb, &st);
+            rc = wait_for_io(fd, pos + size*nmemb, &st, 0);
             if(rc == -1) {
                 return 0;
             }
@@ -1179,7 +4116,18 @@ size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
     fprintf(stderr, "httpcacheopen: fread: read %zu bytes\n", size*nmemb);
 #endif
 
-    return _fread(ptr, size, nmemb, stream);
+    nread = _fread(ptr, size, nmemb, stream);
+
+    /* The stream's own reads never go through read(), what it returns is
+       what the tee is after */
+    if(nread > 0 && (ci = cachefd_get(fd))) {
+        if(ci->teefd > 0 && (end = ftello64(stream)) != -1) {
+            realfd_tee(ci, fd, ptr, nread*size, end);
+        }
+        cachefd_put(ci);
+    }
+
+    return nread;
 }
 
 
@@ -1192,17 +4140,172 @@ int fclose(FILE *fp) {
 
     GET_REAL_SYMBOL(fclose);
 
-    if(fd < CACHE_MAXFD) {
-        /* Clear the entire struct to return it to default state */
-        memset(&cachefdinfo[fd].realst, 0, sizeof(struct stat64));
-    }
+    cachefd_close(fd);
 
     return _fclose(fp);
 }
 
 
+/* The C library opens directories without going through open(), so
+   openat() relative to dirfd() of them would never know where they are */
+DIR *opendir(const char *name) {
+    DIR *dirp;
+    int fd, err;
+
+    GET_REAL_SYMBOL(opendir);
+
+    if(path_notbackend(name) && !path_backendroot(name)) {
+        return _opendir(name);
+    }
+
+    fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1) {
+        return NULL;
+    }
+    dirp = fdopendir(fd);
+    if(!dirp) {
+        err = errno;
+        close(fd);
+        errno = err;
+    }
+
+    return dirp;
+}
+
+
+int closedir(DIR *dirp) {
+
+    GET_REAL_SYMBOL(closedir);
+
+    cachefd_close(dirfd(dirp));
+
+    return _closedir(dirp);
+}
+
+
+/* newfd is about to be replaced by a duplicate of oldfd, closing it */
+static void cachefd_replace(int oldfd, int newfd) {
+
+    if(oldfd == newfd) {
+        return;
+    }
+    copyd_closed(newfd);
+
+    /* Nothing to do, or the real call fails without closing newfd */
+    if(!cachefd_slot(newfd) || fcntl(oldfd, F_GETFD) == -1) {
+        return;
+    }
+
+    cachefd_close(newfd);
+}
+
+
+int dup(int oldfd) {
+    int newfd;
+
+    GET_REAL_SYMBOL(dup);
+
+    newfd = _dup(oldfd);
+    if(newfd != -1) {
+        cachefd_clear(newfd);
+        cachefd_dup(oldfd, newfd);
+    }
+
+    return newfd;
+}
+
+
+int dup2(int oldfd, int newfd) {
+    int rc;
+
+    GET_REAL_SYMBOL(dup2);
+
+    cachefd_replace(oldfd, newfd);
+    rc = _dup2(oldfd, newfd);
+    if(rc != -1 && oldfd != newfd) {
+        cachefd_dup(oldfd, newfd);
+    }
+
+    return rc;
+}
+
+
+#ifdef __linux
+int dup3(int oldfd, int newfd, int flags) {
+    int rc;
+
+    GET_REAL_SYMBOL(dup3);
+
+    cachefd_replace(oldfd, newfd);
+    rc = _dup3(oldfd, newfd, flags);
+    if(rc != -1) {
+        cachefd_dup(oldfd, newfd);
+    }
+
+    return rc;
+}
+#endif /* __linux */
+
+
+/* fcntl() passes its optional argument on as a pointer, whatever it is,
+   as does the C library itself. Only duplicating fds concerns us. */
+static int cache_fcntl(int (*fcntlfunc)(int, int, ...), int fd, int cmd,
+                       void *arg)
+{
+    int newfd;
+
+#ifdef F_DUPFD_CLOEXEC
+    if(cmd != F_DUPFD && cmd != F_DUPFD_CLOEXEC) {
+#else /* F_DUPFD_CLOEXEC */
+    if(cmd != F_DUPFD) {
+#endif /* F_DUPFD_CLOEXEC */
+        return fcntlfunc(fd, cmd, arg);
+    }
+
+    newfd = fcntlfunc(fd, cmd, (int) (intptr_t) arg);
+    if(newfd != -1) {
+        cachefd_clear(newfd);
+        cachefd_dup(fd, newfd);
+    }
+
+    return newfd;
+}
+
+
+int fcntl(int fd, int cmd, ...) {
+    va_list ap;
+    void    *arg;
+
+    GET_REAL_SYMBOL(fcntl);
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    return cache_fcntl(_fcntl, fd, cmd, arg);
+}
+
+
+#ifdef __linux
+int fcntl64(int fd, int cmd, ...) {
+    va_list ap;
+    void    *arg;
+
+    GET_REAL_SYMBOL(fcntl64);
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    return cache_fcntl(_fcntl64, fd, cmd, arg);
+}
+#endif /* __linux */
+
+
 #ifdef __linux
 int __fxstat64(int __ver, int fd, struct stat64 *buf) {
+    cachefdinfo_t   *ci;
+    int             rc;
 
 #ifdef DEBUG
     fprintf(stderr, "httpcacheopen: fstat64 fd=%d\n", fd);
@@ -1214,49 +4317,54 @@ int __fxstat64(int __ver, int fd, struct stat64 *buf) {
         exit(2);
     }
 
-    if(fd < CACHE_MAXFD && cachefdinfo[fd].realst.st_size > 0) {
-        /* Copy the struct for the real file straight off */
-        memcpy(buf, &cachefdinfo[fd].realst, sizeof(struct stat64));
-        return 0;
+    rc = realfstat64(fd, buf);
+    if(rc == 0 && (ci = cachefd_spoofing(fd))) {
+        CACHEFD_SPOOF(buf, ci);
+        cachefd_put(ci);
     }
 
-    return realfstat64(fd, buf);
+    return rc;
 }
+#endif /* __linux */
 
 
-static int realfstat64(int fd, struct stat64 *buf) {
-    GET_REAL_SYMBOL(__fxstat64);
-    return ___fxstat64(_STAT_VER, fd, buf);
-}
-#else /* __linux */
 int fstat64(int fd, struct stat64 *buf) {
+    cachefdinfo_t   *ci;
+    int             rc;
 
 #ifdef DEBUG
     fprintf(stderr, "httpcacheopen: fstat64 fd=%d\n", fd);
 #endif
 
-    if(fd < CACHE_MAXFD && cachefdinfo[fd].realst.st_size > 0) {
-        /* Copy the struct for the real file straight off */
-        memcpy(buf, &cachefdinfo[fd].realst, sizeof(struct stat64));
-        return 0;
+    rc = realfstat64(fd, buf);
+    if(rc == 0 && (ci = cachefd_spoofing(fd))) {
+        CACHEFD_SPOOF(buf, ci);
+        cachefd_put(ci);
     }
 
-    return realfstat64(fd, buf);
+    return rc;
 }
 
 
 static int realfstat64(int fd, struct stat64 *buf) {
+#ifdef __linux
+    /* Before glibc 2.33 there's only __fxstat64 */
+    if(!_fstat64) {
+        GET_REAL_SYMBOL(__fxstat64);
+        return ___fxstat64(_STAT_VER, fd, buf);
+    }
+#endif /* __linux */
     GET_REAL_SYMBOL(fstat64);
     return _fstat64(fd, buf);
 }
-#endif /* __linux */
 
 
 #ifndef WRAPPER_STAT_NOWRAP /* FIXME: Solaris kludge */
 
 #ifdef __linux
-
 int __fxstat(int __ver, int fd, struct stat *buf) {
+    cachefdinfo_t   *ci;
+    int             rc;
 
 #ifdef DEBUG
     fprintf(stderr, "httpcacheopen: fstat fd=%d\n", fd);
@@ -1270,39 +4378,20 @@ int __fxstat(int __ver, int fd, struct stat *buf) {
         exit(2);
     }
 
-    if(fd < CACHE_MAXFD && cachefdinfo[fd].realst.st_size > 0) {
-        if(sizeof(off_t) == sizeof(off64_t) 
-                && sizeof(struct stat) == sizeof(struct stat64)) 
-        {
-            /* Boldly assume the structs are identical */
-            memcpy(buf, &cachefdinfo[fd].realst, sizeof(struct stat64));
-        }
-        else {
-            /* We can't memcpy the real file stat struct, different types */
-            memset(buf, 0, sizeof(struct stat));
-            buf->st_dev = cachefdinfo[fd].realst.st_dev;
-            buf->st_ino = cachefdinfo[fd].realst.st_ino;
-            buf->st_mode = cachefdinfo[fd].realst.st_mode;
-            buf->st_nlink = cachefdinfo[fd].realst.st_nlink;
-            buf->st_uid = cachefdinfo[fd].realst.st_uid;
-            buf->st_gid = cachefdinfo[fd].realst.st_gid;
-            buf->st_rdev = cachefdinfo[fd].realst.st_rdev;
-            buf->st_size = cachefdinfo[fd].realst.st_size;
-            buf->st_blksize = cachefdinfo[fd].realst.st_blksize;
-            buf->st_blocks = cachefdinfo[fd].realst.st_blocks;
-            buf->st_atime = cachefdinfo[fd].realst.st_atime;
-            buf->st_mtime = cachefdinfo[fd].realst.st_mtime;
-            buf->st_ctime = cachefdinfo[fd].realst.st_ctime;
-        }
-        return 0;
+    rc = ___fxstat(_STAT_VER, fd, buf);
+    if(rc == 0 && (ci = cachefd_spoofing(fd))) {
+        CACHEFD_SPOOF(buf, ci);
+        cachefd_put(ci);
     }
 
-    return ___fxstat(_STAT_VER, fd, buf);
+    return rc;
 }
+#endif /* __linux */
 
-#else /* __linux */
 
 int fstat(int fd, struct stat *buf) {
+    cachefdinfo_t   *ci;
+    int             rc;
 
 #ifdef DEBUG
     fprintf(stderr, "httpcacheopen: fstat fd=%d\n", fd);
@@ -1310,49 +4399,29 @@ int fstat(int fd, struct stat *buf) {
 
     GET_REAL_SYMBOL(fstat);
 
-    if(fd < CACHE_MAXFD && cachefdinfo[fd].realst.st_size > 0) {
-        if(sizeof(off_t) == sizeof(off64_t) 
-                && sizeof(struct stat) == sizeof(struct stat64)) 
-        {
-            /* Boldly assume the structs are identical */
-            memcpy(buf, &cachefdinfo[fd].realst, sizeof(struct stat64));
-        }
-        else {
-            /* We can't memcpy the real file stat struct, different types */
-            memset(buf, 0, sizeof(struct stat));
-            buf->st_dev = cachefdinfo[fd].realst.st_dev;
-            buf->st_ino = cachefdinfo[fd].realst.st_ino;
-            buf->st_mode = cachefdinfo[fd].realst.st_mode;
-            buf->st_nlink = cachefdinfo[fd].realst.st_nlink;
-            buf->st_uid = cachefdinfo[fd].realst.st_uid;
-            buf->st_gid = cachefdinfo[fd].realst.st_gid;
-            buf->st_rdev = cachefdinfo[fd].realst.st_rdev;
-            buf->st_size = cachefdinfo[fd].realst.st_size;
-            buf->st_blksize = cachefdinfo[fd].realst.st_blksize;
-            buf->st_blocks = cachefdinfo[fd].realst.st_blocks;
-            buf->st_atime = cachefdinfo[fd].realst.st_atime;
-            buf->st_mtime = cachefdinfo[fd].realst.st_mtime;
-            buf->st_ctime = cachefdinfo[fd].realst.st_ctime;
-        }
-        return 0;
+    rc = _fstat(fd, buf);
+    if(rc == 0 && (ci = cachefd_spoofing(fd))) {
+        CACHEFD_SPOOF(buf, ci);
+        cachefd_put(ci);
     }
 
-    return _fstat(fd, buf);
+    return rc;
 }
-#endif /* __linux */
 
 #endif /* WRAPPER_STAT_NOWRAP */
 
 #if defined(__sun) || defined(__linux)
 ssize_t sendfile64(int out_fd, int in_fd, off64_t *off, size_t len) {
     struct stat64 st;
-    off64_t realoff, avail;
+    off64_t realoff, avail, sendoff;
     ssize_t amt, tot=0;
-    int complete;
+    int complete, sendfd;
+    cachefdinfo_t *ci = NULL;
 
 
     GET_REAL_SYMBOL(sendfile64);
 
+    cachefd_reading(in_fd);
     if(off) {
         realoff = *off;
     }
@@ -1369,24 +4438,42 @@ ssize_t sendfile64(int out_fd, int in_fd, off64_t *off, size_t len) {
 #endif
 
     do {
+        sendfd = in_fd;
+        sendoff = realoff;
         complete = cache_file_complete(in_fd, &st);
         if(complete == -1) {
             tot = -1;
             goto out;
         }
         else if(complete == 0) {
+            cachefd_put(ci);
+            ci = cachefd_get(in_fd);
+            if(!ci || realoff >= ci->size) {
+                /* At the end of the real file */
+                goto out;
+            }
             avail = st.st_size - realoff;
             if(avail <= 0) {
+                /* Might have been fetched out of order */
+                avail = cachefd_rangeavail(in_fd, realoff, &st);
+            }
+            if(avail <= 0 && ci->backendfd > 0) {
+                /* Send it from the backend file, the copy can catch up
+                   in the meantime */
+                sendfd = ci->backendfd - 1;
+                avail = MIN(len, CACHE_BACKEND_CHUNK);
+            }
+            else if(avail <= 0) {
 #ifdef DEBUG
                 fprintf(stderr, "httpcacheopen: sendfile64 outfd=%d infd=%d "
                                 "off=%lld size=%zu: No data available\n", 
                                 out_fd, in_fd, (long long)realoff, len);
 #endif
-                /* FIXME: Non-blocking based on the input file is probably
-                   a really bad idea since it will probably spin like
-                   crazy unless we catch poll/select... */
+                /* Non-blocking is based on the output fd, poll() and
+                   friends won't report it writable until there is data */
                 int rc, flags = fcntl(out_fd, F_GETFL);
                 if(flags < 0) {
+                    cachefd_put(ci);
                     return -1;
                 }
                 if(flags & O_NONBLOCK) {
@@ -1394,12 +4481,18 @@ ssize_t sendfile64(int out_fd, int in_fd, off64_t *off, size_t len) {
                     fprintf(stderr, "httpcacheopen: sendfile64 outfd=%d infd=%d"
                                     ": Would block\n", out_fd, in_fd);
 #endif
-                    errno = EAGAIN;
-                    tot = -1;
+                    cachefd_want(in_fd, realoff, &st);
+#ifdef __linux
+                    cachefd_stall(out_fd, in_fd, realoff);
+#endif /* __linux */
+                    if(tot == 0) {
+                        errno = EAGAIN;
+                        tot = -1;
+                    }
                     goto out;
                 }
 
-                rc = wait_for_io(in_fd, realoff, &st);
+                rc = wait_for_io(in_fd, realoff, &st, 1);
                 if(rc == -1) {
                     tot = -1;
                     goto out;
@@ -1410,16 +4503,40 @@ ssize_t sendfile64(int out_fd, int in_fd, off64_t *off, size_t len) {
                     goto out;
                 }
                 avail = st.st_size - realoff;
+                if(avail <= 0) {
+                    avail = cachefd_rangeavail(in_fd, realoff, &st);
+                }
+            }
+            if(sendfd == in_fd) {
+                sendfd = cachefd_rangefd(in_fd, &sendoff, &st);
             }
         }
         else {
             avail = len;
         }
-        amt = _sendfile64(out_fd, in_fd, &realoff, MIN((off64_t)len,avail));
+        amt = _sendfile64(out_fd, sendfd, &sendoff, MIN((off64_t)len,avail));
+        if(amt > 0) {
+            realoff += amt;
+        }
+        else if(amt == 0 && sendfd != in_fd && ci &&
+                sendfd == ci->backendfd - 1)
+        {
+            /* Backend file shorter than expected, wait for the copy */
+            cachefd_dropbackend(ci);
+            continue;
+        }
         if(amt == -1) {
-            tot = -1;
+            /* Report what we managed to send before the error */
+            if(tot == 0) {
+                tot = -1;
+            }
             goto out;
         }
+#ifdef __linux
+        if(__atomic_load_n(&cachefd_stalled, __ATOMIC_RELAXED)) {
+            cachefd_unstall(out_fd);
+        }
+#endif /* __linux */
 #ifdef DEBUG
         fprintf(stderr, "httpcacheopen: sendfile64 outfd=%d infd=%d off=%lld"
                 ": sent %zd\n", out_fd, in_fd, (long long)realoff, amt);
@@ -1438,9 +4555,16 @@ out:
     fprintf(stderr, "httpcacheopen: sendfile64 outfd=%d infd=%d: Done\n",
             out_fd, in_fd);
 #endif
+    cachefd_put(ci);
     if(off) {
         *off = realoff;
     }
+    else {
+        /* We always send at an explicit offset, move the file offset
+           along as sendfile() would */
+        lseek64(in_fd, realoff, SEEK_SET);
+    }
+    realfd_progress(in_fd, NULL, tot, realoff);
     return tot;
 }
 
@@ -1583,7 +4707,7 @@ ssize_t send_file(int *out_fd, struct sf_parms *sf_iobuf, uint_t flags)
         avail = st.st_size - sf_iobuf->file_offset;
         if(avail <= 0) {
             int rc = wait_for_io(sf_iobuf->file_descriptor,
-                                 sf_iobuf->file_offset, &st);
+                                 sf_iobuf->file_offset, &st, 0);
             if(rc == -1) {
                 ret = -1;
                 goto out;